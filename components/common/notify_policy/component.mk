@@ -0,0 +1,3 @@
+COMPONENT_ADD_INCLUDEDIRS = .
+COMPONENT_SRCDIRS = .
+COMPONENT_DEPENDS = homekit
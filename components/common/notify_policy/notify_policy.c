@@ -0,0 +1,93 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <math.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "notify_policy.h"
+
+// Absorbs float rounding, 21.1 - 21.0 must count as 0.1
+#define DELTA_EPSILON 0.0001
+
+static uint32_t total_sent = 0;
+static uint32_t total_suppressed = 0;
+
+void notify_policy_init(notify_policy_t *policy, notify_policy_config_t config) {
+        memset(policy, 0, sizeof(*policy));
+        policy->config = config;
+}
+
+static float value_as_float(homekit_value_t value) {
+        if (value.format == homekit_format_float) {
+                return value.float_value;
+        }
+        if (value.format == homekit_format_bool) {
+                return value.bool_value ? 1 : 0;
+        }
+        return value.int_value;
+}
+
+bool notify_policy_update(notify_policy_t *policy, homekit_characteristic_t *ch, homekit_value_t value) {
+        uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+        float v = value_as_float(value);
+
+        ch->value = value;
+
+        bool notify = !policy->notified;
+        if (!notify) {
+                uint32_t elapsed = now - policy->last_time;
+                float delta = fabsf(v - policy->last_value);
+
+                if (policy->config.max_interval && elapsed >= policy->config.max_interval) {
+                        notify = true;
+                } else if (delta > 0 && delta + DELTA_EPSILON >= policy->config.min_delta &&
+                           elapsed >= policy->config.min_interval) {
+                        notify = true;
+                }
+        }
+
+        if (!notify) {
+                policy->suppressed++;
+                total_suppressed++;
+                return false;
+        }
+
+        policy->notified = true;
+        policy->last_value = v;
+        policy->last_time = now;
+        policy->sent++;
+        total_sent++;
+
+        homekit_characteristic_notify(ch, ch->value);
+
+        return true;
+}
+
+uint32_t notify_policy_total_sent() {
+        return total_sent;
+}
+
+uint32_t notify_policy_total_suppressed() {
+        return total_suppressed;
+}
@@ -0,0 +1,69 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <homekit/homekit.h>
+
+// Decides when a new sensor value is worth a HomeKit notification.
+//
+// A value is notified when it moved at least min_delta from the last
+// notified value and min_interval has passed since then, or when
+// max_interval has passed regardless (heartbeat). The characteristic value
+// itself is always updated so reads return the latest sample.
+
+typedef struct {
+        float min_delta;
+        // times in milliseconds, 0 disables
+        uint32_t min_interval;
+        uint32_t max_interval;
+} notify_policy_config_t;
+
+#define NOTIFY_POLICY_CONFIG(...) \
+        (notify_policy_config_t) { \
+                .min_delta = 0, \
+                .min_interval = 0, \
+                .max_interval = 0, \
+                __VA_ARGS__ \
+        }
+
+typedef struct {
+        notify_policy_config_t config;
+        bool notified;
+        float last_value;
+        uint32_t last_time;
+
+        uint32_t sent;
+        uint32_t suppressed;
+} notify_policy_t;
+
+void notify_policy_init(notify_policy_t *policy, notify_policy_config_t config);
+
+// Set the characteristic value and notify if the policy allows it.
+// Returns true if a notification was sent.
+bool notify_policy_update(notify_policy_t *policy, homekit_characteristic_t *ch, homekit_value_t value);
+
+// Totals over all policies
+uint32_t notify_policy_total_sent();
+uint32_t notify_policy_total_suppressed();
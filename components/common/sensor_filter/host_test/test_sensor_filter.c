@@ -0,0 +1,176 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+// Host-side test for sensor_filter, run against noisy DHT traces.
+//
+//   cc -Wall -I.. -o test_sensor_filter test_sensor_filter.c ../sensor_filter.c -lm
+//   ./test_sensor_filter
+//
+// Exits non-zero when a check fails. The traces follow the failure modes
+// seen in DHT22/AM2302 logs: a garbage first read after power-up, a flipped
+// high byte (+25.6), a flipped sign bit, zero reads and readings stuck at
+// the top of the range, on top of the normal 0.1 step jitter.
+
+#include <math.h>
+#include <stdio.h>
+
+#include "sensor_filter.h"
+
+#define TRACE_LENGTH(trace) (sizeof(trace) / sizeof(*trace))
+
+static int failures;
+
+#define CHECK(condition, ...) \
+        do { \
+                if (!(condition)) { \
+                        printf("FAIL %s:%d: ", __func__, __LINE__); \
+                        printf(__VA_ARGS__); \
+                        printf("\n"); \
+                        failures++; \
+                } \
+        } while (0)
+
+// Temperature in C, room at about 21.4C
+static const float trace_power_up[] = {
+        85.0, 21.3, 21.4, 21.4, 21.3, 21.4, 21.5, 21.4, 21.4, 21.3,
+};
+
+static const float trace_spikes[] = {
+        21.4, 21.4, 21.5, 21.4, 21.3, 47.0, 21.4, 21.4, 21.5, 21.4,
+        -21.4, 21.5, 21.4, 21.4, 0.0, 21.4, 21.3, 47.1, 21.4, 21.4,
+        21.5, 21.4, 21.4, 21.3, 21.4, -40.0, 21.4, 21.5, 21.4, 21.4,
+};
+
+// Two bad reads inside one window, still outvoted by a window of 5
+static const float trace_double_spike[] = {
+        21.4, 21.4, 21.5, 21.4, 21.4, 47.0, 21.4, 0.0, 21.4, 21.5,
+        21.4, 21.4, 21.3, 21.4, 21.4,
+};
+
+// Heater switching on, the room rises by 3C
+static const float trace_step[] = {
+        20.0, 20.0, 20.1, 20.0, 20.0, 20.0, 23.0, 23.0, 23.1, 23.0,
+        23.0, 47.0, 23.0, 23.0, 23.1, 23.0, 23.0, 23.0, 23.0, 23.0,
+        23.0, 23.0, 23.0, 23.0, 23.0,
+};
+
+// Relative humidity in %, with zero reads and a reading stuck at 99.9
+static const float trace_humidity[] = {
+        48.2, 48.3, 48.2, 0.0, 48.3, 48.4, 99.9, 48.3, 48.2, 48.3,
+        48.3, 0.0, 48.2, 48.3, 48.4, 48.3, 99.9, 48.3, 48.2, 48.2,
+};
+
+// Feeds trace and checks every valid output stays within tolerance of
+// truth. Returns the number of samples before the output was valid.
+static int run_trace(const char *name, const float *trace, int length,
+                     sensor_filter_config_t config, float truth, float tolerance) {
+        sensor_filter_t filter;
+        sensor_filter_init(&filter, config);
+
+        int warm_up = -1;
+        for (int i=0; i < length; i++) {
+                float value = sensor_filter_add(&filter, trace[i]);
+                if (!sensor_filter_valid(&filter)) {
+                        continue;
+                }
+                if (warm_up < 0) {
+                        warm_up = i;
+                }
+                CHECK(fabsf(value - truth) <= tolerance,
+                      "%s: sample %d (raw %.1f) gave %.2f, expected %.1f +- %.2f",
+                      name, i, trace[i], value, truth, tolerance);
+        }
+        return warm_up;
+}
+
+static void test_window_size() {
+        sensor_filter_t filter;
+
+        sensor_filter_init(&filter, SENSOR_FILTER_CONFIG(.window = 4));
+        CHECK(filter.config.window == 3, "window 4 became %d", filter.config.window);
+        sensor_filter_init(&filter, SENSOR_FILTER_CONFIG(.window = 8));
+        CHECK(filter.config.window == SENSOR_FILTER_MAX_WINDOW, "window 8 became %d", filter.config.window);
+        sensor_filter_init(&filter, SENSOR_FILTER_CONFIG(.window = 0));
+        CHECK(filter.config.window == 1, "window 0 became %d", filter.config.window);
+        sensor_filter_init(&filter, SENSOR_FILTER_CONFIG(.alpha = 0));
+        CHECK(filter.config.alpha == 1, "alpha 0 became %.2f", filter.config.alpha);
+}
+
+static void test_power_up() {
+        sensor_filter_config_t config = SENSOR_FILTER_CONFIG();
+        int warm_up = run_trace("power up", trace_power_up, TRACE_LENGTH(trace_power_up), config, 21.4, 0.15);
+        CHECK(warm_up == config.window - 1, "valid after %d samples", warm_up + 1);
+
+        // A spike among the first samples is never published, also not
+        // half averaged with a good read
+        sensor_filter_t filter;
+        sensor_filter_init(&filter, config);
+        for (int i=0; i < 2; i++) {
+                float value = sensor_filter_add(&filter, (const float[]) { 85.0, 21.0 }[i]);
+                CHECK(!sensor_filter_valid(&filter), "valid after %d samples", i + 1);
+                CHECK(value == 85.0 || value == 21.0, "warm-up value %.2f mixes samples", value);
+        }
+}
+
+static void test_spikes() {
+        run_trace("spikes", trace_spikes, TRACE_LENGTH(trace_spikes), SENSOR_FILTER_CONFIG(), 21.4, 0.15);
+        run_trace("double spike", trace_double_spike, TRACE_LENGTH(trace_double_spike), SENSOR_FILTER_CONFIG(), 21.4, 0.15);
+        run_trace("humidity", trace_humidity, TRACE_LENGTH(trace_humidity), SENSOR_FILTER_CONFIG(), 48.3, 0.15);
+        // No smoothing, the median alone has to drop every spike
+        run_trace("median only", trace_spikes, TRACE_LENGTH(trace_spikes), SENSOR_FILTER_CONFIG(.alpha = 1), 21.4, 0.15);
+}
+
+static void test_step() {
+        sensor_filter_t filter;
+        sensor_filter_init(&filter, SENSOR_FILTER_CONFIG());
+
+        int settled = -1;
+        float previous = 0;
+        for (int i=0; i < TRACE_LENGTH(trace_step); i++) {
+                float value = sensor_filter_add(&filter, trace_step[i]);
+                if (!sensor_filter_valid(&filter)) {
+                        continue;
+                }
+                CHECK(value >= 19.9 && value <= 23.1, "sample %d gave %.2f outside the step", i, value);
+                CHECK(value >= previous - 0.1, "sample %d fell from %.2f to %.2f during a rise", i, previous, value);
+                previous = value;
+                if (settled < 0 && fabsf(value - 23.0) <= 0.1) {
+                        settled = i;
+                }
+        }
+        // The median delays the step by half a window, the average adds a
+        // few more samples
+        CHECK(settled >= 0 && settled - 6 <= 12, "settled %d samples after the step", settled - 6);
+}
+
+int main() {
+        test_window_size();
+        test_power_up();
+        test_spikes();
+        test_step();
+
+        if (failures) {
+                printf("%d checks failed\n", failures);
+                return 1;
+        }
+        printf("All checks passed\n");
+        return 0;
+}
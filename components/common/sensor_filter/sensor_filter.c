@@ -0,0 +1,82 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <string.h>
+
+#include "sensor_filter.h"
+
+void sensor_filter_init(sensor_filter_t *filter, sensor_filter_config_t config) {
+        memset(filter, 0, sizeof(*filter));
+
+        if (config.window < 1) {
+                config.window = 1;
+        } else if (config.window > SENSOR_FILTER_MAX_WINDOW) {
+                config.window = SENSOR_FILTER_MAX_WINDOW;
+        }
+        // An even window has no middle sample, averaging the middle pair
+        // lets one bad read through by half
+        if (config.window % 2 == 0) {
+                config.window--;
+        }
+        if (config.alpha <= 0 || config.alpha > 1) {
+                config.alpha = 1;
+        }
+        filter->config = config;
+}
+
+static float median(const float *samples, uint8_t count) {
+        float sorted[SENSOR_FILTER_MAX_WINDOW];
+
+        // Insertion sort, the window is tiny
+        for (int i=0; i < count; i++) {
+                float sample = samples[i];
+                int j = i;
+                for (; j > 0 && sorted[j-1] > sample; j--) {
+                        sorted[j] = sorted[j-1];
+                }
+                sorted[j] = sample;
+        }
+
+        // The lower median while an odd window is filling
+        return sorted[(count - 1) / 2];
+}
+
+float sensor_filter_add(sensor_filter_t *filter, float sample) {
+        filter->samples[filter->head] = sample;
+        filter->head = (filter->head + 1) % filter->config.window;
+        if (filter->count < filter->config.window) {
+                filter->count++;
+        }
+
+        float m = median(filter->samples, filter->count);
+        if (!sensor_filter_valid(filter)) {
+                return m;
+        }
+
+        // The average starts from the first median of a full window
+        if (!filter->started) {
+                filter->value = m;
+                filter->started = true;
+        } else {
+                filter->value += filter->config.alpha * (m - filter->value);
+        }
+        return filter->value;
+}
@@ -0,0 +1,66 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Median-of-N spike rejection followed by an exponential moving average.
+//
+// Samples go into a fixed ring buffer, the median of the last window
+// samples drops single bad reads and the EMA smooths what is left. Until
+// the window has filled the median cannot outvote a bad read, so nothing
+// is valid before then. Tested on a host by host_test/test_sensor_filter.c.
+
+#define SENSOR_FILTER_MAX_WINDOW 7
+
+typedef struct {
+        uint8_t window;  // odd, at most SENSOR_FILTER_MAX_WINDOW, an even size is lowered by one
+        float alpha;     // weight of a new median in the average, 0 < alpha <= 1
+} sensor_filter_config_t;
+
+#define SENSOR_FILTER_CONFIG(...) \
+        (sensor_filter_config_t) { \
+                .window = 5, \
+                .alpha = 0.3, \
+                __VA_ARGS__ \
+        }
+
+typedef struct {
+        sensor_filter_config_t config;
+        float samples[SENSOR_FILTER_MAX_WINDOW];
+        uint8_t head;
+        uint8_t count;
+        bool started;
+        float value;
+} sensor_filter_t;
+
+void sensor_filter_init(sensor_filter_t *filter, sensor_filter_config_t config);
+
+// Add a raw sample and return the filtered value. While the window is
+// filling this is the lower median of the samples so far, only publish it
+// once sensor_filter_valid() is true.
+float sensor_filter_add(sensor_filter_t *filter, float sample);
+
+static inline bool sensor_filter_valid(const sensor_filter_t *filter) {
+        return filter->count == filter->config.window;
+}
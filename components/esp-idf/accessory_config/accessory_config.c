@@ -0,0 +1,189 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accessory_config.h"
+
+static uint16_t read_u16(const uint8_t *p) {
+        return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_u32(const uint8_t *p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+uint32_t accessory_config_crc32(const uint8_t *data, size_t size) {
+        // Bitwise, the blob is parsed once at boot
+        uint32_t crc = 0xffffffff;
+        for (size_t i=0; i < size; i++) {
+                crc ^= data[i];
+                for (int bit=0; bit < 8; bit++) {
+                        crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+                }
+        }
+        return ~crc;
+}
+
+// Walks the records, counting relays and string bytes when config is NULL
+// and filling config otherwise. Returns -1 on a malformed record.
+static int parse_records(const uint8_t *payload, size_t length,
+                         accessory_config_t *config, char *strings,
+                         int *relay_count, size_t *strings_size) {
+        size_t offset = 0;
+        int relays = 0;
+        size_t string_bytes = 0;
+
+        while (offset < length) {
+                if (length - offset < 2) {
+                        return -1;
+                }
+                uint8_t type = payload[offset];
+                uint8_t size = payload[offset + 1];
+                const uint8_t *value = payload + offset + 2;
+                if (length - offset - 2 < size) {
+                        return -1;
+                }
+                offset += 2 + size;
+
+                const char **string = NULL;
+                const uint8_t *string_value = value;
+                size_t string_size = size;
+
+                switch (type) {
+                case ACCESSORY_CONFIG_NAME:
+                        string = config ? &config->name : NULL;
+                        break;
+                case ACCESSORY_CONFIG_MANUFACTURER:
+                        string = config ? &config->manufacturer : NULL;
+                        break;
+                case ACCESSORY_CONFIG_SERIAL:
+                        string = config ? &config->serial : NULL;
+                        break;
+                case ACCESSORY_CONFIG_MODEL:
+                        string = config ? &config->model : NULL;
+                        break;
+                case ACCESSORY_CONFIG_OUTPUT:
+                        if (size != 1 || value[0] > RELAY_OUTPUT_SHIFT_REGISTER) {
+                                return -1;
+                        }
+                        if (config) {
+                                config->output = value[0];
+                        }
+                        continue;
+                case ACCESSORY_CONFIG_RELAY:
+                        if (size < 3 || value[1] > RELAY_TYPE_OUTLET) {
+                                return -1;
+                        }
+                        if (relays == ACCESSORY_CONFIG_MAX_RELAYS) {
+                                return -1;
+                        }
+                        if (config) {
+                                relay_desc_t *relay = &config->relays[relays];
+                                relay->gpio = (int8_t) value[0];
+                                relay->type = value[1];
+                                relay->inverted = value[2] & ACCESSORY_CONFIG_RELAY_INVERTED;
+                                relay->name = NULL;
+                                string = (size > 3) ? &relay->name : NULL;
+                        }
+                        relays++;
+                        string_value = value + 3;
+                        string_size = size - 3;
+                        break;
+                default:
+                        continue;
+                }
+
+                if (!string_size) {
+                        continue;
+                }
+                if (string) {
+                        memcpy(strings + string_bytes, string_value, string_size);
+                        strings[string_bytes + string_size] = 0;
+                        *string = strings + string_bytes;
+                }
+                string_bytes += string_size + 1;
+        }
+
+        *relay_count = relays;
+        *strings_size = string_bytes;
+        return 0;
+}
+
+accessory_config_t *accessory_config_parse(const uint8_t *data, size_t size, relay_output_type_t output) {
+        if (!data || size < ACCESSORY_CONFIG_HEADER_SIZE) {
+                return NULL;
+        }
+        if (read_u32(data) != ACCESSORY_CONFIG_MAGIC) {
+                printf("Accessory config: no config found\n");
+                return NULL;
+        }
+        if (data[4] != ACCESSORY_CONFIG_VERSION) {
+                printf("Accessory config: unsupported version %d\n", data[4]);
+                return NULL;
+        }
+
+        uint16_t length = read_u16(data + 6);
+        const uint8_t *payload = data + ACCESSORY_CONFIG_HEADER_SIZE;
+        if (length > size - ACCESSORY_CONFIG_HEADER_SIZE) {
+                printf("Accessory config: truncated\n");
+                return NULL;
+        }
+        if (accessory_config_crc32(payload, length) != read_u32(data + 8)) {
+                printf("Accessory config: CRC mismatch\n");
+                return NULL;
+        }
+
+        int relay_count;
+        size_t strings_size;
+        if (parse_records(payload, length, NULL, NULL, &relay_count, &strings_size)) {
+                printf("Accessory config: malformed record\n");
+                return NULL;
+        }
+
+        // config | relays[relay_count] | strings
+        size_t relays_offset = sizeof(accessory_config_t);
+        size_t strings_offset = relays_offset + relay_count * sizeof(relay_desc_t);
+        uint8_t *arena = calloc(1, strings_offset + strings_size);
+        if (!arena) {
+                return NULL;
+        }
+
+        accessory_config_t *config = (accessory_config_t *) arena;
+        config->category = data[5];
+        config->output = RELAY_OUTPUT_GPIO;
+        config->relays = (relay_desc_t *) (arena + relays_offset);
+        parse_records(payload, length, config, (char *) (arena + strings_offset),
+                      &config->relay_count, &strings_size);
+
+        // Relay numbers mean GPIOs for one and chain bits for the other
+        if (config->output != output) {
+                printf("Accessory config: built for %s outputs, the firmware drives %s\n",
+                       config->output == RELAY_OUTPUT_SHIFT_REGISTER ? "shift register" : "GPIO",
+                       output == RELAY_OUTPUT_SHIFT_REGISTER ? "shift register" : "GPIO");
+                free(config);
+                return NULL;
+        }
+
+        return config;
+}
@@ -0,0 +1,84 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <relay_bank.h>
+
+// Accessory description loaded from a flash partition instead of compiled
+// in, so one firmware image serves boards with different relays and names.
+//
+// The blob is generated and checked on the host by accessory_config.py.
+// All integers are little endian:
+//
+//   header   magic "ACFG" | version u8 | category u8 | length u16 | crc32 u32
+//   payload  length bytes of records, crc32 is the zlib CRC-32 of them
+//   record   type u8 | size u8 | value[size]
+//
+// Unknown record types are skipped so newer tools can add fields. A blob
+// without an output record is for relays on GPIOs.
+
+#define ACCESSORY_CONFIG_MAGIC 0x47464341  // "ACFG"
+#define ACCESSORY_CONFIG_VERSION 1
+#define ACCESSORY_CONFIG_HEADER_SIZE 12
+#define ACCESSORY_CONFIG_MAX_RELAYS 64
+
+typedef enum {
+        ACCESSORY_CONFIG_NAME = 0x01,           // string
+        ACCESSORY_CONFIG_MANUFACTURER = 0x02,   // string
+        ACCESSORY_CONFIG_SERIAL = 0x03,         // string
+        ACCESSORY_CONFIG_MODEL = 0x04,          // string
+        ACCESSORY_CONFIG_OUTPUT = 0x05,         // relay_output_type_t u8
+        ACCESSORY_CONFIG_RELAY = 0x10,          // gpio i8 | type u8 | flags u8 | name
+} accessory_config_record_t;
+
+#define ACCESSORY_CONFIG_RELAY_INVERTED (1 << 0)
+
+typedef struct {
+        homekit_accessory_category_t category;
+        // NULL when not in the blob
+        const char *name;
+        const char *manufacturer;
+        const char *serial;
+        const char *model;
+
+        relay_output_type_t output;
+        int relay_count;
+        relay_desc_t *relays;
+} accessory_config_t;
+
+// Parse a blob into one allocation holding the config, the relay table and
+// the strings. Returns NULL when the blob is missing, corrupt or invalid, or
+// was built for relays on another output type than the firmware drives.
+// Release with free().
+accessory_config_t *accessory_config_parse(const uint8_t *data, size_t size, relay_output_type_t output);
+
+uint32_t accessory_config_crc32(const uint8_t *data, size_t size);
+
+#ifdef ESP_PLATFORM
+
+// Read and parse the blob from the data partition with the given label
+accessory_config_t *accessory_config_load(const char *label, relay_output_type_t output);
+
+#endif
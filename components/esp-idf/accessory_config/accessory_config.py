@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+#
+# Copyright 2022 Achim Pieters | StudioPieters®
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+# WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+"""Build, check and dump accessory config blobs (see accessory_config.h).
+
+    accessory_config.py build accessory.json accessory.bin
+    accessory_config.py check accessory.json
+    accessory_config.py dump accessory.bin
+
+Write the blob to the board without reflashing the firmware:
+
+    parttool.py write_partition --partition-name=accessory --input=accessory.bin
+
+The JSON file looks like:
+
+    {
+        "category": "other",
+        "name": "Relays",
+        "manufacturer": "StudioPieters®",
+        "serial": "NLDA4SQN1466",
+        "model": "SD466NL/A",
+        "relays": [
+            {"gpio": 12, "name": "Kitchen", "type": "lightbulb"},
+            {"gpio": 5, "type": "outlet", "inverted": true}
+        ]
+    }
+
+For relays on 74HC595 shift registers (CONFIG_RELAY_SHIFT_REGISTER) add
+"output": "shift_register", gpio is then the output bit in the chain. The
+output type is stored in the blob and firmware built for the other type
+ignores the blob.
+"""
+
+import argparse
+import json
+import struct
+import sys
+import zlib
+
+MAGIC = b'ACFG'
+VERSION = 1
+HEADER = struct.Struct('<4sBBHI')
+MAX_RELAYS = 64
+MAX_NAME = 64          # HomeKit limit for the Name characteristic
+MAX_PARTITION = 0x1000
+
+RECORD_NAME = 0x01
+RECORD_MANUFACTURER = 0x02
+RECORD_SERIAL = 0x03
+RECORD_MODEL = 0x04
+RECORD_OUTPUT = 0x05
+RECORD_RELAY = 0x10
+
+STRING_RECORDS = {
+    'name': RECORD_NAME,
+    'manufacturer': RECORD_MANUFACTURER,
+    'serial': RECORD_SERIAL,
+    'model': RECORD_MODEL,
+}
+
+RELAY_TYPES = ['lightbulb', 'switch', 'outlet']
+# relay_output_t, the firmware rejects a blob for the other type
+OUTPUTS = ['gpio', 'shift_register']
+RELAY_INVERTED = 1 << 0
+
+# homekit_accessory_category_t
+CATEGORIES = {
+    'other': 1,
+    'bridge': 2,
+    'fan': 3,
+    'lightbulb': 5,
+    'outlet': 7,
+    'switch': 8,
+}
+
+# ESP32 pins that can drive a relay: 6-11 are the SPI flash, 34-39 are inputs
+OUTPUT_GPIOS = set(range(0, 34)) - set(range(6, 12)) - {20, 24, 28, 29, 30, 31}
+
+
+def check(config):
+    """Returns a list of problems with a parsed JSON config"""
+    errors = []
+
+    if config.get('category', 'other') not in CATEGORIES:
+        errors.append('unknown category "%s", one of %s' % (config['category'], ', '.join(CATEGORIES)))
+
+    for key in STRING_RECORDS:
+        value = config.get(key)
+        if value is not None and len(value.encode()) > MAX_NAME:
+            errors.append('%s is longer than %d bytes' % (key, MAX_NAME))
+
+    relays = config.get('relays', [])
+    if not relays:
+        errors.append('no relays')
+    if len(relays) > MAX_RELAYS:
+        errors.append('%d relays, at most %d' % (len(relays), MAX_RELAYS))
+
+    shift_register = config.get('output', 'gpio') == 'shift_register'
+    if config.get('output', 'gpio') not in OUTPUTS:
+        errors.append('unknown output "%s", one of %s' % (config['output'], ', '.join(OUTPUTS)))
+
+    used = {}
+    for i, relay in enumerate(relays):
+        where = 'relay %d' % (i + 1)
+        gpio = relay.get('gpio')
+        if not isinstance(gpio, int):
+            errors.append('%s: missing gpio' % where)
+        elif shift_register and not 0 <= gpio < MAX_RELAYS:
+            errors.append('%s: output bit %d is beyond the chain' % (where, gpio))
+        elif not shift_register and gpio not in OUTPUT_GPIOS:
+            errors.append('%s: GPIO%d can not drive an output' % (where, gpio))
+        elif gpio in used:
+            errors.append('%s: output %d is also used by relay %d' % (where, gpio, used[gpio] + 1))
+        else:
+            used[gpio] = i
+        if relay.get('type', 'lightbulb') not in RELAY_TYPES:
+            errors.append('%s: unknown type "%s", one of %s' % (where, relay['type'], ', '.join(RELAY_TYPES)))
+        name = relay.get('name', '')
+        if len(name.encode()) > MAX_NAME:
+            errors.append('%s: name is longer than %d bytes' % (where, MAX_NAME))
+
+    return errors
+
+
+def record(record_type, value):
+    return struct.pack('<BB', record_type, len(value)) + value
+
+
+def build(config):
+    payload = b''
+    for key, record_type in STRING_RECORDS.items():
+        if config.get(key) is not None:
+            payload += record(record_type, config[key].encode())
+    payload += record(RECORD_OUTPUT, bytes([OUTPUTS.index(config.get('output', 'gpio'))]))
+    for relay in config['relays']:
+        flags = RELAY_INVERTED if relay.get('inverted') else 0
+        value = struct.pack('<bBB', relay['gpio'], RELAY_TYPES.index(relay.get('type', 'lightbulb')), flags)
+        value += relay.get('name', '').encode()
+        payload += record(RECORD_RELAY, value)
+
+    header = HEADER.pack(MAGIC, VERSION, CATEGORIES[config.get('category', 'other')],
+                         len(payload), zlib.crc32(payload) & 0xffffffff)
+    blob = header + payload
+    if len(blob) > MAX_PARTITION:
+        raise ValueError('blob is %d bytes, the partition holds %d' % (len(blob), MAX_PARTITION))
+    return blob
+
+
+def dump(blob):
+    magic, version, category, length, crc = HEADER.unpack_from(blob)
+    if magic != MAGIC:
+        raise ValueError('not an accessory config')
+    if version != VERSION:
+        raise ValueError('unsupported version %d' % version)
+    payload = blob[HEADER.size:HEADER.size + length]
+    if len(payload) != length:
+        raise ValueError('truncated')
+    if zlib.crc32(payload) & 0xffffffff != crc:
+        raise ValueError('CRC mismatch')
+
+    names = {v: k for k, v in CATEGORIES.items()}
+    config = {'category': names.get(category, category), 'relays': []}
+    strings = {v: k for k, v in STRING_RECORDS.items()}
+    offset = 0
+    while offset < length:
+        record_type, size = struct.unpack_from('<BB', payload, offset)
+        value = payload[offset + 2:offset + 2 + size]
+        offset += 2 + size
+        if record_type in strings:
+            config[strings[record_type]] = value.decode()
+        elif record_type == RECORD_OUTPUT:
+            config['output'] = OUTPUTS[value[0]]
+        elif record_type == RECORD_RELAY:
+            gpio, relay_type, flags = struct.unpack_from('<bBB', value)
+            relay = {'gpio': gpio, 'type': RELAY_TYPES[relay_type]}
+            if value[3:]:
+                relay['name'] = value[3:].decode()
+            if flags & RELAY_INVERTED:
+                relay['inverted'] = True
+            config['relays'].append(relay)
+    return config
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command', required=True)
+    build_parser = commands.add_parser('build', help='check a JSON config and write the blob')
+    build_parser.add_argument('input')
+    build_parser.add_argument('output')
+    check_parser = commands.add_parser('check', help='check a JSON config')
+    check_parser.add_argument('input')
+    dump_parser = commands.add_parser('dump', help='print a blob as JSON')
+    dump_parser.add_argument('input')
+    args = parser.parse_args()
+
+    if args.command == 'dump':
+        with open(args.input, 'rb') as f:
+            print(json.dumps(dump(f.read()), indent=4, ensure_ascii=False))
+        return 0
+
+    with open(args.input) as f:
+        config = json.load(f)
+    errors = check(config)
+    for error in errors:
+        print('%s: %s' % (args.input, error), file=sys.stderr)
+    if errors:
+        return 1
+
+    if args.command == 'build':
+        blob = build(config)
+        with open(args.output, 'wb') as f:
+            f.write(blob)
+        print('%s: %d relays, %d bytes' % (args.output, len(config['relays']), len(blob)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,68 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <esp_partition.h>
+
+#include "accessory_config.h"
+
+accessory_config_t *accessory_config_load(const char *label, relay_output_type_t output) {
+        const esp_partition_t *partition = esp_partition_find_first(
+                ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label
+                );
+        if (!partition) {
+                printf("Accessory config partition \"%s\" not found\n", label);
+                return NULL;
+        }
+
+        uint8_t header[ACCESSORY_CONFIG_HEADER_SIZE];
+        if (esp_partition_read(partition, 0, header, sizeof(header)) != ESP_OK) {
+                return NULL;
+        }
+        if ((header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t) header[3] << 24)) != ACCESSORY_CONFIG_MAGIC) {
+                printf("Accessory config: partition \"%s\" is empty\n", label);
+                return NULL;
+        }
+        size_t size = ACCESSORY_CONFIG_HEADER_SIZE + (header[6] | (header[7] << 8));
+        if (size > partition->size) {
+                printf("Accessory config: larger than the partition\n");
+                return NULL;
+        }
+
+        // The blob is only needed until it is parsed
+        uint8_t *data = malloc(size);
+        if (!data) {
+                return NULL;
+        }
+        accessory_config_t *config = NULL;
+        if (esp_partition_read(partition, 0, data, size) == ESP_OK) {
+                config = accessory_config_parse(data, size, output);
+        }
+        free(data);
+
+        if (config) {
+                printf("Accessory config: \"%s\" with %d relays\n",
+                       config->name ? config->name : "", config->relay_count);
+        }
+        return config;
+}
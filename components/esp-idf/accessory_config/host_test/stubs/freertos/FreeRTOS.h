@@ -0,0 +1,2 @@
+// Host test stand-in, relay_bank.h only needs the types
+#pragma once
@@ -0,0 +1,5 @@
+// Host test stand-in, relay_bank.h only needs the types
+#pragma once
+
+typedef void *SemaphoreHandle_t;
+typedef struct { void *unused[4]; } StaticSemaphore_t;
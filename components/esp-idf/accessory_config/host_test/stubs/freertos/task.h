@@ -0,0 +1,4 @@
+// Host test stand-in, relay_bank.h only needs the types
+#pragma once
+
+typedef void *TaskHandle_t;
@@ -0,0 +1,16 @@
+// Host test stand-in, relay_bank.h only needs the types
+#pragma once
+
+typedef enum {
+        homekit_accessory_category_other = 1,
+        homekit_accessory_category_bridge = 2,
+        homekit_accessory_category_fan = 3,
+        homekit_accessory_category_lightbulb = 5,
+        homekit_accessory_category_outlet = 7,
+        homekit_accessory_category_switch = 8,
+} homekit_accessory_category_t;
+
+typedef struct { void *unused; } homekit_characteristic_t;
+typedef struct { void *unused; } homekit_characteristic_change_callback_t;
+typedef struct { void *unused; } homekit_service_t;
+typedef struct { void *unused; } homekit_accessory_t;
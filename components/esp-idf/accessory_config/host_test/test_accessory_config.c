@@ -0,0 +1,215 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+// Host-side round trip for accessory configs: blobs built by
+// accessory_config.py are parsed by the firmware parser.
+//
+//   cc -Wall -Istubs -I.. -I../../relay_bank -o test_accessory_config test_accessory_config.c ../accessory_config.c
+//   ./test_accessory_config
+//
+// Run from this directory, python3 must be on the path. Exits non-zero when
+// a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accessory_config.h"
+
+#define TOOL "python3 ../accessory_config.py"
+#define JSON_PATH "test_accessory_config.json"
+#define BLOB_PATH "test_accessory_config.bin"
+
+static int failures;
+
+#define CHECK(condition, ...) \
+        do { \
+                if (!(condition)) { \
+                        printf("FAIL %s:%d: ", __func__, __LINE__); \
+                        printf(__VA_ARGS__); \
+                        printf("\n"); \
+                        failures++; \
+                } \
+        } while (0)
+
+static const char config_gpio[] =
+        "{\"category\": \"switch\", \"name\": \"Hall\", \"manufacturer\": \"Maker\","
+        " \"serial\": \"S1\", \"model\": \"M2\", \"relays\": ["
+        "{\"gpio\": 12, \"name\": \"Kitchen\", \"type\": \"lightbulb\"},"
+        "{\"gpio\": 5, \"type\": \"outlet\", \"inverted\": true},"
+        "{\"gpio\": 33, \"type\": \"switch\"}]}";
+
+static const char config_shift_register[] =
+        "{\"output\": \"shift_register\", \"relays\": ["
+        "{\"gpio\": 0}, {\"gpio\": 7, \"name\": \"Pump\"}, {\"gpio\": 63, \"inverted\": true}]}";
+
+static const char config_duplicate[] =
+        "{\"relays\": [{\"gpio\": 12}, {\"gpio\": 12}]}";
+
+// Writes json and runs the tool on it, returns the blob size or -1 when the
+// tool rejected the config
+static int build(const char *json, uint8_t *blob, size_t size) {
+        FILE *f = fopen(JSON_PATH, "w");
+        if (!f) {
+                perror(JSON_PATH);
+                exit(1);
+        }
+        fputs(json, f);
+        fclose(f);
+
+        int status = system(TOOL " build " JSON_PATH " " BLOB_PATH " > /dev/null 2>&1");
+        remove(JSON_PATH);
+        if (status != 0) {
+                return -1;
+        }
+
+        f = fopen(BLOB_PATH, "rb");
+        if (!f) {
+                return -1;
+        }
+        int n = fread(blob, 1, size, f);
+        fclose(f);
+        remove(BLOB_PATH);
+        return n;
+}
+
+static void test_gpio() {
+        uint8_t blob[4096];
+        int size = build(config_gpio, blob, sizeof(blob));
+        CHECK(size > ACCESSORY_CONFIG_HEADER_SIZE, "tool failed on a valid config");
+        if (size <= ACCESSORY_CONFIG_HEADER_SIZE) {
+                return;
+        }
+
+        accessory_config_t *config = accessory_config_parse(blob, size, RELAY_OUTPUT_GPIO);
+        CHECK(config, "valid blob rejected");
+        if (!config) {
+                return;
+        }
+        CHECK(config->category == homekit_accessory_category_switch, "category %d", config->category);
+        CHECK(config->name && !strcmp(config->name, "Hall"), "name");
+        CHECK(config->manufacturer && !strcmp(config->manufacturer, "Maker"), "manufacturer");
+        CHECK(config->serial && !strcmp(config->serial, "S1"), "serial");
+        CHECK(config->model && !strcmp(config->model, "M2"), "model");
+        CHECK(config->output == RELAY_OUTPUT_GPIO, "output %d", config->output);
+        CHECK(config->relay_count == 3, "%d relays", config->relay_count);
+        if (config->relay_count == 3) {
+                const relay_desc_t *r = config->relays;
+                CHECK(r[0].gpio == 12 && r[0].type == RELAY_TYPE_LIGHTBULB && !r[0].inverted, "relay 1");
+                CHECK(r[0].name && !strcmp(r[0].name, "Kitchen"), "relay 1 name");
+                CHECK(r[1].gpio == 5 && r[1].type == RELAY_TYPE_OUTLET && r[1].inverted, "relay 2");
+                CHECK(!r[1].name, "relay 2 has a name");
+                CHECK(r[2].gpio == 33 && r[2].type == RELAY_TYPE_SWITCH, "relay 3");
+        }
+        free(config);
+
+        // Firmware driving shift registers must not treat GPIOs as chain bits
+        config = accessory_config_parse(blob, size, RELAY_OUTPUT_SHIFT_REGISTER);
+        CHECK(!config, "GPIO blob accepted by shift register firmware");
+        free(config);
+}
+
+static void test_shift_register() {
+        uint8_t blob[4096];
+        int size = build(config_shift_register, blob, sizeof(blob));
+        CHECK(size > ACCESSORY_CONFIG_HEADER_SIZE, "tool failed on a valid config");
+        if (size <= ACCESSORY_CONFIG_HEADER_SIZE) {
+                return;
+        }
+
+        accessory_config_t *config = accessory_config_parse(blob, size, RELAY_OUTPUT_SHIFT_REGISTER);
+        CHECK(config, "valid blob rejected");
+        if (config) {
+                CHECK(config->output == RELAY_OUTPUT_SHIFT_REGISTER, "output %d", config->output);
+                CHECK(config->category == homekit_accessory_category_other, "category %d", config->category);
+                CHECK(!config->name, "name set");
+                CHECK(config->relay_count == 3, "%d relays", config->relay_count);
+                if (config->relay_count == 3) {
+                        CHECK(config->relays[0].gpio == 0, "relay 1 bit %d", config->relays[0].gpio);
+                        CHECK(config->relays[1].gpio == 7 && config->relays[1].name
+                              && !strcmp(config->relays[1].name, "Pump"), "relay 2");
+                        CHECK(config->relays[2].gpio == 63 && config->relays[2].inverted, "relay 3");
+                }
+                free(config);
+        }
+
+        config = accessory_config_parse(blob, size, RELAY_OUTPUT_GPIO);
+        CHECK(!config, "shift register blob accepted by GPIO firmware");
+        free(config);
+}
+
+// Blobs from before the output record are for GPIOs
+static void test_no_output_record() {
+        const uint8_t payload[] = { ACCESSORY_CONFIG_RELAY, 3, 12, RELAY_TYPE_SWITCH, 0 };
+        uint8_t blob[ACCESSORY_CONFIG_HEADER_SIZE + sizeof(payload)];
+        uint32_t crc = accessory_config_crc32(payload, sizeof(payload));
+        const uint8_t header[ACCESSORY_CONFIG_HEADER_SIZE] = {
+                'A', 'C', 'F', 'G', ACCESSORY_CONFIG_VERSION, homekit_accessory_category_other,
+                sizeof(payload), 0, crc, crc >> 8, crc >> 16, crc >> 24,
+        };
+        memcpy(blob, header, sizeof(header));
+        memcpy(blob + sizeof(header), payload, sizeof(payload));
+
+        accessory_config_t *config = accessory_config_parse(blob, sizeof(blob), RELAY_OUTPUT_GPIO);
+        CHECK(config && config->relay_count == 1 && config->relays[0].gpio == 12, "GPIO firmware rejected an old blob");
+        free(config);
+        config = accessory_config_parse(blob, sizeof(blob), RELAY_OUTPUT_SHIFT_REGISTER);
+        CHECK(!config, "shift register firmware accepted an old blob");
+        free(config);
+}
+
+static void test_corrupt() {
+        uint8_t blob[4096];
+        int size = build(config_gpio, blob, sizeof(blob));
+        if (size <= ACCESSORY_CONFIG_HEADER_SIZE) {
+                return;
+        }
+
+        blob[size - 1] ^= 0x01;
+        accessory_config_t *config = accessory_config_parse(blob, size, RELAY_OUTPUT_GPIO);
+        CHECK(!config, "corrupt blob accepted");
+        free(config);
+        blob[size - 1] ^= 0x01;
+
+        config = accessory_config_parse(blob, size - 1, RELAY_OUTPUT_GPIO);
+        CHECK(!config, "truncated blob accepted");
+        free(config);
+}
+
+static void test_tool_checks() {
+        uint8_t blob[4096];
+        CHECK(build(config_duplicate, blob, sizeof(blob)) < 0, "tool accepted two relays on one GPIO");
+}
+
+int main() {
+        test_gpio();
+        test_shift_register();
+        test_no_output_record();
+        test_corrupt();
+        test_tool_checks();
+
+        if (failures) {
+                printf("%d checks failed\n", failures);
+                return 1;
+        }
+        printf("All checks passed\n");
+        return 0;
+}
@@ -0,0 +1,85 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+
+#include "diagnostics.h"
+
+typedef struct {
+        const char *stage;
+        int64_t time;
+} boot_timeline_entry_t;
+
+static boot_timeline_entry_t timeline[BOOT_TIMELINE_SIZE];
+static int timeline_size = 0;
+static int64_t ready_time = 0;
+static portMUX_TYPE timeline_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void boot_timeline_mark(const char *stage) {
+        int64_t now = esp_timer_get_time();
+
+        portENTER_CRITICAL(&timeline_lock);
+        if (timeline_size < BOOT_TIMELINE_SIZE) {
+                timeline[timeline_size].stage = stage;
+                timeline[timeline_size].time = now;
+                timeline_size++;
+        }
+        portEXIT_CRITICAL(&timeline_lock);
+}
+
+void boot_timeline_ready() {
+        if (ready_time) {
+                return;
+        }
+
+        boot_timeline_mark("homekit_ready");
+        ready_time = esp_timer_get_time();
+
+        diagnostics_boot_time.value = HOMEKIT_UINT32(ready_time / 1000);
+        homekit_characteristic_notify(&diagnostics_boot_time, diagnostics_boot_time.value);
+
+        boot_timeline_dump();
+
+#if CONFIG_DIAGNOSTICS_STACK_MONITOR
+        stack_monitor_start(CONFIG_DIAGNOSTICS_STACK_MONITOR_PERIOD);
+#endif
+}
+
+void boot_timeline_dump() {
+        int64_t previous = 0;
+
+        printf("Boot timeline:\n");
+        for (int i=0; i < timeline_size; i++) {
+                printf("  %-16s %8lldms  +%lldms\n", timeline[i].stage,
+                       timeline[i].time / 1000, (timeline[i].time - previous) / 1000);
+                previous = timeline[i].time;
+        }
+        if (ready_time) {
+                printf("Boot to HomeKit ready: %lldms\n", ready_time / 1000);
+        }
+}
+
+int64_t boot_timeline_total() {
+        return ready_time;
+}
@@ -0,0 +1,52 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <homekit/types.h>
+
+#ifndef HOMEKIT_CUSTOM_UUID
+#define HOMEKIT_CUSTOM_UUID(value) (value "-0e36-4a42-ad11-745a73b84f2b")
+#endif
+
+#define HOMEKIT_SERVICE_CUSTOM_DIAGNOSTICS HOMEKIT_CUSTOM_UUID("F0000000")
+
+#define HOMEKIT_CHARACTERISTIC_CUSTOM_BOOT_TIME HOMEKIT_CUSTOM_UUID("F0000001")
+#define HOMEKIT_DECLARE_CHARACTERISTIC_CUSTOM_BOOT_TIME(_value, ...) \
+        .type = HOMEKIT_CHARACTERISTIC_CUSTOM_BOOT_TIME, \
+        .description = "Boot time (ms)", \
+        .format = homekit_format_uint32, \
+        .unit = homekit_unit_none, \
+        .permissions = homekit_permissions_paired_read \
+                       | homekit_permissions_notify, \
+        .value = HOMEKIT_UINT32_(_value), \
+        ##__VA_ARGS__
+
+#define HOMEKIT_CHARACTERISTIC_CUSTOM_STACK_HEADROOM HOMEKIT_CUSTOM_UUID("F0000002")
+#define HOMEKIT_DECLARE_CHARACTERISTIC_CUSTOM_STACK_HEADROOM(_value, ...) \
+        .type = HOMEKIT_CHARACTERISTIC_CUSTOM_STACK_HEADROOM, \
+        .description = "Stack headroom (bytes)", \
+        .format = homekit_format_uint32, \
+        .unit = homekit_unit_none, \
+        .permissions = homekit_permissions_paired_read \
+                       | homekit_permissions_notify, \
+        .value = HOMEKIT_UINT32_(_value), \
+        ##__VA_ARGS__
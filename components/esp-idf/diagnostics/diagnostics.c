@@ -0,0 +1,32 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include "diagnostics.h"
+
+homekit_characteristic_t diagnostics_boot_time = HOMEKIT_CHARACTERISTIC_(CUSTOM_BOOT_TIME, 0);
+homekit_characteristic_t diagnostics_stack_headroom = HOMEKIT_CHARACTERISTIC_(CUSTOM_STACK_HEADROOM, 0);
+
+homekit_service_t diagnostics_service = HOMEKIT_SERVICE_(CUSTOM_DIAGNOSTICS, .characteristics=(homekit_characteristic_t*[]) {
+        HOMEKIT_CHARACTERISTIC(NAME, "Diagnostics"),
+        &diagnostics_boot_time,
+        &diagnostics_stack_headroom,
+        NULL
+});
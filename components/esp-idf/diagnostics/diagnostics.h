@@ -0,0 +1,61 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <homekit/homekit.h>
+#include <homekit/characteristics.h>
+#include "custom_characteristics.h"
+
+// Boot-to-HomeKit-ready time in milliseconds, set by boot_timeline_ready()
+extern homekit_characteristic_t diagnostics_boot_time;
+
+// Smallest stack high-water mark of any task in bytes, set by the stack monitor
+extern homekit_characteristic_t diagnostics_stack_headroom;
+
+// Custom service holding the diagnostic characteristics, add
+// DIAGNOSTICS_SERVICE to the services of one accessory
+extern homekit_service_t diagnostics_service;
+#define DIAGNOSTICS_SERVICE (&diagnostics_service)
+
+#define BOOT_TIMELINE_SIZE 16
+
+// Record the end of an init stage, stage must be a string literal
+void boot_timeline_mark(const char *stage);
+
+// Mark HomeKit as ready and publish the total boot time
+void boot_timeline_ready();
+
+void boot_timeline_dump();
+
+// Microseconds from boot to boot_timeline_ready(), 0 if not there yet
+int64_t boot_timeline_total();
+
+// Sample the stack high-water mark of every task each period milliseconds,
+// started by boot_timeline_ready() when CONFIG_DIAGNOSTICS_STACK_MONITOR is set
+int stack_monitor_start(uint32_t period);
+
+// Take a sample now, printing tasks whose headroom shrank
+void stack_monitor_sample();
+
+void stack_monitor_dump();
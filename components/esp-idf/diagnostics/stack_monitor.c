@@ -0,0 +1,183 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include "diagnostics.h"
+
+#ifdef CONFIG_DIAGNOSTICS_STACK_MONITOR_MAX_TASKS
+#define STACK_MONITOR_MAX_TASKS CONFIG_DIAGNOSTICS_STACK_MONITOR_MAX_TASKS
+#else
+#define STACK_MONITOR_MAX_TASKS 32
+#endif
+
+#ifdef CONFIG_DIAGNOSTICS_STACK_MONITOR_MIN_FREE
+#define STACK_MONITOR_MIN_FREE CONFIG_DIAGNOSTICS_STACK_MONITOR_MIN_FREE
+#else
+#define STACK_MONITOR_MIN_FREE 512
+#endif
+
+typedef struct {
+        TaskHandle_t handle;
+        char name[configMAX_TASK_NAME_LEN];
+        uint32_t stack_free;    // lowest high-water mark seen, in bytes
+        bool seen;
+} stack_monitor_entry_t;
+
+static stack_monitor_entry_t entries[STACK_MONITOR_MAX_TASKS];
+static int entry_count = 0;
+static esp_timer_handle_t monitor_timer = NULL;
+
+#if configUSE_TRACE_FACILITY
+// Static so a sample does not put a few hundred bytes on the caller's stack
+static TaskStatus_t task_status[STACK_MONITOR_MAX_TASKS];
+#endif
+
+static stack_monitor_entry_t *stack_monitor_entry(const TaskStatus_t *status) {
+        for (int i=0; i < entry_count; i++) {
+                if (entries[i].handle == status->xHandle && !strcmp(entries[i].name, status->pcTaskName)) {
+                        return &entries[i];
+                }
+        }
+        if (entry_count == STACK_MONITOR_MAX_TASKS) {
+                return NULL;
+        }
+
+        stack_monitor_entry_t *entry = &entries[entry_count++];
+        entry->handle = status->xHandle;
+        strncpy(entry->name, status->pcTaskName, sizeof(entry->name) - 1);
+        entry->name[sizeof(entry->name) - 1] = 0;
+        entry->stack_free = UINT32_MAX;
+        return entry;
+}
+
+void stack_monitor_sample() {
+#if configUSE_TRACE_FACILITY
+        static portMUX_TYPE sample_lock = portMUX_INITIALIZER_UNLOCKED;
+        static bool sampling = false;
+
+        portENTER_CRITICAL(&sample_lock);
+        bool busy = sampling;
+        sampling = true;
+        portEXIT_CRITICAL(&sample_lock);
+        if (busy) {
+                return;
+        }
+
+        // With more tasks than fit, nothing is filled in and 0 is returned.
+        // Skip the sample rather than forget every task.
+        static bool overflowed = false;
+        UBaseType_t count = uxTaskGetSystemState(task_status, STACK_MONITOR_MAX_TASKS, NULL);
+        if (count == 0) {
+                if (!overflowed) {
+                        printf("Stack monitor: %u tasks, only room for %d, raise CONFIG_DIAGNOSTICS_STACK_MONITOR_MAX_TASKS\n",
+                               (unsigned) uxTaskGetNumberOfTasks(), STACK_MONITOR_MAX_TASKS);
+                        overflowed = true;
+                }
+                sampling = false;
+                return;
+        }
+        overflowed = false;
+
+        for (int i=0; i < entry_count; i++) {
+                entries[i].seen = false;
+        }
+
+        for (int i=0; i < count; i++) {
+                stack_monitor_entry_t *entry = stack_monitor_entry(&task_status[i]);
+                if (!entry) {
+                        continue;
+                }
+
+                // On ESP-IDF stack sizes and high-water marks are in bytes
+                uint32_t stack_free = task_status[i].usStackHighWaterMark;
+                if (stack_free < entry->stack_free) {
+                        if (entry->stack_free != UINT32_MAX) {
+                                printf("Stack: %-16s %5u bytes free (was %u)\n", entry->name, stack_free, entry->stack_free);
+                        }
+                        if (stack_free < STACK_MONITOR_MIN_FREE
+                            && (entry->stack_free == UINT32_MAX || entry->stack_free >= STACK_MONITOR_MIN_FREE)) {
+                                printf("Stack: %-16s below %d bytes free, raise its stack size\n", entry->name, STACK_MONITOR_MIN_FREE);
+                        }
+                        entry->stack_free = stack_free;
+                }
+                entry->seen = true;
+        }
+
+        // Forget deleted tasks and find the tightest stack
+        uint32_t headroom = UINT32_MAX;
+        int n = 0;
+        for (int i=0; i < entry_count; i++) {
+                if (!entries[i].seen) {
+                        continue;
+                }
+                entries[n++] = entries[i];
+                if (entries[i].stack_free < headroom) {
+                        headroom = entries[i].stack_free;
+                }
+        }
+        entry_count = n;
+
+        if (n > 0 && (uint32_t)diagnostics_stack_headroom.value.int_value != headroom) {
+                diagnostics_stack_headroom.value = HOMEKIT_UINT32(headroom);
+                homekit_characteristic_notify(&diagnostics_stack_headroom, diagnostics_stack_headroom.value);
+        }
+
+        sampling = false;
+#endif
+}
+
+void stack_monitor_dump() {
+        stack_monitor_sample();
+
+        printf("Stack high-water marks:\n");
+        for (int i=0; i < entry_count; i++) {
+                printf("  %-16s %5u bytes free\n", entries[i].name, entries[i].stack_free);
+        }
+}
+
+static void stack_monitor_callback(void *arg) {
+        stack_monitor_sample();
+}
+
+int stack_monitor_start(uint32_t period) {
+        if (monitor_timer) {
+                return 0;
+        }
+
+        esp_timer_create_args_t timer_args = {
+                .callback = stack_monitor_callback,
+                .name = "stack_monitor",
+        };
+        if (esp_timer_create(&timer_args, &monitor_timer) != ESP_OK) {
+                printf("Failed to create stack monitor timer\n");
+                return -1;
+        }
+        esp_timer_start_periodic(monitor_timer, (uint64_t)period * 1000);
+
+        stack_monitor_dump();
+        return 0;
+}
@@ -0,0 +1,241 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "event_log.h"
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#define LOCK(log) if ((log)->lock) xSemaphoreTake((log)->lock, portMAX_DELAY)
+#define UNLOCK(log) if ((log)->lock) xSemaphoreGive((log)->lock)
+#else
+#define LOCK(log)
+#define UNLOCK(log)
+#endif
+
+#define RECORD_SIZE sizeof(event_log_record_t)
+#define ERASED_SEQ 0xFFFFFFFF
+
+static uint16_t record_check(const event_log_record_t *record) {
+        const uint16_t *words = (const uint16_t *) record;
+        uint16_t sum1 = 0xff, sum2 = 0xff;
+
+        for (int i=0; i < RECORD_SIZE / 2; i++) {
+                if (i == offsetof(event_log_record_t, check) / 2) {
+                        continue;
+                }
+                sum1 = (sum1 + words[i]) % 0xff;
+                sum2 = (sum2 + sum1) % 0xff;
+        }
+
+        return (sum2 << 8) | sum1;
+}
+
+static bool record_valid(const event_log_record_t *record) {
+        return record->seq != ERASED_SEQ && record->check == record_check(record);
+}
+
+int event_log_init(event_log_t *log, const event_log_storage_t *storage) {
+        if (storage->size < 2 * EVENT_LOG_SECTOR_SIZE || storage->size % EVENT_LOG_SECTOR_SIZE) {
+                printf("Invalid event log size %u\n", storage->size);
+                return -1;
+        }
+
+        void *lock = log->lock;
+        void *queue = log->queue;
+        memset(log, 0, sizeof(*log));
+        log->storage = *storage;
+        log->lock = lock;
+        log->queue = queue;
+
+        // The newest sector is the one starting with the highest sequence number
+        event_log_record_t record;
+        int newest = -1;
+        for (uint32_t offset = 0; offset < storage->size; offset += EVENT_LOG_SECTOR_SIZE) {
+                if (storage->read(storage->context, offset, &record, RECORD_SIZE)) {
+                        return -1;
+                }
+                if (record_valid(&record) && (newest < 0 || record.seq >= log->next_seq)) {
+                        newest = offset;
+                        log->next_seq = record.seq + 1;
+                }
+        }
+
+        if (newest < 0) {
+                log->head = 0;
+                return 0;
+        }
+
+        // Continue after the last used slot of that sector
+        uint32_t offset = newest + RECORD_SIZE;
+        uint32_t end = newest + EVENT_LOG_SECTOR_SIZE;
+        for (; offset < end; offset += RECORD_SIZE) {
+                if (storage->read(storage->context, offset, &record, RECORD_SIZE)) {
+                        return -1;
+                }
+                if (record.seq == ERASED_SEQ) {
+                        break;
+                }
+                if (record_valid(&record)) {
+                        log->next_seq = record.seq + 1;
+                }
+        }
+        log->head = offset % storage->size;
+
+        return 0;
+}
+
+static int flush(event_log_t *log) {
+        event_log_storage_t *storage = &log->storage;
+        size_t i = 0;
+
+        while (i < log->batch_size) {
+                if (log->head % EVENT_LOG_SECTOR_SIZE == 0) {
+                        if (storage->erase_sector(storage->context, log->head)) {
+                                break;
+                        }
+                }
+
+                size_t room = (EVENT_LOG_SECTOR_SIZE - log->head % EVENT_LOG_SECTOR_SIZE) / RECORD_SIZE;
+                size_t count = log->batch_size - i;
+                if (count > room) {
+                        count = room;
+                }
+
+                if (storage->write(storage->context, log->head, &log->batch[i], count * RECORD_SIZE)) {
+                        break;
+                }
+
+                log->head = (log->head + count * RECORD_SIZE) % storage->size;
+                i += count;
+        }
+
+        // A failed batch is dropped rather than retried forever
+        int result = (i == log->batch_size) ? 0 : -1;
+        log->dropped += log->batch_size - i;
+        log->batch_size = 0;
+
+        return result;
+}
+
+static int write_record(event_log_t *log, event_log_record_t *record) {
+        record->seq = log->next_seq++;
+        record->check = record_check(record);
+        log->batch[log->batch_size++] = *record;
+
+        if (log->batch_size == EVENT_LOG_BATCH_SIZE) {
+                return flush(log);
+        }
+        return 0;
+}
+
+int event_log_write(event_log_t *log, event_log_record_t *record) {
+        LOCK(log);
+        int result = write_record(log, record);
+        UNLOCK(log);
+
+        return result;
+}
+
+int event_log_flush(event_log_t *log) {
+        LOCK(log);
+        int result = flush(log);
+        UNLOCK(log);
+
+        return result;
+}
+
+#ifdef ESP_PLATFORM
+// Give every queued record its sequence number, the lock must be held
+static int drain(event_log_t *log) {
+        event_log_record_t record;
+        int result = 0;
+
+        while (log->queue && xQueueReceive(log->queue, &record, 0) == pdTRUE) {
+                if (write_record(log, &record)) {
+                        result = -1;
+                }
+        }
+        return result;
+}
+
+int event_log_drain(event_log_t *log) {
+        LOCK(log);
+        int result = drain(log);
+        UNLOCK(log);
+
+        return result;
+}
+
+int event_log_sync(event_log_t *log, uint32_t *next_seq) {
+        LOCK(log);
+        int result = drain(log);
+        if (flush(log)) {
+                result = -1;
+        }
+        *next_seq = log->next_seq;
+        UNLOCK(log);
+
+        return result;
+}
+#endif
+
+int event_log_read_last(event_log_t *log, event_log_record_t *records, size_t count) {
+        event_log_storage_t *storage = &log->storage;
+        int n = 0;
+
+        LOCK(log);
+        for (int i = log->batch_size - 1; i >= 0 && n < count; i--) {
+                records[n++] = log->batch[i];
+        }
+
+        // Walk back from the head until an erased slot or older data wraps
+        uint32_t offset = log->head;
+        uint32_t slots = storage->size / RECORD_SIZE;
+        event_log_record_t record;
+        for (uint32_t i = 0; i < slots && n < count; i++) {
+                offset = (offset + storage->size - RECORD_SIZE) % storage->size;
+                if (storage->read(storage->context, offset, &record, RECORD_SIZE)) {
+                        n = -1;
+                        break;
+                }
+                if (record.seq == ERASED_SEQ) {
+                        break;
+                }
+                if (!record_valid(&record)) {
+                        continue;
+                }
+                if (n > 0 && record.seq >= records[n-1].seq) {
+                        break;
+                }
+                records[n++] = record;
+        }
+        UNLOCK(log);
+
+        return n;
+}
@@ -0,0 +1,101 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Append-only event log kept in a ring of flash sectors.
+//
+// Records are fixed size and written in batches. When the head reaches the
+// end of a sector the next sector, holding the oldest records, is erased, so
+// every sector of the region wears at the same rate.
+
+#define EVENT_LOG_SECTOR_SIZE 4096
+#define EVENT_LOG_BATCH_SIZE 8
+#define EVENT_LOG_QUEUE_SIZE 16
+#define EVENT_LOG_FLUSH_PERIOD 2000  // ms
+
+typedef struct {
+        uint32_t seq;
+        uint32_t timestamp;  // seconds, time(NULL)
+        uint8_t type;
+        uint8_t source;
+        uint16_t check;
+        uint32_t value;
+} event_log_record_t;
+
+typedef struct {
+        int (*read)(void *context, uint32_t offset, void *data, size_t size);
+        int (*write)(void *context, uint32_t offset, const void *data, size_t size);
+        int (*erase_sector)(void *context, uint32_t offset);
+        void *context;
+        uint32_t size;  // multiple of EVENT_LOG_SECTOR_SIZE, at least two sectors
+} event_log_storage_t;
+
+typedef struct {
+        event_log_storage_t storage;
+        uint32_t head;  // offset of the next free slot
+        uint32_t next_seq;
+        event_log_record_t batch[EVENT_LOG_BATCH_SIZE];
+        uint8_t batch_size;
+        uint32_t dropped;
+
+        void *lock;
+        void *queue;
+} event_log_t;
+
+int event_log_init(event_log_t *log, const event_log_storage_t *storage);
+
+// Buffer a record, the batch is written out once it is full
+int event_log_write(event_log_t *log, event_log_record_t *record);
+int event_log_flush(event_log_t *log);
+
+// Copy up to count most recent records into records, newest first.
+// Returns the number of records copied or -1 on error.
+int event_log_read_last(event_log_t *log, event_log_record_t *records, size_t count);
+
+#ifdef ESP_PLATFORM
+
+int event_log_partition_storage(event_log_storage_t *storage, const char *label);
+
+// Start a writer task so event_log_add() never touches flash
+int event_log_start(event_log_t *log);
+
+// Non-blocking, safe to call from HomeKit callbacks. Returns -1 and counts the
+// record as dropped if the writer queue is full.
+int event_log_add(event_log_t *log, uint8_t type, uint8_t source, uint32_t value);
+
+// Write the records waiting in the writer queue, used by the writer task
+int event_log_drain(event_log_t *log);
+
+// Write and flush everything added so far and return the sequence number the
+// next record will get. Every record added before the call has a lower one.
+int event_log_sync(event_log_t *log, uint32_t *next_seq);
+
+#else
+
+// Host build: storage backed by a memory-mapped file that behaves like NOR flash
+int event_log_file_storage(event_log_storage_t *storage, const char *path, uint32_t size);
+void event_log_file_close(event_log_storage_t *storage);
+
+#endif
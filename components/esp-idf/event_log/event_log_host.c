@@ -0,0 +1,101 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#ifndef ESP_PLATFORM
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "event_log.h"
+
+static int file_read(void *context, uint32_t offset, void *data, size_t size) {
+        memcpy(data, (uint8_t *) context + offset, size);
+        return 0;
+}
+
+static int file_write(void *context, uint32_t offset, const void *data, size_t size) {
+        // Like NOR flash, programming can only clear bits
+        uint8_t *dst = (uint8_t *) context + offset;
+        const uint8_t *src = data;
+        for (size_t i=0; i < size; i++) {
+                dst[i] &= src[i];
+        }
+        return 0;
+}
+
+static int file_erase_sector(void *context, uint32_t offset) {
+        memset((uint8_t *) context + offset, 0xff, EVENT_LOG_SECTOR_SIZE);
+        return 0;
+}
+
+int event_log_file_storage(event_log_storage_t *storage, const char *path, uint32_t size) {
+        if (size % EVENT_LOG_SECTOR_SIZE) {
+                return -1;
+        }
+
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+                return -1;
+        }
+
+        // New space reads as erased flash
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size < size) {
+                uint8_t erased[EVENT_LOG_SECTOR_SIZE];
+                memset(erased, 0xff, sizeof(erased));
+                lseek(fd, st.st_size, SEEK_SET);
+                for (off_t left = size - st.st_size; left > 0; left -= sizeof(erased)) {
+                        if (write(fd, erased, left < sizeof(erased) ? left : sizeof(erased)) < 0) {
+                                close(fd);
+                                return -1;
+                        }
+                }
+        }
+
+        void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+                return -1;
+        }
+
+        storage->read = file_read;
+        storage->write = file_write;
+        storage->erase_sector = file_erase_sector;
+        storage->context = data;
+        storage->size = size;
+
+        return 0;
+}
+
+void event_log_file_close(event_log_storage_t *storage) {
+        if (!storage->context) {
+                return;
+        }
+
+        msync(storage->context, storage->size, MS_SYNC);
+        munmap(storage->context, storage->size);
+        storage->context = NULL;
+}
+
+#endif
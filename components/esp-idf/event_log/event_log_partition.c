@@ -0,0 +1,121 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <time.h>
+
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#include "event_log.h"
+
+static int partition_read(void *context, uint32_t offset, void *data, size_t size) {
+        return esp_partition_read(context, offset, data, size) == ESP_OK ? 0 : -1;
+}
+
+static int partition_write(void *context, uint32_t offset, const void *data, size_t size) {
+        return esp_partition_write(context, offset, data, size) == ESP_OK ? 0 : -1;
+}
+
+static int partition_erase_sector(void *context, uint32_t offset) {
+        return esp_partition_erase_range(context, offset, EVENT_LOG_SECTOR_SIZE) == ESP_OK ? 0 : -1;
+}
+
+int event_log_partition_storage(event_log_storage_t *storage, const char *label) {
+        const esp_partition_t *partition = esp_partition_find_first(
+                ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label
+                );
+        if (!partition) {
+                printf("Event log partition \"%s\" not found\n", label);
+                return -1;
+        }
+
+        storage->read = partition_read;
+        storage->write = partition_write;
+        storage->erase_sector = partition_erase_sector;
+        storage->context = (void *) partition;
+        storage->size = partition->size - partition->size % EVENT_LOG_SECTOR_SIZE;
+
+        return 0;
+}
+
+static void event_log_task(void *_args) {
+        event_log_t *log = _args;
+        const TickType_t flush_period = pdMS_TO_TICKS(EVENT_LOG_FLUSH_PERIOD);
+        TickType_t batch_start = 0;
+        event_log_record_t record;
+
+        while (1) {
+                // Flush a partial batch once its oldest record is flush_period old
+                TickType_t wait = portMAX_DELAY;
+                if (log->batch_size) {
+                        TickType_t age = xTaskGetTickCount() - batch_start;
+                        wait = (age < flush_period) ? flush_period - age : 0;
+                }
+
+                // Peek and take the records under the log lock, so
+                // event_log_sync() never misses one that is in flight here
+                if (xQueuePeek(log->queue, &record, wait) == pdTRUE) {
+                        if (!log->batch_size) {
+                                batch_start = xTaskGetTickCount();
+                        }
+                        event_log_drain(log);
+                } else {
+                        event_log_flush(log);
+                }
+        }
+}
+
+int event_log_start(event_log_t *log) {
+        log->lock = xSemaphoreCreateMutex();
+        log->queue = xQueueCreate(EVENT_LOG_QUEUE_SIZE, sizeof(event_log_record_t));
+        if (!log->lock || !log->queue) {
+                return -1;
+        }
+
+        if (xTaskCreate(event_log_task, "Event log", 2048, log, 1, NULL) != pdPASS) {
+                return -1;
+        }
+
+        return 0;
+}
+
+int event_log_add(event_log_t *log, uint8_t type, uint8_t source, uint32_t value) {
+        if (!log->queue) {
+                return -1;
+        }
+
+        event_log_record_t record = {
+                .timestamp = time(NULL),
+                .type = type,
+                .source = source,
+                .value = value,
+        };
+        if (xQueueSend(log->queue, &record, 0) != pdTRUE) {
+                log->dropped++;
+                return -1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,289 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+#include "input_service.h"
+
+typedef struct {
+        uint8_t gpio;
+        input_config_t config;
+        input_callback_fn callback;
+        void *context;
+
+        uint8_t integrator;
+        uint8_t integrator_max;
+        bool active;
+        uint8_t presses;
+        bool long_sent;
+        int64_t changed_at;          // ms
+} input_t;
+
+typedef struct {
+        int8_t index;
+        input_event_t event;
+} input_message_t;
+
+static input_t inputs[INPUT_SERVICE_MAX_INPUTS];
+static volatile int input_count;
+
+static QueueHandle_t input_queue;
+static TaskHandle_t wake_task;
+static esp_timer_handle_t scan_timer;
+static volatile bool scanning;
+
+static bool input_level(const input_t *input) {
+        return gpio_get_level(input->gpio) != input->config.active_low;
+}
+
+static void input_send(int index, input_event_type_t type) {
+        input_message_t message = {
+                .index = index,
+                .event = {
+                        .gpio = inputs[index].gpio,
+                        .type = type,
+                        .active = inputs[index].active,
+                },
+        };
+        if (xQueueSend(input_queue, &message, 0) != pdTRUE) {
+                printf("Input service: dropped event of GPIO %d\n", inputs[index].gpio);
+        }
+}
+
+static void input_send_presses(int index) {
+        static const input_event_type_t press_events[] = {
+                INPUT_EVENT_SINGLE_PRESS, INPUT_EVENT_DOUBLE_PRESS, INPUT_EVENT_TRIPLE_PRESS,
+        };
+        input_send(index, press_events[inputs[index].presses - 1]);
+        inputs[index].presses = 0;
+}
+
+static void input_changed(int index, int64_t now) {
+        input_t *input = &inputs[index];
+        if (input->config.type == INPUT_TOGGLE) {
+                input_send(index, INPUT_EVENT_CHANGE);
+                return;
+        }
+
+        input->changed_at = now;
+        if (input->active) {
+                input->long_sent = false;
+        } else if (!input->long_sent) {
+                input->presses++;
+                if (input->presses >= input->config.max_presses) {
+                        input_send_presses(index);
+                }
+        }
+}
+
+// Returns true while the input needs more scans
+static bool input_scan(int index, int64_t now) {
+        input_t *input = &inputs[index];
+
+        if (input_level(input)) {
+                if (input->integrator < input->integrator_max) {
+                        input->integrator++;
+                }
+        } else if (input->integrator > 0) {
+                input->integrator--;
+        }
+
+        bool settled = true;
+        if (input->integrator == input->integrator_max && !input->active) {
+                input->active = true;
+                input_changed(index, now);
+        } else if (input->integrator == 0 && input->active) {
+                input->active = false;
+                input_changed(index, now);
+        } else if (input->integrator != 0 && input->integrator != input->integrator_max) {
+                settled = false;
+        }
+
+        if (input->config.type == INPUT_TOGGLE) {
+                return !settled;
+        }
+
+        if (input->active) {
+                if (!input->config.long_press_time || input->long_sent) {
+                        return !settled;
+                }
+                if (now - input->changed_at >= input->config.long_press_time) {
+                        input->long_sent = true;
+                        input->presses = 0;
+                        input_send(index, INPUT_EVENT_LONG_PRESS);
+                        return !settled;
+                }
+                return true;
+        }
+
+        if (input->presses && now - input->changed_at >= input->config.repeat_time) {
+                input_send_presses(index);
+        }
+        return input->presses || !settled;
+}
+
+static void input_scan_timer(void *arg) {
+        int64_t now = esp_timer_get_time() / 1000;
+        int count = input_count;
+
+        bool busy = false;
+        for (int i=0; i < count; i++) {
+                busy |= input_scan(i, now);
+        }
+        if (busy) {
+                return;
+        }
+
+        esp_timer_stop(scan_timer);
+        scanning = false;
+        // An edge since the last scan found the interrupt handler returning
+        // early, look for it here
+        for (int i=0; i < count; i++) {
+                if (input_level(&inputs[i]) != inputs[i].active) {
+                        scanning = true;
+                        esp_timer_start_periodic(scan_timer, INPUT_SERVICE_SCAN_PERIOD * 1000);
+                        break;
+                }
+        }
+}
+
+// The scan timer can not be started from an interrupt. A task of its own
+// starts it, so an edge is never lost to a full event queue or left waiting
+// behind a slow callback.
+static void IRAM_ATTR input_isr(void *arg) {
+        if (scanning) {
+                return;
+        }
+        scanning = true;
+
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(wake_task, &woken);
+        if (woken) {
+                portYIELD_FROM_ISR();
+        }
+}
+
+static void input_wake_task(void *arg) {
+        while (1) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                esp_err_t err = esp_timer_start_periodic(scan_timer, INPUT_SERVICE_SCAN_PERIOD * 1000);
+                // Already running is fine, anything else leaves the next
+                // edge to try again
+                if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+                        printf("Input service: failed to start scanning: %s\n", esp_err_to_name(err));
+                        scanning = false;
+                }
+        }
+}
+
+static void input_task(void *arg) {
+        input_message_t message;
+
+        while (1) {
+                if (xQueueReceive(input_queue, &message, portMAX_DELAY) != pdTRUE) {
+                        continue;
+                }
+
+                input_t *input = &inputs[message.index];
+                input->callback(&message.event, input->context);
+        }
+}
+
+static int input_service_start() {
+        input_queue = xQueueCreate(INPUT_SERVICE_QUEUE_SIZE, sizeof(input_message_t));
+        if (!input_queue) {
+                return -1;
+        }
+
+        esp_timer_create_args_t timer_args = {
+                .callback = input_scan_timer,
+                .name = "input_scan",
+        };
+        if (esp_timer_create(&timer_args, &scan_timer) != ESP_OK) {
+                return -1;
+        }
+
+        // Above the callback task and the usual accessory tasks
+        if (xTaskCreate(input_wake_task, "Input wake", 2048, NULL, 10, &wake_task) != pdPASS
+            || xTaskCreate(input_task, "Input", 3072, NULL, 2, NULL) != pdPASS) {
+                return -1;
+        }
+
+        // Shared with other drivers, already installed is fine
+        gpio_install_isr_service(0);
+        return 0;
+}
+
+int input_service_add(int gpio, input_config_t config, input_callback_fn callback, void *context) {
+        if (input_count == INPUT_SERVICE_MAX_INPUTS || !GPIO_IS_VALID_GPIO(gpio) || !callback) {
+                return -1;
+        }
+        if (config.max_presses < 1 || config.max_presses > 3) {
+                config.max_presses = 1;
+        }
+        if (!input_queue && input_service_start()) {
+                printf("Input service: failed to start\n");
+                return -1;
+        }
+
+        int index = input_count;
+        input_t *input = &inputs[index];
+        *input = (input_t) {
+                .gpio = gpio,
+                .config = config,
+                .callback = callback,
+                .context = context,
+                .integrator_max = config.debounce_time / INPUT_SERVICE_SCAN_PERIOD,
+        };
+        if (input->integrator_max < 1) {
+                input->integrator_max = 1;
+        }
+
+        gpio_set_direction(gpio, GPIO_MODE_INPUT);
+        gpio_set_pull_mode(gpio, config.pull_up ? GPIO_PULLUP_ONLY : GPIO_FLOATING);
+        input->active = input_level(input);
+        input->integrator = input->active ? input->integrator_max : 0;
+        // Visible to the scan timer once complete
+        input_count = index + 1;
+
+        gpio_set_intr_type(gpio, GPIO_INTR_ANYEDGE);
+        if (gpio_isr_handler_add(gpio, input_isr, NULL) != ESP_OK) {
+                printf("Input service: failed to add GPIO %d\n", gpio);
+                return -1;
+        }
+        return 0;
+}
+
+bool input_service_active(int gpio) {
+        for (int i=0; i < input_count; i++) {
+                if (inputs[i].gpio == gpio) {
+                        return inputs[i].active;
+                }
+        }
+        return false;
+}
@@ -0,0 +1,98 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Buttons, switches and sensor outputs on GPIOs, handled by one service.
+//
+// An edge on any input starts one scan timer that samples every input each
+// INPUT_SERVICE_SCAN_PERIOD and debounces it with an integrator. The timer
+// stops again once all inputs are settled and no press is being timed, so
+// idle inputs cost nothing and more inputs only lengthen the scan loop.
+// Events are delivered through one queue to one task, which runs the
+// callbacks.
+
+#define INPUT_SERVICE_MAX_INPUTS 16
+#define INPUT_SERVICE_SCAN_PERIOD 5  // ms
+#define INPUT_SERVICE_QUEUE_SIZE 8
+
+typedef enum {
+        INPUT_EVENT_SINGLE_PRESS,
+        INPUT_EVENT_DOUBLE_PRESS,
+        INPUT_EVENT_TRIPLE_PRESS,
+        INPUT_EVENT_LONG_PRESS,
+        INPUT_EVENT_CHANGE,          // toggle inputs, see active
+} input_event_type_t;
+
+typedef struct {
+        uint8_t gpio;
+        input_event_type_t type;
+        bool active;                 // debounced state after the event
+} input_event_t;
+
+typedef void (*input_callback_fn)(const input_event_t *event, void *context);
+
+typedef enum {
+        INPUT_BUTTON,                // press events
+        INPUT_TOGGLE,                // a change event on every debounced edge
+} input_type_t;
+
+typedef struct {
+        input_type_t type;
+        bool active_low;
+        bool pull_up;
+        uint16_t debounce_time;      // ms the level has to hold
+        // Buttons only
+        uint8_t max_presses;         // 1-3, above 1 a press waits repeat_time for the next
+        uint16_t repeat_time;        // ms
+        uint16_t long_press_time;    // ms, 0 disables long presses
+} input_config_t;
+
+#define INPUT_BUTTON_CONFIG(...) \
+        (input_config_t) { \
+                .type = INPUT_BUTTON, \
+                .active_low = true, \
+                .pull_up = true, \
+                .debounce_time = 20, \
+                .max_presses = 1, \
+                .repeat_time = 300, \
+                .long_press_time = 1000, \
+                __VA_ARGS__ \
+        }
+
+#define INPUT_TOGGLE_CONFIG(...) \
+        (input_config_t) { \
+                .type = INPUT_TOGGLE, \
+                .active_low = false, \
+                .pull_up = false, \
+                .debounce_time = 50, \
+                __VA_ARGS__ \
+        }
+
+// Starts watching gpio, the service itself starts with the first input.
+// Toggle inputs report no event for their level at start.
+int input_service_add(int gpio, input_config_t config, input_callback_fn callback, void *context);
+
+// Debounced state of an input added before
+bool input_service_active(int gpio);
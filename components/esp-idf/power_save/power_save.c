@@ -0,0 +1,117 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+
+#include <esp_pm.h>
+#include <esp_wifi.h>
+
+#include "power_save.h"
+
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t busy_lock;
+
+#if CONFIG_IDF_TARGET_ESP32
+typedef esp_pm_config_esp32_t power_save_pm_config_t;
+#elif CONFIG_IDF_TARGET_ESP32S2
+typedef esp_pm_config_esp32s2_t power_save_pm_config_t;
+#elif CONFIG_IDF_TARGET_ESP32S3
+typedef esp_pm_config_esp32s3_t power_save_pm_config_t;
+#elif CONFIG_IDF_TARGET_ESP32C3
+typedef esp_pm_config_esp32c3_t power_save_pm_config_t;
+#endif
+#endif
+
+int power_save_init(power_save_config_t config) {
+        if (config.min_freq_mhz > config.max_freq_mhz) {
+                printf("Power save: minimum CPU frequency %dMHz is above the maximum %dMHz\n",
+                       config.min_freq_mhz, config.max_freq_mhz);
+                return -1;
+        }
+
+#if CONFIG_PM_ENABLE
+        power_save_pm_config_t pm_config = {
+                .max_freq_mhz = config.max_freq_mhz,
+                .min_freq_mhz = config.min_freq_mhz,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+                .light_sleep_enable = config.light_sleep,
+#endif
+        };
+        esp_err_t err = esp_pm_configure(&pm_config);
+        if (err != ESP_OK) {
+                printf("Failed to configure power management: %s\n", esp_err_to_name(err));
+                return -1;
+        }
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "busy", &busy_lock);
+#if !CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        if (config.light_sleep) {
+                printf("Light sleep needs CONFIG_FREERTOS_USE_TICKLESS_IDLE\n");
+        }
+#endif
+#else
+        printf("CPU frequency scaling needs CONFIG_PM_ENABLE\n");
+#endif
+
+        esp_err_t wifi_err = esp_wifi_set_ps(config.wifi_ps);
+        if (wifi_err != ESP_OK) {
+                printf("Failed to set Wi-Fi power save: %s\n", esp_err_to_name(wifi_err));
+                return -1;
+        }
+
+        printf("Power save: CPU %d-%dMHz, light sleep %s, Wi-Fi power save %d\n",
+               config.min_freq_mhz, config.max_freq_mhz, config.light_sleep ? "on" : "off", config.wifi_ps);
+        return 0;
+}
+
+int power_save_init_profile() {
+#if CONFIG_POWER_SAVE_PROFILE_BALANCED
+        return power_save_init(POWER_SAVE_CONFIG(.max_freq_mhz = CONFIG_POWER_SAVE_MAX_FREQ,
+                                                 .min_freq_mhz = CONFIG_POWER_SAVE_MIN_FREQ));
+#elif CONFIG_POWER_SAVE_PROFILE_LOW_POWER
+        return power_save_init(POWER_SAVE_CONFIG(.max_freq_mhz = CONFIG_POWER_SAVE_MAX_FREQ,
+                                                 .min_freq_mhz = CONFIG_POWER_SAVE_MIN_FREQ,
+                                                 .light_sleep = true,
+                                                 .wifi_ps = WIFI_PS_MAX_MODEM));
+#else
+        return 0;
+#endif
+}
+
+void power_save_busy(bool busy) {
+#if CONFIG_PM_ENABLE
+        if (!busy_lock) {
+                return;
+        }
+        if (busy) {
+                esp_pm_lock_acquire(busy_lock);
+        } else {
+                esp_pm_lock_release(busy_lock);
+        }
+#endif
+}
+
+void power_save_dump() {
+#if CONFIG_PM_PROFILING
+        esp_pm_dump_locks(stdout);
+#else
+        printf("Power mode statistics need CONFIG_PM_PROFILING\n");
+#endif
+}
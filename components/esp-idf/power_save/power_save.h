@@ -0,0 +1,66 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_wifi.h>
+
+// CPU frequency scaling, automatic light sleep and Wi-Fi modem sleep.
+//
+// Both sleep modes keep the association and the HomeKit session alive: the
+// radio wakes for the DTIM beacons (every listen_interval beacons in
+// WIFI_PS_MAX_MODEM, see CONFIG_WIFI_STATION_LISTEN_INTERVAL) and the CPU
+// wakes for timers, Wi-Fi and GPIO wakeup sources. DFS and light sleep need
+// CONFIG_PM_ENABLE, light sleep also CONFIG_FREERTOS_USE_TICKLESS_IDLE.
+
+typedef struct {
+        int max_freq_mhz;
+        int min_freq_mhz;
+        bool light_sleep;        // sleep automatically when all tasks are idle
+        wifi_ps_type_t wifi_ps;
+} power_save_config_t;
+
+#define POWER_SAVE_CONFIG(...) \
+        (power_save_config_t) { \
+                .max_freq_mhz = 240, \
+                .min_freq_mhz = 80, \
+                .light_sleep = false, \
+                .wifi_ps = WIFI_PS_MIN_MODEM, \
+                __VA_ARGS__ \
+        }
+
+// Call after wifi_station_init()
+int power_save_init(power_save_config_t config);
+
+// Apply the profile chosen in menuconfig (CONFIG_POWER_SAVE_PROFILE_*), does
+// nothing for the none profile. Call after wifi_station_init()
+int power_save_init_profile();
+
+// Keep the CPU at full speed and out of light sleep while busy, e.g. around
+// bit-banged sensor reads. Calls nest.
+void power_save_busy(bool busy);
+
+// Print the time spent in each power mode since boot (CONFIG_PM_PROFILING),
+// multiply by the module's current per mode for the average current
+void power_save_dump();
@@ -0,0 +1,586 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_attr.h>
+#include <driver/gpio.h>
+#include <driver/spi_master.h>
+#include <nvs.h>
+#include <soc/gpio_reg.h>
+#include <homekit/homekit.h>
+#include <homekit/characteristics.h>
+
+#include "relay_bank.h"
+
+#define RELAY_BIT(index) ((uint64_t) 1 << (index))
+
+#define RELAY_BANK_NVS_NAMESPACE "relay_bank"
+
+#ifndef CONFIG_RELAY_BANK_SAVE_DELAY
+#define CONFIG_RELAY_BANK_SAVE_DELAY 2000
+#define CONFIG_RELAY_BANK_SAVE_INTERVAL 10000
+#endif
+
+static int service_list_length(homekit_service_t **services) {
+        int length = 0;
+        while (services && services[length]) {
+                length++;
+        }
+        return length;
+}
+
+static void write_gpios(relay_bank_t *bank, uint64_t state) {
+        uint32_t set[2] = { 0 }, clear[2] = { 0 };
+        for (int i=0; i < bank->count; i++) {
+                const relay_desc_t *desc = bank->relays[i].desc;
+                bool level = ((state & RELAY_BIT(i)) != 0) != desc->inverted;
+                uint32_t *pins = level ? set : clear;
+                pins[desc->gpio / 32] |= 1u << (desc->gpio % 32);
+        }
+
+        // GPIO.out_w1ts / out_w1tc, each pin bank switches in one write
+        REG_WRITE(GPIO_OUT_W1TS_REG, set[0]);
+        REG_WRITE(GPIO_OUT_W1TC_REG, clear[0]);
+#ifdef GPIO_OUT1_W1TS_REG
+        if (set[1] | clear[1]) {
+                REG_WRITE(GPIO_OUT1_W1TS_REG, set[1]);
+                REG_WRITE(GPIO_OUT1_W1TC_REG, clear[1]);
+        }
+#endif
+}
+
+static void write_shift_register(relay_bank_t *bank, uint64_t state) {
+        memset(bank->shift_data, 0, sizeof(bank->shift_data));
+        for (int i=0; i < bank->count; i++) {
+                const relay_desc_t *desc = bank->relays[i].desc;
+                bool level = ((state & RELAY_BIT(i)) != 0) != desc->inverted;
+                if (level) {
+                        // The first byte out ends up in the last register
+                        bank->shift_data[bank->shift_bytes - 1 - desc->gpio / 8] |= 1 << (desc->gpio % 8);
+                }
+        }
+
+        spi_transaction_t transaction = {
+                .length = bank->shift_bytes * 8,
+                .tx_buffer = bank->shift_data,
+        };
+        if (spi_device_polling_transmit(bank->spi, &transaction) != ESP_OK) {
+                printf("Relay bank: shift register write failed\n");
+        }
+}
+
+static void write_outputs(relay_bank_t *bank, uint64_t state) {
+        if (bank->output.type == RELAY_OUTPUT_SHIFT_REGISTER) {
+                write_shift_register(bank, state);
+        } else {
+                write_gpios(bank, state);
+        }
+        bank->written = state;
+}
+
+static void relay_bank_save(relay_bank_t *bank) {
+        xSemaphoreTake(bank->lock, portMAX_DELAY);
+        uint64_t state = bank->state;
+        xSemaphoreGive(bank->lock);
+        if (state == bank->saved) {
+                return;
+        }
+
+        nvs_handle_t handle;
+        esp_err_t err = nvs_open(RELAY_BANK_NVS_NAMESPACE, NVS_READWRITE, &handle);
+        if (err == ESP_OK) {
+                err = nvs_set_u64(handle, bank->save_key, state);
+                if (err == ESP_OK) {
+                        err = nvs_commit(handle);
+                }
+                nvs_close(handle);
+        }
+        if (err != ESP_OK) {
+                printf("Relay bank: failed to save state: %s\n", esp_err_to_name(err));
+        }
+
+        // Also after a failure, so a broken NVS is not retried in a loop
+        bank->saved = state;
+        bank->last_save = esp_timer_get_time();
+}
+
+// A commit that erases a page blocks for tens of milliseconds, too long for
+// the esp_timer task that also runs the flush and zero-cross timers
+static void relay_bank_save_task(void *arg) {
+        relay_bank_t *bank = arg;
+
+        while (1) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                relay_bank_save(bank);
+        }
+}
+
+static void relay_bank_save_timer(void *arg) {
+        relay_bank_t *bank = arg;
+        xTaskNotifyGive(bank->save_task);
+}
+
+// Changes are collected for the save delay and saved no sooner than the
+// save interval after the previous save
+static void relay_bank_schedule_save(relay_bank_t *bank) {
+        if (!bank->save_task) {
+                return;
+        }
+        int64_t delay = CONFIG_RELAY_BANK_SAVE_DELAY * 1000LL;
+        int64_t next_save = bank->last_save + CONFIG_RELAY_BANK_SAVE_INTERVAL * 1000LL - esp_timer_get_time();
+        if (next_save > delay) {
+                delay = next_save;
+        }
+        // Fails harmlessly when a save is already scheduled
+        esp_timer_start_once(bank->save_timer, delay);
+}
+
+static void IRAM_ATTR zero_cross_isr(void *arg) {
+        relay_bank_t *bank = arg;
+        uint32_t now = esp_timer_get_time();
+        uint32_t period = now - bank->zero_cross.last;
+        uint32_t nominal = bank->zero_cross.nominal_half_period;
+
+        if (period < nominal * RELAY_ZERO_CROSS_GLITCH / 100) {
+                return;
+        }
+        // Track the mains frequency, skipping gaps of missed pulses
+        if (period < nominal * 5 / 4) {
+                bank->zero_cross.half_period = (bank->zero_cross.half_period * 7 + period) / 8;
+        }
+        bank->zero_cross.last = now;
+}
+
+// Of the pending relays, returns the ones due now and sets next to the time
+// of the earliest later one. Called with the lock held.
+static uint64_t zero_cross_due(relay_bank_t *bank, uint64_t pending, int64_t *next) {
+        int64_t now = esp_timer_get_time();
+        int64_t half_period = bank->zero_cross.half_period;
+        uint32_t since = (uint32_t) now - bank->zero_cross.last;
+        if (since > RELAY_ZERO_CROSS_TIMEOUT * half_period) {
+                // No mains signal, switch right away
+                for (int i=0; i < bank->count; i++) {
+                        bank->relays[i].switch_at = 0;
+                }
+                return pending;
+        }
+        int64_t last_zero_cross = now - since;
+        // Leave time for the timer to fire
+        int64_t earliest = now + 2 * RELAY_ZERO_CROSS_TOLERANCE;
+
+        uint64_t due = 0;
+        *next = 0;
+        for (int i=0; i < bank->count; i++) {
+                relay_t *relay = &bank->relays[i];
+                if (!(pending & RELAY_BIT(i))) {
+                        relay->switch_at = 0;
+                        continue;
+                }
+
+                if (!relay->switch_at) {
+                        const relay_zero_cross_config_t *config = &bank->zero_cross.config;
+                        bool on = (bank->state & RELAY_BIT(i)) != 0;
+                        int delay = on
+                                    ? (relay->desc->operate_time ? relay->desc->operate_time : config->operate_time)
+                                    : (relay->desc->release_time ? relay->desc->release_time : config->release_time);
+                        int64_t switch_at = last_zero_cross + config->offset - delay;
+                        if (switch_at < earliest) {
+                                switch_at += ((earliest - switch_at) / half_period + 1) * half_period;
+                        }
+                        relay->switch_at = switch_at;
+                }
+
+                if (relay->switch_at <= now + RELAY_ZERO_CROSS_TOLERANCE) {
+                        due |= RELAY_BIT(i);
+                        relay->switch_at = 0;
+                } else if (!*next || relay->switch_at < *next) {
+                        *next = relay->switch_at;
+                }
+        }
+        return due;
+}
+
+// Write out the pending state, or the part of it that is due with zero-cross
+// switching, and report the relays that changed
+static void relay_bank_flush(relay_bank_t *bank) {
+        int64_t next = 0;
+
+        xSemaphoreTake(bank->lock, portMAX_DELAY);
+        uint64_t due = bank->state ^ bank->written;
+        if (due && bank->zero_cross.enabled) {
+                due = zero_cross_due(bank, due, &next);
+        }
+        uint64_t state = (bank->written & ~due) | (bank->state & due);
+        uint64_t changed = state ^ bank->written;
+        if (changed) {
+                write_outputs(bank, state);
+        }
+        xSemaphoreGive(bank->lock);
+
+        if (next) {
+                int64_t delay = next - esp_timer_get_time();
+                esp_timer_stop(bank->flush_timer);
+                esp_timer_start_once(bank->flush_timer, delay > 0 ? delay : 0);
+        }
+
+        if (changed) {
+                relay_bank_schedule_save(bank);
+        }
+        for (int i=0; changed && bank->callback && i < bank->count; i++) {
+                if (changed & RELAY_BIT(i)) {
+                        bank->callback(bank, i, (state & RELAY_BIT(i)) != 0, bank->context);
+                }
+        }
+}
+
+static void relay_bank_flush_timer(void *arg) {
+        relay_bank_flush(arg);
+}
+
+static void relay_on_callback(homekit_characteristic_t *ch, homekit_value_t value, void *context) {
+        relay_t *relay = context;
+        relay_bank_t *bank = relay->bank;
+
+        xSemaphoreTake(bank->lock, portMAX_DELAY);
+        uint64_t state = value.bool_value
+                         ? bank->state | RELAY_BIT(relay->index)
+                         : bank->state & ~RELAY_BIT(relay->index);
+        bool pending = (state != bank->written);
+        bank->state = state;
+        xSemaphoreGive(bank->lock);
+
+        // The other writes of the same request arrive before the timer fires.
+        // Fails harmlessly when the timer is already running.
+        if (pending) {
+                esp_timer_start_once(bank->flush_timer, RELAY_BANK_COALESCE_TIME * 1000);
+        }
+}
+
+static void relay_init(relay_bank_t *bank, int index, const relay_desc_t *desc) {
+        relay_t *relay = &bank->relays[index];
+        relay->desc = desc;
+        relay->bank = bank;
+        relay->index = index;
+
+        const char *name = desc->name;
+        if (!name) {
+                snprintf(relay->name_value, sizeof(relay->name_value), "Relay %d", index + 1);
+                name = relay->name_value;
+        }
+        relay->name = (homekit_characteristic_t) HOMEKIT_CHARACTERISTIC_(NAME, (char *) name);
+        relay->on = (homekit_characteristic_t) HOMEKIT_CHARACTERISTIC_(ON, false);
+        relay->on_callback = (homekit_characteristic_change_callback_t) {
+                .function = relay_on_callback,
+                .context = relay,
+        };
+        relay->on.callback = &relay->on_callback;
+
+        homekit_characteristic_t **c = relay->characteristics;
+        *(c++) = &relay->name;
+        *(c++) = &relay->on;
+
+        switch (desc->type) {
+        case RELAY_TYPE_SWITCH:
+                relay->service = (homekit_service_t) HOMEKIT_SERVICE_(SWITCH);
+                break;
+        case RELAY_TYPE_OUTLET:
+                relay->service = (homekit_service_t) HOMEKIT_SERVICE_(OUTLET);
+                // Nothing measures the load, report it as always plugged in
+                relay->in_use = (homekit_characteristic_t) HOMEKIT_CHARACTERISTIC_(OUTLET_IN_USE, true);
+                *(c++) = &relay->in_use;
+                break;
+        case RELAY_TYPE_LIGHTBULB:
+        default:
+                relay->service = (homekit_service_t) HOMEKIT_SERVICE_(LIGHTBULB);
+                break;
+        }
+        *c = NULL;
+        relay->service.primary = (index == 0);
+        relay->service.characteristics = relay->characteristics;
+}
+
+static int output_init(relay_bank_t *bank) {
+        if (bank->output.type == RELAY_OUTPUT_GPIO) {
+                for (int i=0; i < bank->count; i++) {
+                        gpio_reset_pin(bank->relays[i].desc->gpio);
+                }
+                // Set the levels before the pins start driving
+                write_outputs(bank, 0);
+                for (int i=0; i < bank->count; i++) {
+                        gpio_set_direction(bank->relays[i].desc->gpio, GPIO_MODE_OUTPUT);
+                }
+                return 0;
+        }
+
+        const relay_output_t *output = &bank->output;
+        if (output->enable_gpio >= 0) {
+                // Keep the outputs off until the registers hold a known state
+                gpio_reset_pin(output->enable_gpio);
+                gpio_set_direction(output->enable_gpio, GPIO_MODE_OUTPUT);
+                gpio_set_level(output->enable_gpio, 1);
+        }
+
+        spi_bus_config_t bus_config = {
+                .mosi_io_num = output->mosi_gpio,
+                .miso_io_num = -1,
+                .sclk_io_num = output->sclk_gpio,
+                .quadwp_io_num = -1,
+                .quadhd_io_num = -1,
+                .max_transfer_sz = sizeof(bank->shift_data),
+        };
+        spi_device_interface_config_t device_config = {
+                .clock_speed_hz = output->clock_speed_hz,
+                .mode = 0,
+                // The rising edge at the end of the transfer latches the outputs
+                .spics_io_num = output->latch_gpio,
+                .queue_size = 1,
+        };
+        if (spi_bus_initialize(output->spi_host, &bus_config, 0) != ESP_OK
+            || spi_bus_add_device(output->spi_host, &device_config, (spi_device_handle_t *) &bank->spi) != ESP_OK) {
+                printf("Relay bank: failed to set up the shift register bus\n");
+                return -1;
+        }
+
+        write_outputs(bank, 0);
+        if (output->enable_gpio >= 0) {
+                gpio_set_level(output->enable_gpio, 0);
+        }
+        return 0;
+}
+
+static int check_relays(const relay_desc_t *relays, int count, const relay_output_t *output) {
+        if (count < 1 || count > RELAY_BANK_MAX_RELAYS) {
+                printf("Relay bank: %d relays, at most %d\n", count, RELAY_BANK_MAX_RELAYS);
+                return -1;
+        }
+        for (int i=0; i < count; i++) {
+                bool valid = (output && output->type == RELAY_OUTPUT_SHIFT_REGISTER)
+                             ? (relays[i].gpio >= 0 && relays[i].gpio < RELAY_BANK_MAX_RELAYS)
+                             : GPIO_IS_VALID_OUTPUT_GPIO(relays[i].gpio);
+                if (!valid) {
+                        printf("Relay bank: relay %d has an invalid output %d\n", i + 1, relays[i].gpio);
+                        return -1;
+                }
+                for (int j=0; j < i; j++) {
+                        if (relays[j].gpio == relays[i].gpio) {
+                                printf("Relay bank: relays %d and %d share output %d\n", j + 1, i + 1, relays[i].gpio);
+                                return -1;
+                        }
+                }
+        }
+        return 0;
+}
+
+relay_bank_t *relay_bank_create(const relay_desc_t *relays, int count,
+                                homekit_accessory_category_t category,
+                                homekit_service_t **head, homekit_service_t **tail,
+                                const relay_output_t *output) {
+        if (check_relays(relays, count, output)) {
+                return NULL;
+        }
+
+        int head_count = service_list_length(head);
+        int tail_count = service_list_length(tail);
+        int service_count = head_count + count + tail_count;
+
+        // bank | relays[count] | services[service_count + 1]
+        size_t relays_offset = sizeof(relay_bank_t);
+        size_t services_offset = relays_offset + count * sizeof(relay_t);
+        size_t size = services_offset + (service_count + 1) * sizeof(homekit_service_t *);
+
+        uint8_t *arena = calloc(1, size);
+        if (!arena) {
+                printf("Failed to allocate %u bytes for %d relays\n", (unsigned) size, count);
+                return NULL;
+        }
+
+        relay_bank_t *bank = (relay_bank_t *) arena;
+        bank->count = count;
+        bank->relays = (relay_t *) (arena + relays_offset);
+        bank->services = (homekit_service_t **) (arena + services_offset);
+        bank->output = output ? *output : (relay_output_t) { .type = RELAY_OUTPUT_GPIO };
+        bank->lock = xSemaphoreCreateMutexStatic(&bank->lock_buffer);
+
+        homekit_service_t **s = bank->services;
+        for (int i=0; i < head_count; i++) {
+                *(s++) = head[i];
+        }
+        for (int i=0; i < count; i++) {
+                relay_init(bank, i, &relays[i]);
+                *(s++) = &bank->relays[i].service;
+                if (relays[i].gpio / 8 + 1 > bank->shift_bytes) {
+                        bank->shift_bytes = relays[i].gpio / 8 + 1;
+                }
+        }
+        for (int i=0; i < tail_count; i++) {
+                *(s++) = tail[i];
+        }
+        *s = NULL;
+
+        esp_timer_create_args_t timer_args = {
+                .callback = relay_bank_flush_timer,
+                .arg = bank,
+                .name = "relay_bank",
+        };
+        esp_timer_create_args_t save_timer_args = {
+                .callback = relay_bank_save_timer,
+                .arg = bank,
+                .name = "relay_bank_save",
+        };
+        if (esp_timer_create(&timer_args, &bank->flush_timer) != ESP_OK
+            || esp_timer_create(&save_timer_args, &bank->save_timer) != ESP_OK
+            || output_init(bank)) {
+                // The caller may fall back to another table, leave nothing behind
+                if (bank->flush_timer) {
+                        esp_timer_delete(bank->flush_timer);
+                }
+                if (bank->save_timer) {
+                        esp_timer_delete(bank->save_timer);
+                }
+                vSemaphoreDelete(bank->lock);
+                free(arena);
+                return NULL;
+        }
+
+        bank->accessory = (homekit_accessory_t) HOMEKIT_ACCESSORY_(.id=1, .category=category, .services=bank->services);
+        bank->accessories[0] = &bank->accessory;
+        bank->accessories[1] = NULL;
+
+        printf("Relay bank: %d relays in %u bytes\n", count, (unsigned) size);
+        return bank;
+}
+
+void relay_bank_set_callback(relay_bank_t *bank, relay_bank_callback_fn callback, void *context) {
+        bank->callback = callback;
+        bank->context = context;
+}
+
+void relay_bank_set_mask(relay_bank_t *bank, uint64_t mask, uint64_t state) {
+        if (bank->count < RELAY_BANK_MAX_RELAYS) {
+                mask &= RELAY_BIT(bank->count) - 1;
+        }
+
+        xSemaphoreTake(bank->lock, portMAX_DELAY);
+        uint64_t changed = (bank->state ^ state) & mask;
+        bank->state ^= changed;
+        for (int i=0; i < bank->count; i++) {
+                if (changed & RELAY_BIT(i)) {
+                        bank->relays[i].on.value = HOMEKIT_BOOL((state & RELAY_BIT(i)) != 0);
+                }
+        }
+        xSemaphoreGive(bank->lock);
+
+        relay_bank_flush(bank);
+
+        // The callbacks find the state already written or scheduled
+        for (int i=0; i < bank->count; i++) {
+                if (changed & RELAY_BIT(i)) {
+                        homekit_characteristic_notify(&bank->relays[i].on, bank->relays[i].on.value);
+                }
+        }
+}
+
+uint64_t relay_bank_get_mask(relay_bank_t *bank) {
+        return bank->state;
+}
+
+void relay_bank_set(relay_bank_t *bank, int index, bool on) {
+        if (index < 0 || index >= bank->count) {
+                return;
+        }
+        relay_bank_set_mask(bank, RELAY_BIT(index), on ? RELAY_BIT(index) : 0);
+}
+
+bool relay_bank_get(relay_bank_t *bank, int index) {
+        if (index < 0 || index >= bank->count) {
+                return false;
+        }
+        return (bank->state & RELAY_BIT(index)) != 0;
+}
+
+int relay_bank_zero_cross_init(relay_bank_t *bank, relay_zero_cross_config_t config) {
+        if (config.gpio < 0) {
+                return 0;
+        }
+        if (config.mains_frequency <= 0) {
+                return -1;
+        }
+
+        bank->zero_cross.config = config;
+        bank->zero_cross.nominal_half_period = 1000000 / (2 * config.mains_frequency);
+        bank->zero_cross.half_period = bank->zero_cross.nominal_half_period;
+        // Stale until the first pulse
+        bank->zero_cross.last = (uint32_t) esp_timer_get_time() - RELAY_ZERO_CROSS_TIMEOUT * 2 * bank->zero_cross.half_period;
+
+        gpio_reset_pin(config.gpio);
+        gpio_set_direction(config.gpio, GPIO_MODE_INPUT);
+        gpio_set_intr_type(config.gpio, config.rising_edge ? GPIO_INTR_POSEDGE : GPIO_INTR_NEGEDGE);
+        // Shared with the other inputs, already installed is fine
+        gpio_install_isr_service(0);
+        if (gpio_isr_handler_add(config.gpio, zero_cross_isr, bank) != ESP_OK) {
+                printf("Relay bank: failed to set up the zero-cross input\n");
+                return -1;
+        }
+
+        bank->zero_cross.enabled = true;
+        printf("Relay bank: switching %dus from the zero crossing on GPIO %d\n", config.offset, config.gpio);
+        return 0;
+}
+
+int relay_bank_restore(relay_bank_t *bank, const char *key, relay_power_on_t policy) {
+        uint64_t state = 0;
+
+        switch (policy) {
+        case RELAY_POWER_ON_ON:
+                state = UINT64_MAX;
+                break;
+        case RELAY_POWER_ON_OFF:
+                break;
+        case RELAY_POWER_ON_LAST: {
+                nvs_handle_t handle;
+                esp_err_t err = nvs_open(RELAY_BANK_NVS_NAMESPACE, NVS_READONLY, &handle);
+                if (err == ESP_OK) {
+                        err = nvs_get_u64(handle, key, &state);
+                        nvs_close(handle);
+                }
+                if (err != ESP_OK) {
+                        // First boot, start with everything off
+                        state = 0;
+                }
+                bank->saved = state;
+                bank->save_key = key;
+                if (!bank->save_task
+                    && xTaskCreate(relay_bank_save_task, "Relay save", 2048, bank, 1, &bank->save_task) != pdPASS) {
+                        printf("Relay bank: failed to start the save task, states are not saved\n");
+                        bank->save_task = NULL;
+                }
+                break;
+        }
+        }
+
+        printf("Relay bank: restoring %s state\n",
+               policy == RELAY_POWER_ON_LAST ? "last" : policy == RELAY_POWER_ON_ON ? "on" : "off");
+        relay_bank_set_mask(bank, UINT64_MAX, state);
+        return 0;
+}
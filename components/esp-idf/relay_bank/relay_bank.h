@@ -0,0 +1,254 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <homekit/types.h>
+
+// A bank of relays, each exposed as its own service on one accessory.
+//
+// The relays are described by a table of relay_desc_t. relay_bank_create()
+// lays out the accessory, the service list and every relay service and
+// characteristic in one allocation, so a board with many relays boots with
+// a single malloc and no heap fragmentation.
+//
+// Outputs are written as a whole: changes are collected for
+// RELAY_BANK_COALESCE_TIME, so all relays of one HomeKit write (a scene)
+// switch together, and then applied with one register write per GPIO bank
+// or one shift register transfer.
+//
+// With a mains zero-cross detector, relay_bank_zero_cross_init() delays
+// each relay so its contacts close or open at a fixed offset from a zero
+// crossing, started early by the relay's operate or release time. Relays
+// due at the same time still switch in one write.
+//
+// relay_bank_restore() applies the power-on policy. With the last state
+// policy the states of all relays are saved together as one NVS value, at
+// most every CONFIG_RELAY_BANK_SAVE_INTERVAL, by a low priority task.
+
+#define RELAY_BANK_MAX_RELAYS 64
+#define RELAY_BANK_COALESCE_TIME 5  // ms
+
+typedef enum {
+        RELAY_TYPE_LIGHTBULB,
+        RELAY_TYPE_SWITCH,
+        RELAY_TYPE_OUTLET,
+} relay_type_t;
+
+typedef struct {
+        int8_t gpio;             // output bit in the chain for shift registers
+        const char *name;        // NULL names the relay "Relay <n>"
+        relay_type_t type;
+        bool inverted;           // relay energized on a low output
+        // Coil to contact delays in us for zero-cross switching, 0 uses
+        // the bank defaults
+        uint16_t operate_time;
+        uint16_t release_time;
+} relay_desc_t;
+
+#define RELAY_DESC(_gpio, ...) \
+        { .gpio = (_gpio), .type = RELAY_TYPE_LIGHTBULB, __VA_ARGS__ }
+
+#define RELAY_NAME_MAX 16
+
+typedef enum {
+        RELAY_OUTPUT_GPIO,
+        RELAY_OUTPUT_SHIFT_REGISTER,
+} relay_output_type_t;
+
+// A chain of 74HC595 on an SPI bus: MOSI to SER, SCLK to SRCLK and the
+// latch (chip select) to RCLK. Output bit n is Q(n % 8) of the n / 8th
+// register, counted from the one wired to the ESP.
+typedef struct {
+        relay_output_type_t type;
+        int spi_host;
+        int mosi_gpio;
+        int sclk_gpio;
+        int latch_gpio;
+        int enable_gpio;         // active low OE, -1 when tied to ground
+        int clock_speed_hz;
+} relay_output_t;
+
+#define RELAY_OUTPUT_SHIFT_REGISTER_CONFIG(...) \
+        (relay_output_t) { \
+                .type = RELAY_OUTPUT_SHIFT_REGISTER, \
+                .spi_host = 1, \
+                .mosi_gpio = 13, \
+                .sclk_gpio = 14, \
+                .latch_gpio = 15, \
+                .enable_gpio = -1, \
+                .clock_speed_hz = 1000000, \
+                __VA_ARGS__ \
+        }
+
+typedef enum {
+        RELAY_POWER_ON_LAST,
+        RELAY_POWER_ON_OFF,
+        RELAY_POWER_ON_ON,
+} relay_power_on_t;
+
+// The policy chosen in menuconfig
+#if CONFIG_RELAY_BANK_POWER_ON_ON
+#define RELAY_POWER_ON_DEFAULT RELAY_POWER_ON_ON
+#elif CONFIG_RELAY_BANK_POWER_ON_OFF
+#define RELAY_POWER_ON_DEFAULT RELAY_POWER_ON_OFF
+#else
+#define RELAY_POWER_ON_DEFAULT RELAY_POWER_ON_LAST
+#endif
+
+// Ignore detector pulses this close to the previous one, and fall back to
+// switching right away when no pulse came for this many half periods
+#define RELAY_ZERO_CROSS_GLITCH 50    // % of a half period
+#define RELAY_ZERO_CROSS_TIMEOUT 4
+// Relays due within this time of each other are switched together
+#define RELAY_ZERO_CROSS_TOLERANCE 200  // us
+
+typedef struct {
+        int gpio;                // detector output, a pulse at every zero crossing
+        bool rising_edge;
+        int offset;              // us from the zero crossing to the contact edge
+        int operate_time;        // us, default for relays without their own
+        int release_time;        // us
+        int mains_frequency;     // Hz, until the period is measured
+} relay_zero_cross_config_t;
+
+#if defined(CONFIG_RELAY_BANK_ZERO_CROSS_GPIO) && CONFIG_RELAY_BANK_ZERO_CROSS_GPIO >= 0
+#define RELAY_ZERO_CROSS_DEFAULT_GPIO CONFIG_RELAY_BANK_ZERO_CROSS_GPIO
+#define RELAY_ZERO_CROSS_DEFAULT_OFFSET CONFIG_RELAY_BANK_ZERO_CROSS_OFFSET
+#define RELAY_ZERO_CROSS_DEFAULT_OPERATE_TIME CONFIG_RELAY_BANK_OPERATE_TIME
+#define RELAY_ZERO_CROSS_DEFAULT_RELEASE_TIME CONFIG_RELAY_BANK_RELEASE_TIME
+#define RELAY_ZERO_CROSS_DEFAULT_FREQUENCY CONFIG_RELAY_BANK_MAINS_FREQUENCY
+#else
+#define RELAY_ZERO_CROSS_DEFAULT_GPIO -1
+#define RELAY_ZERO_CROSS_DEFAULT_OFFSET 0
+#define RELAY_ZERO_CROSS_DEFAULT_OPERATE_TIME 10000
+#define RELAY_ZERO_CROSS_DEFAULT_RELEASE_TIME 5000
+#define RELAY_ZERO_CROSS_DEFAULT_FREQUENCY 50
+#endif
+
+#define RELAY_ZERO_CROSS_CONFIG(...) \
+        (relay_zero_cross_config_t) { \
+                .gpio = RELAY_ZERO_CROSS_DEFAULT_GPIO, \
+                .rising_edge = true, \
+                .offset = RELAY_ZERO_CROSS_DEFAULT_OFFSET, \
+                .operate_time = RELAY_ZERO_CROSS_DEFAULT_OPERATE_TIME, \
+                .release_time = RELAY_ZERO_CROSS_DEFAULT_RELEASE_TIME, \
+                .mains_frequency = RELAY_ZERO_CROSS_DEFAULT_FREQUENCY, \
+                __VA_ARGS__ \
+        }
+
+typedef struct _relay_bank relay_bank_t;
+
+// Called after a relay output changed
+typedef void (*relay_bank_callback_fn)(relay_bank_t *bank, int index, bool on, void *context);
+
+typedef struct {
+        const relay_desc_t *desc;
+        relay_bank_t *bank;
+        int index;
+
+        char name_value[RELAY_NAME_MAX];
+        homekit_characteristic_t name;
+        homekit_characteristic_t on;
+        homekit_characteristic_t in_use;
+        homekit_characteristic_change_callback_t on_callback;
+        homekit_characteristic_t *characteristics[4];
+        homekit_service_t service;
+
+        int64_t switch_at;       // us, scheduled zero-cross write, 0 if none
+} relay_t;
+
+struct _relay_bank {
+        int count;
+        relay_t *relays;
+
+        relay_bank_callback_fn callback;
+        void *context;
+
+        relay_output_t output;
+        uint64_t state;          // bit per relay, set when on
+        uint64_t written;        // state last written to the outputs
+        int shift_bytes;
+        void *spi;
+        uint8_t shift_data[RELAY_BANK_MAX_RELAYS / 8];
+        esp_timer_handle_t flush_timer;
+
+        struct {
+                bool enabled;
+                relay_zero_cross_config_t config;
+                volatile uint32_t last;          // us, low bits of esp_timer_get_time()
+                volatile uint32_t half_period;   // us
+                uint32_t nominal_half_period;
+        } zero_cross;
+
+        const char *save_key;    // NULL when not saving
+        uint64_t saved;
+        int64_t last_save;       // us
+        esp_timer_handle_t save_timer;
+        TaskHandle_t save_task;  // writes NVS, woken by save_timer
+
+        SemaphoreHandle_t lock;
+        StaticSemaphore_t lock_buffer;
+
+        homekit_accessory_t accessory;
+        homekit_accessory_t *accessories[2];
+        homekit_service_t **services;
+};
+
+// Builds the accessory with the relay services between the NULL terminated
+// head and tail service lists, e.g. the accessory information before and
+// DIAGNOSTICS_SERVICE after. output is NULL for relays on GPIOs. The relays
+// start off. Returns NULL on a bad config or when out of memory. The relays
+// table is referenced, not copied. Use bank->accessories in
+// homekit_server_config_t.
+relay_bank_t *relay_bank_create(const relay_desc_t *relays, int count,
+                                homekit_accessory_category_t category,
+                                homekit_service_t **head, homekit_service_t **tail,
+                                const relay_output_t *output);
+
+void relay_bank_set_callback(relay_bank_t *bank, relay_bank_callback_fn callback, void *context);
+
+// Switch one relay and notify controllers of the change
+void relay_bank_set(relay_bank_t *bank, int index, bool on);
+
+bool relay_bank_get(relay_bank_t *bank, int index);
+
+// Switch the relays in mask to the matching bits of state in one output
+// write and notify controllers, bit n is relay n
+void relay_bank_set_mask(relay_bank_t *bank, uint64_t mask, uint64_t state);
+
+uint64_t relay_bank_get_mask(relay_bank_t *bank);
+
+// Synchronize switching with the zero-cross detector on config.gpio, does
+// nothing when it is -1. The defaults come from menuconfig.
+int relay_bank_zero_cross_init(relay_bank_t *bank, relay_zero_cross_config_t config);
+
+// Switch the relays to their power-on state. With RELAY_POWER_ON_LAST the
+// state is read from, and later changes are saved to, NVS under key.
+// Call once after relay_bank_create(), before the HomeKit server starts.
+int relay_bank_restore(relay_bank_t *bank, const char *key, relay_power_on_t policy);
@@ -0,0 +1,119 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <driver/gpio.h>
+
+#include "status_led.h"
+
+#define STATUS_LED_QUEUE_SIZE 4
+#define STATUS_LED_STACK_SIZE 1024
+
+const status_led_pattern_t status_led_identify = STATUS_LED_PATTERN({
+        100, -100, 100, -350,
+        100, -100, 100, -350,
+        100, -100, 100, -350,
+});
+
+static int led_gpio = -1;
+static bool led_active_high = true;
+static volatile bool led_idle = false;
+static const status_led_pattern_t * volatile led_current = NULL;
+
+static QueueHandle_t led_queue;
+static StaticQueue_t led_queue_buffer;
+static uint8_t led_queue_storage[STATUS_LED_QUEUE_SIZE * sizeof(status_led_pattern_t *)];
+static StaticTask_t led_task_buffer;
+static StackType_t led_task_stack[STATUS_LED_STACK_SIZE];
+
+static void led_write(bool on) {
+        gpio_set_level(led_gpio, (on == led_active_high) ? 1 : 0);
+}
+
+static void status_led_task(void *_args) {
+        const status_led_pattern_t *pattern;
+        const status_led_pattern_t *next;
+
+        while (1) {
+                if (xQueueReceive(led_queue, &pattern, portMAX_DELAY) != pdTRUE) {
+                        continue;
+                }
+
+                led_current = pattern;
+                for (int i=0; i < pattern->n; i++) {
+                        led_write(pattern->delay[i] > 0);
+                        vTaskDelay(abs(pattern->delay[i]) / portTICK_PERIOD_MS);
+                }
+
+                // Requests for the same pattern made while it played are merged
+                while (xQueuePeek(led_queue, &next, 0) == pdTRUE && next == pattern) {
+                        xQueueReceive(led_queue, &next, 0);
+                }
+
+                led_current = NULL;
+                led_write(led_idle);
+        }
+}
+
+int status_led_init(int gpio, bool active_high) {
+        if (led_queue) {
+                return -1;
+        }
+
+        led_gpio = gpio;
+        led_active_high = active_high;
+
+        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+        led_write(led_idle);
+
+        led_queue = xQueueCreateStatic(STATUS_LED_QUEUE_SIZE, sizeof(status_led_pattern_t *),
+                                       led_queue_storage, &led_queue_buffer);
+        xTaskCreateStatic(status_led_task, "Status LED", STATUS_LED_STACK_SIZE, NULL, 2,
+                          led_task_stack, &led_task_buffer);
+
+        return 0;
+}
+
+void status_led_set(bool on) {
+        led_idle = on;
+        if (led_gpio >= 0 && !led_current) {
+                led_write(on);
+        }
+}
+
+int status_led_signal(const status_led_pattern_t *pattern) {
+        if (!led_queue) {
+                return -1;
+        }
+        if (pattern == led_current) {
+                return 0;
+        }
+
+        // A full queue already holds enough blinking, drop the request
+        xQueueSend(led_queue, &pattern, 0);
+
+        return 0;
+}
@@ -0,0 +1,54 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// One long-lived task plays blink patterns on the status LED.
+//
+// A pattern is a list of delays in milliseconds, positive ones with the LED
+// on and negative ones with the LED off. Patterns must have static storage,
+// only a pointer to them is queued.
+
+typedef struct {
+        int n;
+        const int16_t *delay;
+} status_led_pattern_t;
+
+#define STATUS_LED_PATTERN(...) { \
+        .n = sizeof((int16_t[]) __VA_ARGS__) / sizeof(int16_t), \
+        .delay = (int16_t[]) __VA_ARGS__, \
+}
+
+// Three double blinks, used by every identify routine
+extern const status_led_pattern_t status_led_identify;
+
+int status_led_init(int gpio, bool active_high);
+
+// Level the LED returns to when no pattern is playing
+void status_led_set(bool on);
+
+// Queue a pattern without allocating. A request for the pattern that is
+// playing, or for the same pattern right behind it in the queue, is merged
+// into it. Other queued duplicates still play, e.g. A, B, A plays A twice.
+int status_led_signal(const status_led_pattern_t *pattern);
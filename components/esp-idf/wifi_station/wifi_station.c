@@ -0,0 +1,238 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_attr.h>
+#include <esp_event.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <nvs.h>
+
+#include "wifi_station.h"
+
+#define CACHE_MAGIC 0x57494649
+#define CACHE_NAMESPACE "wifi_station"
+#define CACHE_KEY "ap"
+
+typedef struct {
+        uint32_t magic;
+        uint8_t channel;
+        uint8_t bssid[6];
+} wifi_station_cache_t;
+
+// Survives a soft reset or deep sleep, NVS covers power cycles
+static RTC_NOINIT_ATTR wifi_station_cache_t rtc_cache;
+static wifi_station_cache_t cache;
+
+static wifi_config_t wifi_config;
+static wifi_station_ready_fn ready_callback;
+static bool ready = false;
+static bool using_cache = false;
+
+static esp_timer_handle_t reconnect_timer;
+static uint32_t backoff = CONFIG_WIFI_STATION_BACKOFF_MIN;
+
+static int64_t start_time;
+static int64_t disconnect_time;
+static wifi_station_metrics_t metrics;
+
+static void cache_load() {
+        if (rtc_cache.magic == CACHE_MAGIC) {
+                cache = rtc_cache;
+                return;
+        }
+
+        nvs_handle_t handle;
+        if (nvs_open(CACHE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+                return;
+        }
+        size_t size = sizeof(cache);
+        if (nvs_get_blob(handle, CACHE_KEY, &cache, &size) != ESP_OK || cache.magic != CACHE_MAGIC) {
+                memset(&cache, 0, sizeof(cache));
+        }
+        nvs_close(handle);
+}
+
+static void cache_store(uint8_t channel, const uint8_t *bssid) {
+        if (cache.magic == CACHE_MAGIC && cache.channel == channel && !memcmp(cache.bssid, bssid, 6)) {
+                return;
+        }
+
+        cache.magic = CACHE_MAGIC;
+        cache.channel = channel;
+        memcpy(cache.bssid, bssid, 6);
+        rtc_cache = cache;
+
+        // Only written when the access point changes
+        nvs_handle_t handle;
+        if (nvs_open(CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+                return;
+        }
+        nvs_set_blob(handle, CACHE_KEY, &cache, sizeof(cache));
+        nvs_commit(handle);
+        nvs_close(handle);
+}
+
+// Scan again on the next connect, the access point may have moved channel
+static void cache_unpin() {
+        wifi_config.sta.channel = 0;
+        wifi_config.sta.bssid_set = false;
+        esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+}
+
+static void cache_forget() {
+        using_cache = false;
+        cache_unpin();
+
+        // Drop every copy, so the next boot scans as well and the access
+        // point found by the scan is stored again
+        cache.magic = 0;
+        rtc_cache.magic = 0;
+        nvs_handle_t handle;
+        if (nvs_open(CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+                return;
+        }
+        esp_err_t err = nvs_erase_key(handle, CACHE_KEY);
+        if (err == ESP_OK) {
+                nvs_commit(handle);
+        } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+                printf("Failed to forget access point: %s\n", esp_err_to_name(err));
+        }
+        nvs_close(handle);
+}
+
+static void connect() {
+        metrics.attempt_count++;
+        esp_wifi_connect();
+}
+
+static void reconnect_timeout(void *_args) {
+        connect();
+}
+
+static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+        int64_t now = esp_timer_get_time();
+
+        if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+                printf("STA start\n");
+                connect();
+        } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+                wifi_event_sta_connected_t *event = event_data;
+                if (!metrics.connect_count) {
+                        metrics.connected_time = now - start_time;
+                        metrics.fast_connect = using_cache;
+                }
+                metrics.connect_count++;
+                cache_store(event->channel, event->bssid);
+                // The cached access point worked, a later disconnect is an
+                // ordinary one and keeps the cache
+                using_cache = false;
+        } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+                wifi_event_sta_disconnected_t *event = event_data;
+                if (!disconnect_time) {
+                        disconnect_time = now;
+                }
+                metrics.disconnect_count++;
+                metrics.last_disconnect_reason = event->reason;
+
+                if (using_cache) {
+                        cache_forget();
+                } else if (wifi_config.sta.bssid_set) {
+                        cache_unpin();
+                }
+
+                printf("STA disconnected (reason %d), retrying in %ums\n", event->reason, backoff);
+                esp_timer_stop(reconnect_timer);
+                esp_timer_start_once(reconnect_timer, backoff * 1000LL);
+                backoff *= 2;
+                if (backoff > CONFIG_WIFI_STATION_BACKOFF_MAX) {
+                        backoff = CONFIG_WIFI_STATION_BACKOFF_MAX;
+                }
+        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+                backoff = CONFIG_WIFI_STATION_BACKOFF_MIN;
+                if (disconnect_time) {
+                        metrics.last_reconnect_time = now - disconnect_time;
+                        disconnect_time = 0;
+                }
+
+                if (!ready) {
+                        ready = true;
+                        metrics.ready_time = now - start_time;
+                        printf("WiFI ready in %lldms (%u attempts%s)\n",
+                               metrics.ready_time / 1000, metrics.attempt_count,
+                               metrics.fast_connect ? ", fast connect" : "");
+                        if (ready_callback) {
+                                ready_callback();
+                        }
+                } else {
+                        printf("WiFI reconnected in %lldms\n", metrics.last_reconnect_time / 1000);
+                }
+        }
+}
+
+int wifi_station_init(const char *ssid, const char *password, wifi_station_ready_fn on_ready) {
+        start_time = esp_timer_get_time();
+        ready_callback = on_ready;
+
+        esp_timer_create_args_t timer_args = {
+                .callback = reconnect_timeout,
+                .name = "wifi_reconnect",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &reconnect_timer));
+
+        ESP_ERROR_CHECK(esp_netif_init());
+
+        ESP_ERROR_CHECK(esp_event_loop_create_default());
+        esp_netif_create_default_wifi_sta();
+
+        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
+        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
+
+        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
+        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
+        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+        strncpy((char *) wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
+        strncpy((char *) wifi_config.sta.password, password, sizeof(wifi_config.sta.password));
+        wifi_config.sta.listen_interval = CONFIG_WIFI_STATION_LISTEN_INTERVAL;
+
+        // Skip the scan and go straight to the last access point
+        cache_load();
+        if (cache.magic == CACHE_MAGIC) {
+                using_cache = true;
+                wifi_config.sta.channel = cache.channel;
+                wifi_config.sta.bssid_set = true;
+                memcpy(wifi_config.sta.bssid, cache.bssid, 6);
+        }
+
+        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+        ESP_ERROR_CHECK(esp_wifi_start());
+
+        return 0;
+}
+
+void wifi_station_get_metrics(wifi_station_metrics_t *result) {
+        *result = metrics;
+}
@@ -0,0 +1,49 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*wifi_station_ready_fn)();
+
+typedef struct {
+        // Microseconds since wifi_station_init()
+        int64_t connected_time;      // first association
+        int64_t ready_time;          // first IP address
+        // Duration of the most recent disconnect to IP address
+        int64_t last_reconnect_time;
+
+        uint32_t attempt_count;
+        uint32_t connect_count;
+        uint32_t disconnect_count;
+        uint8_t last_disconnect_reason;
+
+        // The first connection went straight to the cached channel and BSSID
+        bool fast_connect;
+} wifi_station_metrics_t;
+
+// Bring up the station interface and connect. on_ready is called once, on
+// the first IP address; later reconnects only update the metrics.
+int wifi_station_init(const char *ssid, const char *password, wifi_station_ready_fn on_ready);
+
+void wifi_station_get_metrics(wifi_station_metrics_t *metrics);
@@ -27,13 +27,20 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/timers.h>
 #include <driver/gpio.h>
+#include <esp_timer.h>
 
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
-#include <button.h>
-#include <toggle.h>
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
+#include <input_service.h>
+#include <event_log.h>
 
 #define TAMPERED_PIN 4
 
@@ -170,74 +177,25 @@ void display_alarm() {
 
 #define BOOT_BUTTON 0 // for reset configuration
 
-void on_wifi_ready();
-
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-        if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-                printf("STA start\n");
-                esp_wifi_connect();
-        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-                printf("WiFI ready\n");
-                on_wifi_ready();
-        }
-}
-
-static void wifi_init() {
-        ESP_ERROR_CHECK(esp_netif_init());
-
-        ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
-
-        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-        wifi_config_t wifi_config = {
-                .sta = {
-                        .ssid = WIFI_SSID,
-                        .password = WIFI_PASSWORD,
-                },
-        };
-
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
-}
+event_log_t alarm_log;
 
+void on_wifi_ready();
 
 const int LED_INBUILT_GPIO = CONFIG_LED_GPIO;  // this is the onboard LED used to show on/off only
 bool led_on = false;
 
 void led_write(bool on) {
-        gpio_set_level(LED_INBUILT_GPIO, on ? 0 : 1);
+        status_led_set(on);
 }
 
 void led_init() {
-        gpio_set_direction(LED_INBUILT_GPIO, GPIO_MODE_OUTPUT);
-        led_write(led_on);
-}
-
-void security_system_identify_task(void *_args) {
-        for (int i=0; i<3; i++) {
-                for (int j=0; j<2; j++) {
-                        led_write(true);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                        led_write(false);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                }
-                vTaskDelay(250 / portTICK_PERIOD_MS);
-        }
+        status_led_init(LED_INBUILT_GPIO, false);
         led_write(led_on);
-        vTaskDelete(NULL);
 }
 
 void security_system_identify(homekit_value_t _value) {
         printf("Security System identify\n");
-        xTaskCreate(security_system_identify_task, "Security System identify", 128, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
 void reset_configuration_task() {
@@ -255,38 +213,87 @@ void reset_configuration_task() {
         homekit_server_reset();
         vTaskDelay(1000 / portTICK_PERIOD_MS);
         printf("Restarting\n");
+        event_log_flush(&alarm_log);
         esp_restart();
         vTaskDelete(NULL);
 }
 
 void reset_configuration() {
         printf("Resetting Window Covering configuration\n");
-        xTaskCreate(reset_configuration_task, "Reset Window Covering", 256, NULL, 2, NULL);
+        xTaskCreate(reset_configuration_task, "Reset Window Covering", 2048, NULL, 2, NULL);
 }
 
 
-void button_up_callback(button_event_t event, void* context) {
-        switch (event) {
-        case button_event_single_press:
+void button_up_callback(const input_event_t *event, void* context) {
+        switch (event->type) {
+        case INPUT_EVENT_SINGLE_PRESS:
                 printf("single press\n");
                 break;
-        case button_event_double_press:
+        case INPUT_EVENT_DOUBLE_PRESS:
                 printf("double press\n");
                 break;
-        case button_event_tripple_press:
+        case INPUT_EVENT_TRIPLE_PRESS:
                 printf("tripple press\n");
                 break;
-        case button_event_long_press:
+        case INPUT_EVENT_LONG_PRESS:
                 printf("long press\n");
                 reset_configuration();
                 break;
+        default:
+                break;
+        }
+}
+
+const int SIREN_GPIO = CONFIG_SIREN_GPIO;
+
+void siren_write(bool on) {
+        gpio_set_level(SIREN_GPIO, on ? 1 : 0);
+}
+
+typedef enum {
+        alarm_event_arm = 1,
+        alarm_event_disarm = 2,
+        alarm_event_trigger = 3,
+        alarm_event_tamper = 4,
+} alarm_event_t;
+
+typedef enum {
+        alarm_source_homekit = 0,
+        alarm_source_zone = 1,
+        alarm_source_tamper_switch = 2,
+} alarm_source_t;
+
+void alarm_log_dump(size_t count) {
+        static const char *event_names[] = { "?", "arm", "disarm", "trigger", "tamper" };
+        event_log_record_t records[10];
+
+        if (count > sizeof(records) / sizeof(*records)) {
+                count = sizeof(records) / sizeof(*records);
+        }
+        int n = event_log_read_last(&alarm_log, records, count);
+        for (int i=0; i < n; i++) {
+                printf("Event #%u at %u: %s source=%d value=%u\n",
+                       records[i].seq, records[i].timestamp,
+                       event_names[records[i].type < 5 ? records[i].type : 0],
+                       records[i].source, records[i].value);
         }
 }
 
-void update_state();
+void alarm_log_init() {
+        event_log_storage_t storage;
+        if (event_log_partition_storage(&storage, "eventlog") ||
+            event_log_init(&alarm_log, &storage) ||
+            event_log_start(&alarm_log)) {
+                printf("Failed to initialize event log\n");
+                return;
+        }
+        alarm_log_dump(10);
+}
+
+void alarm_request_update();
 
 void on_update(homekit_characteristic_t *ch, homekit_value_t value, void *context) {
-        update_state();
+        alarm_request_update();
 }
 homekit_characteristic_t security_system_current_state = HOMEKIT_CHARACTERISTIC_(SECURITY_SYSTEM_CURRENT_STATE, 0);
 homekit_characteristic_t security_system_target_state = HOMEKIT_CHARACTERISTIC_(SECURITY_SYSTEM_TARGET_STATE, 0, .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update));
@@ -297,39 +304,168 @@ homekit_characteristic_t security_system_target_state = HOMEKIT_CHARACTERISTIC_(
 // 3 ”Disarmed”
 // 4 ”Alarm Triggered”
 
+void alarm_notify_state(void *_args, uint32_t _arg) {
+        homekit_characteristic_notify(&security_system_current_state, security_system_current_state.value);
+}
+
+// Runs on alarm_task only, which owns the display and the current state
 void update_state() {
         if (security_system_current_state.value.int_value != 1 && security_system_target_state.value.int_value == 1) {
                 security_system_current_state.value = HOMEKIT_UINT8(1);
                 printf("Security System Away Arm.\n");
-                homekit_characteristic_notify(&security_system_current_state, security_system_current_state.value);
+                event_log_add(&alarm_log, alarm_event_arm, alarm_source_homekit, 1);
+                xTimerPendFunctionCall(alarm_notify_state, NULL, 0, 0);
                 display_away();
         }
         else if (security_system_current_state.value.int_value != 2 && security_system_target_state.value.int_value == 2) {
                 security_system_current_state.value = HOMEKIT_UINT8(2);
                 printf("Security System Night Arm.\n");
-                homekit_characteristic_notify(&security_system_current_state, security_system_current_state.value);
+                event_log_add(&alarm_log, alarm_event_arm, alarm_source_homekit, 2);
+                xTimerPendFunctionCall(alarm_notify_state, NULL, 0, 0);
                 display_night();
         }
         else if (security_system_current_state.value.int_value != 2 && security_system_target_state.value.int_value == 3) {
                 security_system_current_state.value = HOMEKIT_UINT8(3);
                 printf("Security System Disarmed.\n");
-                homekit_characteristic_notify(&security_system_current_state, security_system_current_state.value);
+                event_log_add(&alarm_log, alarm_event_disarm, alarm_source_homekit, 3);
+                siren_write(false);
+                xTimerPendFunctionCall(alarm_notify_state, NULL, 0, 0);
                 display_Disarm();
         }
         else if (security_system_current_state.value.int_value != 2 && security_system_target_state.value.int_value == 4) {
                 security_system_current_state.value = HOMEKIT_UINT8(4);
                 printf("Security System Alarm Triggered.\n");
-                homekit_characteristic_notify(&security_system_current_state, security_system_current_state.value);
+                event_log_add(&alarm_log, alarm_event_trigger, alarm_source_homekit, 4);
+                xTimerPendFunctionCall(alarm_notify_state, NULL, 0, 0);
                 display_alarm();
         }
         else if (security_system_current_state.value.int_value != 0 && security_system_target_state.value.int_value == 0) {
                 security_system_current_state.value = HOMEKIT_UINT8(0);
                 printf("Security System Stay Arm.\n");
-                homekit_characteristic_notify(&security_system_current_state, security_system_current_state.value);
+                event_log_add(&alarm_log, alarm_event_arm, alarm_source_homekit, 0);
+                xTimerPendFunctionCall(alarm_notify_state, NULL, 0, 0);
                 display_home();
         }
 }
 
+// Intrusion path: zone ISR -> zone_queue -> alarm_task (high priority, pinned)
+// The siren and display are driven directly from alarm_task, HomeKit is only
+// told afterwards from the timer service task so a slow controller session
+// can never delay the outputs. Target state changes from HomeKit go through
+// the same queue, so alarm_task is the only writer of the display and the
+// current state.
+
+const int8_t zone_gpios[] = {
+        CONFIG_ALARM_ZONE_1_GPIO,
+        CONFIG_ALARM_ZONE_2_GPIO,
+        CONFIG_ALARM_ZONE_3_GPIO,
+        CONFIG_ALARM_ZONE_4_GPIO,
+};
+const size_t zone_count = sizeof(zone_gpios) / sizeof(*zone_gpios);
+
+// Zone number of a target state change instead of a zone edge
+#define ALARM_TARGET_CHANGED 0xff
+
+typedef struct {
+        uint8_t zone;
+        int64_t edge_us;
+} zone_event_t;
+
+static QueueHandle_t zone_queue;
+
+// GPIO edge to siren output, in microseconds
+static int64_t alarm_latency_last = 0;
+static int64_t alarm_latency_min = INT64_MAX;
+static int64_t alarm_latency_max = 0;
+static uint32_t alarm_trigger_count = 0;
+
+static void IRAM_ATTR zone_isr_handler(void *arg) {
+        zone_event_t event = {
+                .zone = (uint32_t) arg,
+                .edge_us = esp_timer_get_time(),
+        };
+        BaseType_t higher_priority_task_woken = pdFALSE;
+        xQueueSendFromISR(zone_queue, &event, &higher_priority_task_woken);
+        if (higher_priority_task_woken) {
+                portYIELD_FROM_ISR();
+        }
+}
+
+void alarm_notify_homekit(void *_args, uint32_t zone) {
+        homekit_characteristic_notify(&security_system_current_state, security_system_current_state.value);
+        printf("Security System Alarm Triggered by zone %u.\n", zone);
+        printf("Trigger latency: %lldus (min %lldus, max %lldus, %u triggers)\n",
+               alarm_latency_last, alarm_latency_min, alarm_latency_max, alarm_trigger_count);
+}
+
+void alarm_task(void *_args) {
+        zone_event_t event;
+
+        while (1) {
+                if (xQueueReceive(zone_queue, &event, portMAX_DELAY) != pdTRUE) {
+                        continue;
+                }
+                if (event.zone == ALARM_TARGET_CHANGED) {
+                        update_state();
+                        continue;
+                }
+                // Zones are active low, ignore glitches that are already gone
+                if (gpio_get_level(zone_gpios[event.zone]) != 0) {
+                        continue;
+                }
+                // Only Stay, Away and Night arm can trigger
+                if (security_system_current_state.value.int_value > 2) {
+                        continue;
+                }
+
+                siren_write(true);
+
+                alarm_latency_last = esp_timer_get_time() - event.edge_us;
+                if (alarm_latency_last < alarm_latency_min) {
+                        alarm_latency_min = alarm_latency_last;
+                }
+                if (alarm_latency_last > alarm_latency_max) {
+                        alarm_latency_max = alarm_latency_last;
+                }
+                alarm_trigger_count++;
+
+                security_system_current_state.value = HOMEKIT_UINT8(4);
+                display_alarm();
+                event_log_add(&alarm_log, alarm_event_trigger, alarm_source_zone, event.zone);
+
+                xTimerPendFunctionCall(alarm_notify_homekit, NULL, event.zone, 0);
+        }
+}
+
+void alarm_request_update() {
+        if (!zone_queue) {
+                return;
+        }
+        zone_event_t event = { .zone = ALARM_TARGET_CHANGED };
+        xQueueSend(zone_queue, &event, portMAX_DELAY);
+}
+
+void alarm_init() {
+        gpio_set_direction(SIREN_GPIO, GPIO_MODE_OUTPUT);
+        siren_write(false);
+
+        // Two edges per zone and a target state change
+        zone_queue = xQueueCreate(zone_count * 2 + 1, sizeof(zone_event_t));
+
+        gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+        for (int i=0; i < zone_count; i++) {
+                if (zone_gpios[i] < 0) {
+                        continue;
+                }
+                gpio_set_direction(zone_gpios[i], GPIO_MODE_INPUT);
+                gpio_set_pull_mode(zone_gpios[i], GPIO_PULLUP_ONLY);
+                gpio_set_intr_type(zone_gpios[i], GPIO_INTR_NEGEDGE);
+                gpio_isr_handler_add(zone_gpios[i], zone_isr_handler, (void *) i);
+        }
+
+        xTaskCreatePinnedToCore(alarm_task, "Alarm", 2048, NULL, configMAX_PRIORITIES - 1, NULL, CONFIG_ALARM_TASK_CORE);
+}
+
       #define DEVICE_NAME "ARMOR Security"
       #define DEVICE_MANUFACTURER "StudioPieters®"
       #define DEVICE_SERIAL "NLDA4SQN1466"
@@ -365,14 +501,16 @@ homekit_accessory_t *accessories[] = {
 
                         NULL
                 }),
+                DIAGNOSTICS_SERVICE,
                 NULL
         }),
         NULL
 };
 
 
-void status_tampered_callback(bool high, void *context) {
-        status_tampered.value = HOMEKIT_UINT8(high ? 1 : 0); // switch from 1:0 to 0:1 to inverse signal.
+void status_tampered_callback(const input_event_t *event, void *context) {
+        status_tampered.value = HOMEKIT_UINT8(event->active ? 1 : 0); // switch from 1:0 to 0:1 to inverse signal.
+        event_log_add(&alarm_log, alarm_event_tamper, alarm_source_tamper_switch, status_tampered.value.int_value);
         homekit_characteristic_notify(&status_tampered, status_tampered.value);
 }
 
@@ -388,7 +526,9 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -399,24 +539,29 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        alarm_log_init();
+        wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+        power_save_init_profile();
+        boot_timeline_mark("wifi_init");
         led_init();
         spi_int();
+        alarm_init();
 
 
-        button_config_t config = BUTTON_CONFIG(
-                button_active_low,
+        input_config_t config = INPUT_BUTTON_CONFIG(
                 .long_press_time = 4000,
-                .max_repeat_presses = 3,
+                .max_presses = 3,
                 );
 
-        int b = button_create(BOOT_BUTTON, config, button_up_callback, NULL);
+        int b = input_service_add(BOOT_BUTTON, config, button_up_callback, NULL);
         if (b) {
                 printf("Failed to initialize a button\n");
         }
 
-        if (toggle_create(TAMPERED_PIN, status_tampered_callback, NULL)) {
+        if (input_service_add(TAMPERED_PIN, INPUT_TOGGLE_CONFIG(), status_tampered_callback, NULL)) {
                 printf("Tampered with ARMOR Alarm system\n");
         }
+        boot_timeline_mark("peripherals");
 }
@@ -0,0 +1,105 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdlib.h>
+
+#include "battery_estimator.h"
+
+const battery_curve_point_t battery_curve_li_ion[] = {
+        { 4200, 100 },
+        { 4150, 95 },
+        { 4110, 90 },
+        { 4080, 85 },
+        { 4020, 80 },
+        { 3980, 75 },
+        { 3950, 70 },
+        { 3910, 65 },
+        { 3870, 60 },
+        { 3850, 55 },
+        { 3840, 50 },
+        { 3820, 45 },
+        { 3800, 40 },
+        { 3790, 35 },
+        { 3770, 30 },
+        { 3750, 25 },
+        { 3730, 20 },
+        { 3710, 15 },
+        { 3690, 10 },
+        { 3610, 5 },
+        { 3270, 0 },
+};
+const int battery_curve_li_ion_size = sizeof(battery_curve_li_ion) / sizeof(*battery_curve_li_ion);
+
+static int compare_samples(const void *a, const void *b) {
+        return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+uint32_t battery_trimmed_mean(uint16_t *samples, int count, int trim) {
+        if (count <= 2 * trim) {
+                return 0;
+        }
+
+        qsort(samples, count, sizeof(*samples), compare_samples);
+
+        uint32_t sum = 0;
+        for (int i = trim; i < count - trim; i++) {
+                sum += samples[i];
+        }
+        return (sum + (count - 2 * trim) / 2) / (count - 2 * trim);
+}
+
+uint8_t battery_curve_percent(const battery_curve_point_t *curve, int curve_size, uint32_t voltage) {
+        if (voltage >= curve[0].voltage) {
+                return curve[0].percent;
+        }
+
+        for (int i=1; i < curve_size; i++) {
+                if (voltage >= curve[i].voltage) {
+                        const battery_curve_point_t *high = &curve[i-1], *low = &curve[i];
+                        return low->percent + (voltage - low->voltage) * (high->percent - low->percent)
+                               / (high->voltage - low->voltage);
+                }
+        }
+        return curve[curve_size - 1].percent;
+}
+
+void battery_estimator_init(battery_estimator_t *estimator, battery_estimator_config_t config) {
+        estimator->config = config;
+        estimator->percent = -1;
+}
+
+uint8_t battery_estimator_update(battery_estimator_t *estimator, uint32_t voltage, bool charging) {
+        battery_estimator_config_t *config = &estimator->config;
+        int percent = battery_curve_percent(config->curve, config->curve_size, voltage);
+
+        if (estimator->percent < 0) {
+                estimator->percent = percent;
+        } else if (percent > estimator->percent) {
+                int threshold = charging ? config->hysteresis : config->rise;
+                if (percent - estimator->percent >= threshold || percent == 100) {
+                        estimator->percent = percent;
+                }
+        } else if (estimator->percent - percent >= config->hysteresis || percent == 0) {
+                estimator->percent = percent;
+        }
+
+        return estimator->percent;
+}
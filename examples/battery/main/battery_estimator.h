@@ -0,0 +1,74 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Turns battery voltage readings into a stable state of charge.
+//
+// A burst of raw ADC samples is reduced to one value with a trimmed mean.
+// The voltage is mapped to a percentage through a piecewise-linear
+// discharge curve. The reported value only moves by at least hysteresis
+// percent, and while discharging it does not rise by less than rise
+// percent, so load and temperature swings of the cell voltage do not make
+// it wander.
+
+typedef struct {
+        uint16_t voltage;    // mV
+        uint8_t percent;
+} battery_curve_point_t;
+
+// Resting voltage of a single Li-ion/Li-Po cell, highest voltage first
+extern const battery_curve_point_t battery_curve_li_ion[];
+extern const int battery_curve_li_ion_size;
+
+typedef struct {
+        const battery_curve_point_t *curve;
+        int curve_size;
+        uint8_t hysteresis;
+        uint8_t rise;
+} battery_estimator_config_t;
+
+#define BATTERY_ESTIMATOR_CONFIG(...) \
+        (battery_estimator_config_t) { \
+                .curve = battery_curve_li_ion, \
+                .curve_size = battery_curve_li_ion_size, \
+                .hysteresis = 2, \
+                .rise = 5, \
+                __VA_ARGS__ \
+        }
+
+typedef struct {
+        battery_estimator_config_t config;
+        int percent;         // reported value, -1 before the first update
+} battery_estimator_t;
+
+void battery_estimator_init(battery_estimator_t *estimator, battery_estimator_config_t config);
+
+// Mean of samples without the trim lowest and trim highest ones, sorts samples
+uint32_t battery_trimmed_mean(uint16_t *samples, int count, int trim);
+
+uint8_t battery_curve_percent(const battery_curve_point_t *curve, int curve_size, uint32_t voltage);
+
+// Feed a voltage in mV, returns the percentage to report
+uint8_t battery_estimator_update(battery_estimator_t *estimator, uint32_t voltage, bool charging);
@@ -30,58 +30,70 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <driver/gpio.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+#include <esp_system.h>
 
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
+#include <wifi_station.h>
+#include <diagnostics.h>
+#ifdef CONFIG_LOW_POWER_MODE
+#include <esp_sleep.h>
+#include <power_save.h>
+#endif
 
 #include "driver/adc.h"
 #include "esp_adc_cal.h"
+#include "battery_estimator.h"
 // Define ADC settings
 #define DEFAULT_VREF 1100
 static esp_adc_cal_characteristics_t *adc_chars;
 static const adc_channel_t channel = ADC_CHANNEL_6;     // GPIO34 on ESP32 WROOM 32D
 static const adc_bits_width_t width = ADC_WIDTH_BIT_12;
-static const adc_atten_t atten = ADC_ATTEN_DB_0;
 static const adc_unit_t unit = ADC_UNIT_1;
 
-void on_wifi_ready();
-
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-        if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-                printf("STA start\n");
-                esp_wifi_connect();
-        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-                printf("WiFI ready\n");
-                on_wifi_ready();
-        }
-}
-
-static void wifi_init() {
-        ESP_ERROR_CHECK(esp_netif_init());
-
-        ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
-
-        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-        wifi_config_t wifi_config = {
-                .sta = {
-                        .ssid = WIFI_SSID,
-                        .password = WIFI_PASSWORD,
-                },
-        };
+// Highest pin voltage in mV with usable linearity for each attenuation
+#if defined(CONFIG_BATTERY_ADC_ATTEN_11DB)
+static const adc_atten_t atten = ADC_ATTEN_DB_11;
+#define BATTERY_ADC_MAX_VOLTAGE 2450
+#elif defined(CONFIG_BATTERY_ADC_ATTEN_6DB)
+static const adc_atten_t atten = ADC_ATTEN_DB_6;
+#define BATTERY_ADC_MAX_VOLTAGE 1750
+#elif defined(CONFIG_BATTERY_ADC_ATTEN_2_5DB)
+static const adc_atten_t atten = ADC_ATTEN_DB_2_5;
+#define BATTERY_ADC_MAX_VOLTAGE 1250
+#else
+static const adc_atten_t atten = ADC_ATTEN_DB_0;
+#define BATTERY_ADC_MAX_VOLTAGE 950
+#endif
+
+// The battery is measured through a divider, VBAT -- R1 -- GPIO34 -- R2 -- GND
+#define BATTERY_DIVIDER_R1 CONFIG_BATTERY_DIVIDER_R1
+#define BATTERY_DIVIDER_R2 CONFIG_BATTERY_DIVIDER_R2
+#define BATTERY_FULL_VOLTAGE 4200
+// Samples per reading, the highest and lowest eighth are dropped
+#define BATTERY_SAMPLES 64
+#define BATTERY_SAMPLES_TRIM (BATTERY_SAMPLES / 8)
+// Below this there is no cell connected
+#define BATTERY_MIN_VOLTAGE 2500
+
+static battery_estimator_t battery_estimator;
+
+// Last reported values, kept in RTC memory so a watchdog or brownout reset
+// starts from them instead of announcing 0% until the first reading
+#define BATTERY_RETAINED_MAGIC 0xba77e41a
+typedef struct {
+        uint32_t magic;
+        int8_t percent;
+        uint8_t charging_state;
+        uint8_t status_low_battery;
+} battery_retained_t;
+
+static RTC_NOINIT_ATTR battery_retained_t battery_retained;
 
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
-}
+void on_wifi_ready();
 
 const int STAT1 = 35;     // GPIO35 on ESP32 WROOM 32D - Input only
 const int STAT2 = 36;     // GPIO35 on ESP32 WROOM 32D - SensVP - Input only
@@ -104,10 +116,72 @@ const int PG = 39;        // GPIO39 on ESP32 WROOM 32D - SensVN - Input only
 //| No Input Power Present    | Off   | Off   | Off |
 //+---------------------------+-------+-------+-----+
 
+// One task handles the charger pins and the battery level. It sleeps until
+// a pin changes or the level timer expires.
+#ifdef CONFIG_LOW_POWER_MODE
+#define BATTERY_LEVEL_PERIOD 300000
+#else
+#define BATTERY_LEVEL_PERIOD 60000
+#endif
+// Time the STAT pins get to settle after an edge before they are read
+#define CHARGER_SETTLE_TIME 20
+
+#define BATTERY_EVENT_CHARGER (1 << 0)
+#define BATTERY_EVENT_LEVEL (1 << 1)
+
+TaskHandle_t battery_task_handle;
+
+static void IRAM_ATTR charger_isr(void *arg) {
+        BaseType_t woken = pdFALSE;
+#ifdef CONFIG_LOW_POWER_MODE
+        // Level interrupt, it stays off until charger_arm() after the read
+        gpio_intr_disable((uint32_t) arg);
+#endif
+        xTaskNotifyFromISR(battery_task_handle, BATTERY_EVENT_CHARGER, eSetBits, &woken);
+        if (woken) {
+                portYIELD_FROM_ISR();
+        }
+}
+
+void battery_level_timer(void *arg) {
+        xTaskNotify(battery_task_handle, BATTERY_EVENT_LEVEL, eSetBits);
+}
+
+const int charger_gpios[] = { STAT1, STAT2, PG };
+
+#ifdef CONFIG_LOW_POWER_MODE
+// Light sleep only wakes on a GPIO level, not an edge. Each pin waits for
+// the level opposite to the one just read, so any change wakes the chip.
+// GPIO36/39 can raise a spurious interrupt while Wi-Fi sleeps (ESP32
+// errata 3.11), which only costs an extra read here.
+void charger_arm() {
+        for (int i=0; i < 3; i++) {
+                int level = gpio_get_level(charger_gpios[i]);
+                gpio_wakeup_enable(charger_gpios[i], level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+                gpio_intr_enable(charger_gpios[i]);
+        }
+}
+#endif
+
 void gpio_init() {
-        gpio_set_direction(STAT1, GPIO_MODE_INPUT);
-        gpio_set_direction(STAT2, GPIO_MODE_INPUT);
-        gpio_set_direction(PG, GPIO_MODE_INPUT);
+#ifdef CONFIG_LOW_POWER_MODE
+        // The ISR calls gpio_intr_disable(), which is not in IRAM
+        gpio_install_isr_service(0);
+#else
+        gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+#endif
+
+        for (int i=0; i < 3; i++) {
+                gpio_set_direction(charger_gpios[i], GPIO_MODE_INPUT);
+#ifndef CONFIG_LOW_POWER_MODE
+                gpio_set_intr_type(charger_gpios[i], GPIO_INTR_ANYEDGE);
+#endif
+                gpio_isr_handler_add(charger_gpios[i], charger_isr, (void *) charger_gpios[i]);
+        }
+#ifdef CONFIG_LOW_POWER_MODE
+        charger_arm();
+        esp_sleep_enable_gpio_wakeup();
+#endif
 }
 
 void led_identify(homekit_value_t _value) {
@@ -128,38 +202,54 @@ homekit_characteristic_t revision = HOMEKIT_CHARACTERISTIC_(FIRMWARE_REVISION,
 /////// BATTERY LEVEL - HAP Manual - ”9.10 Battery Level” (page 162) ///////
 homekit_characteristic_t battery_level = HOMEKIT_CHARACTERISTIC_(BATTERY_LEVEL, 0);
 
-void battery_level_task(void *pvParameters){
+extern homekit_characteristic_t charging_state;
+
+void battery_level_update() {
+        static uint16_t samples[BATTERY_SAMPLES];
 
+        for (int i=0; i < BATTERY_SAMPLES; i++) {
+                samples[i] = adc1_get_raw((adc1_channel_t)channel);
+        }
+        uint32_t adc_reading = battery_trimmed_mean(samples, BATTERY_SAMPLES, BATTERY_SAMPLES_TRIM);
+//Convert adc_reading to voltage in mV, at the battery
+        uint32_t voltage = esp_adc_cal_raw_to_voltage(adc_reading, adc_chars)
+                           * (BATTERY_DIVIDER_R1 + BATTERY_DIVIDER_R2) / BATTERY_DIVIDER_R2;
+
+        if (voltage < BATTERY_MIN_VOLTAGE) {
+                printf("Couldnt find battery (%umV, check the divider and attenuation settings)\n", voltage);
+                return;
+        }
+
+        bool charging = (charging_state.value.int_value == 1);
+        uint8_t percentage = battery_estimator_update(&battery_estimator, voltage, charging);
+        printf("Raw: %u  Voltage: %umV  Percentage: %u%%\n", adc_reading, voltage, percentage);
+
+        if (battery_level.value.int_value != percentage) {
+                battery_level.value = HOMEKIT_UINT8(percentage);
+                homekit_characteristic_notify(&battery_level, battery_level.value);
+        }
+        battery_retained.percent = percentage;
+}
+
+void battery_level_init(){
 // Configure ADC
         adc1_config_width(width);
         adc1_config_channel_atten(channel, atten);
 
 //Characterize ADC
         adc_chars = calloc(1, sizeof(esp_adc_cal_characteristics_t));
-        esp_adc_cal_characterize(unit, atten, width, DEFAULT_VREF, adc_chars);
-
-        while (1) {
-                uint32_t adc_reading = 0;
-                adc_reading = adc1_get_raw((adc1_channel_t)channel);
-//Convert adc_reading to voltage in mV
-                uint32_t voltage = esp_adc_cal_raw_to_voltage(adc_reading, adc_chars);
-//Convert adc_reading to voltage in Percentage
-// 4,2 ~ 3,1V
-                uint8_t percentage = 100 * (adc_reading - 0) / (4095 - 0);
-                printf("Raw: %d  Voltage: %dmV  Percentage: %%d\n", adc_reading, voltage, percentage);
-
-                if (percentage > 0) {
-                        homekit_characteristic_notify(&battery_level, HOMEKIT_UINT8(percentage));
-                }
-                else {
-                        printf("Couldnt find battery\n");
-                }
-                vTaskDelay(3000 / portTICK_PERIOD_MS);
+        esp_adc_cal_value_t calibration = esp_adc_cal_characterize(unit, atten, width, DEFAULT_VREF, adc_chars);
+        printf("ADC calibrated from %s\n",
+               (calibration == ESP_ADC_CAL_VAL_EFUSE_TP) ? "eFuse two point" :
+               (calibration == ESP_ADC_CAL_VAL_EFUSE_VREF) ? "eFuse Vref" : "default Vref");
+
+        uint32_t full_voltage = BATTERY_FULL_VOLTAGE * BATTERY_DIVIDER_R2 / (BATTERY_DIVIDER_R1 + BATTERY_DIVIDER_R2);
+        if (full_voltage > BATTERY_ADC_MAX_VOLTAGE) {
+                printf("A full battery gives %umV at GPIO34, above the %umV ADC range, raise the attenuation\n",
+                       full_voltage, BATTERY_ADC_MAX_VOLTAGE);
         }
-}
 
-void battery_level_init(){
-        xTaskCreate(battery_level_task, "Battery Level", configMINIMAL_STACK_SIZE * 3, NULL, 5, NULL);
+        battery_estimator_init(&battery_estimator, BATTERY_ESTIMATOR_CONFIG());
 }
 
 /////// CHARGING STATE - HAP Manual - ”9.19 Charging State” (page 166) ///////
@@ -170,29 +260,6 @@ void battery_level_init(){
 
 homekit_characteristic_t charging_state = HOMEKIT_CHARACTERISTIC_(CHARGING_STATE, 0);
 
-void charging_state_task(void *arg) {
-
-        while (1) {
-                if (gpio_get_level(STAT1) == 0 && gpio_get_level(STAT2) == 1 && gpio_get_level(PG) == 1) {
-                        printf("Not Charging - Charge Complete - Standby\n");
-                        homekit_characteristic_notify(&charging_state, HOMEKIT_UINT8(0));
-                }
-                else if (gpio_get_level(STAT1) == 1 && gpio_get_level(STAT2) == 0 && gpio_get_level(PG) == 1) {
-                        printf("Charging\n");
-                        homekit_characteristic_notify(&charging_state, HOMEKIT_UINT8(1));
-                }
-                else if (gpio_get_level(STAT1) == 0 && gpio_get_level(STAT2) == 0 && gpio_get_level(PG) == 1) {
-                        printf("Not Chargeable - No Battery Present\n");
-                        homekit_characteristic_notify(&charging_state, HOMEKIT_UINT8(2));
-                }
-                vTaskDelay(3000 / portTICK_PERIOD_MS);
-        }
-}
-
-void charging_state_init(){
-        xTaskCreate(charging_state_task, "Charging State", 1024, NULL, 2, NULL);
-}
-
 /////// STATUS LOW BATTERY - HAP Manual - ”9.99 Status Low Battery” (page 213) ///////
 
 // 0 ”Battery level is normal”
@@ -200,23 +267,103 @@ void charging_state_init(){
 
 homekit_characteristic_t status_low_battery = HOMEKIT_CHARACTERISTIC_(STATUS_LOW_BATTERY, 0);
 
-void battery_status_task(void *arg) {
+// The truth table above indexed by STAT1 << 2 | STAT2 << 1 | PG, -1 leaves
+// a characteristic as it is
+typedef struct {
+        const char *description;
+        int8_t charging_state;
+        int8_t status_low_battery;
+} charger_status_t;
+
+const charger_status_t charger_statuses[8] = {
+        [0b000] = { "Shutdown - No Input Power", -1, -1 },
+        [0b001] = { "Not Chargeable - No Battery Present", 2, -1 },
+        [0b010] = { "Invalid", -1, -1 },
+        [0b011] = { "Not Charging - Charge Complete - Standby", 0, 0 },
+        [0b100] = { "Low Battery Output", -1, 1 },
+        [0b101] = { "Charging", 1, -1 },
+        [0b110] = { "Invalid", -1, -1 },
+        [0b111] = { "Temperature or Timer Fault", -1, -1 },
+};
+
+void charger_update() {
+        // One snapshot of all three pins, so a state is never decoded from
+        // pins read on either side of an edge
+        int code = (gpio_get_level(STAT1) << 2) | (gpio_get_level(STAT2) << 1) | gpio_get_level(PG);
+        const charger_status_t *status = &charger_statuses[code];
+        printf("%s\n", status->description);
+
+        if (status->charging_state >= 0 && charging_state.value.int_value != status->charging_state) {
+                charging_state.value = HOMEKIT_UINT8(status->charging_state);
+                homekit_characteristic_notify(&charging_state, charging_state.value);
+        }
+        if (status->status_low_battery >= 0 && status_low_battery.value.int_value != status->status_low_battery) {
+                status_low_battery.value = HOMEKIT_UINT8(status->status_low_battery);
+                homekit_characteristic_notify(&status_low_battery, status_low_battery.value);
+        }
+        battery_retained.charging_state = charging_state.value.int_value;
+        battery_retained.status_low_battery = status_low_battery.value.int_value;
+}
+
+void battery_retained_restore() {
+        esp_reset_reason_t reason = esp_reset_reason();
+        if (battery_retained.magic != BATTERY_RETAINED_MAGIC
+            || reason == ESP_RST_POWERON || reason == ESP_RST_UNKNOWN) {
+                battery_retained = (battery_retained_t) {
+                        .magic = BATTERY_RETAINED_MAGIC,
+                        .percent = -1,
+                };
+                return;
+        }
+
+        printf("Restoring battery state after reset: %d%%\n", battery_retained.percent);
+        charging_state.value = HOMEKIT_UINT8(battery_retained.charging_state);
+        status_low_battery.value = HOMEKIT_UINT8(battery_retained.status_low_battery);
+        if (battery_retained.percent >= 0) {
+                battery_level.value = HOMEKIT_UINT8(battery_retained.percent);
+                battery_estimator.percent = battery_retained.percent;
+        }
+}
+
+void battery_task(void *arg) {
+        uint32_t events = BATTERY_EVENT_CHARGER | BATTERY_EVENT_LEVEL;
 
         while (1) {
-                if (gpio_get_level(STAT1) == 0 && gpio_get_level(STAT2) == 1 && gpio_get_level(PG) == 1) {
-                        printf("Battery level is normal\n");
-                        homekit_characteristic_notify(&status_low_battery, HOMEKIT_UINT8(0));
+                if (events & BATTERY_EVENT_CHARGER) {
+                        vTaskDelay(CHARGER_SETTLE_TIME / portTICK_PERIOD_MS);
+                        // Edges during the settle time are covered by this read
+                        uint32_t more = 0;
+                        xTaskNotifyWait(0, UINT32_MAX, &more, 0);
+                        events |= more;
+                        charger_update();
+#ifdef CONFIG_LOW_POWER_MODE
+                        charger_arm();
+#endif
                 }
-                else if (gpio_get_level(STAT1) == 1 && gpio_get_level(STAT2) == 0 && gpio_get_level(PG) == 0) {
-                        printf("Battery level is low\n");
-                        homekit_characteristic_notify(&status_low_battery, HOMEKIT_UINT8(1));
+                if (events & BATTERY_EVENT_LEVEL) {
+                        battery_level_update();
+#ifdef CONFIG_LOW_POWER_MODE
+                        power_save_dump();
+#endif
                 }
-                vTaskDelay(3000 / portTICK_PERIOD_MS);
+
+                xTaskNotifyWait(0, UINT32_MAX, &events, portMAX_DELAY);
         }
 }
 
-void battery_status_init(){
-        xTaskCreate(battery_status_task, "Battery Status", 1024, NULL, 2, NULL);
+void battery_init() {
+        battery_level_init();
+        battery_retained_restore();
+
+        xTaskCreate(battery_task, "Battery", 3072, NULL, 2, &battery_task_handle);
+
+        esp_timer_handle_t level_timer;
+        esp_timer_create_args_t timer_args = {
+                .callback = battery_level_timer,
+                .name = "battery_level",
+        };
+        esp_timer_create(&timer_args, &level_timer);
+        esp_timer_start_periodic(level_timer, BATTERY_LEVEL_PERIOD * 1000);
 }
 
 homekit_accessory_t *accessories[] = {
@@ -237,6 +384,7 @@ homekit_accessory_t *accessories[] = {
                         &status_low_battery,
                         NULL
                 }),
+                DIAGNOSTICS_SERVICE,
                 NULL
         }),
         NULL
@@ -249,7 +397,9 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -260,12 +410,15 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+        boot_timeline_mark("wifi_init");
+#ifdef CONFIG_LOW_POWER_MODE
+        power_save_init(POWER_SAVE_CONFIG(.light_sleep = true, .wifi_ps = WIFI_PS_MAX_MODEM));
+#endif
 
+        battery_init();
         gpio_init();
-
-        battery_level_init();
-        charging_state_init();
-        battery_status_init();
+        boot_timeline_mark("peripherals");
 }
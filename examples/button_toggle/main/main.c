@@ -22,6 +22,7 @@
  **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_log.h>
@@ -34,126 +35,64 @@
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
-#include "toggle.h"
-#include "button.h"
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
+#include <relay_bank.h>
+#include <input_service.h>
 
 void on_wifi_ready();
 
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-        if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-                printf("STA start\n");
-                esp_wifi_connect();
-        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-                printf("WiFI ready\n");
-                on_wifi_ready();
-        }
-}
-
-static void wifi_init() {
-        ESP_ERROR_CHECK(esp_netif_init());
-
-        ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
-
-        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-        wifi_config_t wifi_config = {
-                .sta = {
-                        .ssid = WIFI_SSID,
-                        .password = WIFI_PASSWORD,
-                },
-        };
-
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
-}
-
-const int relay_gpio = 12;
 const int led_gpio = CONFIG_LED_GPIO;
 const int button_gpio = 0;
 const int toggle_gpio = 14;
 bool led_on = false;
 
-void toggle_callback(uint8_t toggle_gpio);
-void switch_on_callback(homekit_characteristic_t *_ch, homekit_value_t on, void *context);
-void button_callback(uint8_t button_gpio, button_event_t event);
-
-void relay_write(bool on) {
-        gpio_set_level(relay_gpio, on ? 1 : 0);
-}
+void toggle_callback(const input_event_t *event, void *context);
+void button_callback(const input_event_t *event, void *context);
 
 void led_write(bool on) {
-        gpio_set_level(led_gpio, on ? 1 : 0);
+        status_led_set(on);
 }
 
 void led_init() {
-        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+        status_led_init(led_gpio, true);
         led_write(led_on);
 }
 
 
-void led_identify_task(void *_args) {
-        for (int i=0; i<3; i++) {
-                for (int j=0; j<2; j++) {
-                        led_write(true);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                        led_write(false);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                }
-
-                vTaskDelay(250 / portTICK_PERIOD_MS);
-        }
-
-        led_write(false);
-
-        vTaskDelete(NULL);
-}
-
 void led_identify(homekit_value_t _value) {
         printf("LED identify\n");
-        xTaskCreate(led_identify_task, "LED identify", 512, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
-homekit_characteristic_t switch_on = HOMEKIT_CHARACTERISTIC_(ON, false, .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(switch_on_callback));
-
-void relay_init() {
-        gpio_set_direction(relay_gpio, GPIO_MODE_OUTPUT);
-        relay_write(switch_on.value.bool_value);
-        gpio_set_direction(toggle_gpio, GPIO_MODE_INPUT);
+const relay_desc_t relays[] = {
+        RELAY_DESC(12, .name = "HomeKit Switch", .type = RELAY_TYPE_SWITCH),
+};
 
-}
+relay_bank_t *relay_bank;
 
-void switch_on_callback(homekit_characteristic_t *_ch, homekit_value_t on, void *context) {
-        relay_write(switch_on.value.bool_value);
+void relay_toggle() {
+        relay_bank_set(relay_bank, 0, !relay_bank_get(relay_bank, 0));
 }
 
-void button_callback(uint8_t gpio, button_event_t event) {
-        switch (event) {
-        case button_event_single_press:
-                printf("Toggling relay due to button at GPIO %2d\n", gpio);
-                switch_on.value.bool_value = !switch_on.value.bool_value;
-                relay_write(switch_on.value.bool_value);
-                homekit_characteristic_notify(&switch_on, switch_on.value);
+void button_callback(const input_event_t *event, void *context) {
+        switch (event->type) {
+        case INPUT_EVENT_SINGLE_PRESS:
+                printf("Toggling relay due to button at GPIO %2d\n", event->gpio);
+                relay_toggle();
                 break;
-        case button_event_long_press:
+        case INPUT_EVENT_LONG_PRESS:
 
                 break;
         default:
-                printf("Unknown button event: %d\n", event);
+                printf("Unknown button event: %d\n", event->type);
         }
 }
 
-void toggle_callback(uint8_t gpio) {
-        switch_on.value.bool_value = !switch_on.value.bool_value;
-        relay_write(switch_on.value.bool_value);
-        homekit_characteristic_notify(&switch_on, switch_on.value);
+void toggle_callback(const input_event_t *event, void *context) {
+        relay_toggle();
 }
 
 #define DEVICE_NAME "HomeKit Switch"
@@ -168,35 +107,45 @@ homekit_characteristic_t serial = HOMEKIT_CHARACTERISTIC_(SERIAL_NUMBER, DEVICE_
 homekit_characteristic_t model= HOMEKIT_CHARACTERISTIC_(MODEL, DEVICE_MODEL);
 homekit_characteristic_t revision = HOMEKIT_CHARACTERISTIC_(FIRMWARE_REVISION,  FW_VERSION);
 
-homekit_accessory_t *accessories[] = {
-        HOMEKIT_ACCESSORY(.id=1, .category=homekit_accessory_category_lightbulb, .services=(homekit_service_t*[]){
-                HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
-                        &name,
-                        &manufacturer,
-                        &serial,
-                        &model,
-                        &revision,
-                        HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
-                        NULL
-                }),
-                HOMEKIT_SERVICE(SWITCH, .primary=true, .characteristics=(homekit_characteristic_t*[]){
-                        HOMEKIT_CHARACTERISTIC(NAME, "HomeKit Switch"),
-                        &switch_on,
-                        NULL
-                }),
+homekit_service_t *head_services[] = {
+        HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
+                &name,
+                &manufacturer,
+                &serial,
+                &model,
+                &revision,
+                HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
                 NULL
         }),
         NULL
 };
 
+homekit_service_t *tail_services[] = {
+        DIAGNOSTICS_SERVICE,
+        NULL
+};
+
 homekit_server_config_t config = {
-        .accessories = accessories,
         .password = "338-77-883",
         .setupId="1QJ8",
 };
 
+void relay_init() {
+        relay_bank = relay_bank_create(relays, sizeof(relays) / sizeof(*relays),
+                                       homekit_accessory_category_lightbulb,
+                                       head_services, tail_services, NULL);
+        if (!relay_bank) {
+                abort();
+        }
+        relay_bank_zero_cross_init(relay_bank, RELAY_ZERO_CROSS_CONFIG());
+        relay_bank_restore(relay_bank, "relays", RELAY_POWER_ON_DEFAULT);
+        config.accessories = relay_bank->accessories;
+}
+
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -207,22 +156,23 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
-        led_init();
         relay_init();
+        wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+        power_save_init_profile();
+        boot_timeline_mark("wifi_init");
+        led_init();
 
-        button_config_t button_config = BUTTON_CONFIG(
-                button_active_low,
-                .max_repeat_presses=0,
+        input_config_t button_config = INPUT_BUTTON_CONFIG(
                 .long_press_time=4000,
                 );
-        if (button_create(button_gpio, button_config, button_callback, NULL)) {
+        if (input_service_add(button_gpio, button_config, button_callback, NULL)) {
                 printf("Failed to initialize button\n");
         }
 
-        if (toggle_create(toggle_gpio, toggle_callback, NULL)) {
+        if (input_service_add(toggle_gpio, INPUT_TOGGLE_CONFIG(), toggle_callback, NULL)) {
                 printf("Failed to initialize toggle\n");
         }
-
+        boot_timeline_mark("peripherals");
 }
@@ -22,6 +22,7 @@
  **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_log.h>
@@ -34,152 +35,52 @@
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
-#include "toggle.h"
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
+#include <relay_bank.h>
+#include <input_service.h>
 
 void on_wifi_ready();
 
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-        if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-                printf("STA start\n");
-                esp_wifi_connect();
-        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-                printf("WiFI ready\n");
-                on_wifi_ready();
-        }
-}
-
-static void wifi_init() {
-        ESP_ERROR_CHECK(esp_netif_init());
-
-        ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
-
-        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-        wifi_config_t wifi_config = {
-                .sta = {
-                        .ssid = WIFI_SSID,
-                        .password = WIFI_PASSWORD,
-                },
-        };
-
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
-}
-
-const int relay0_gpio = 12;
-const int relay1_gpio = 5;
 const int led_gpio = CONFIG_LED_GPIO;
 const int button_gpio = 9;
 bool led_on = false;
 
 void led_write(bool on) {
-        gpio_set_level(led_gpio, on ? 1 : 0);
-}
-
-void relay_write(int relay, bool on) {
-        gpio_set_level(relay, on ? 1 : 0);
+        status_led_set(on);
 }
 
 void led_init() {
-        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+        status_led_init(led_gpio, true);
         led_write(led_on);
 }
 
-int lamp_state = 3;
-
-void top_light_on_set(homekit_value_t value);
-void bottom_light_on_set(homekit_value_t value);
+const relay_desc_t relays[] = {
+        RELAY_DESC(12, .name = "Top Light"),
+        RELAY_DESC(5, .name = "Bottom Light"),
+};
 
-homekit_characteristic_t top_light_on = HOMEKIT_CHARACTERISTIC_(
-        ON, true,
-        .setter=top_light_on_set,
-        );
-homekit_characteristic_t bottom_light_on = HOMEKIT_CHARACTERISTIC_(
-        ON, true,
-        .setter=bottom_light_on_set,
-        );
+relay_bank_t *relay_bank;
 
+// Bit 0 is the top light, bit 1 the bottom light. Both relays switch in
+// one write, also when a scene sets both lights.
 void lamp_state_set(int state) {
-        lamp_state = state % 4;
-        bool top_on = (state & 1) != 0;
-        bool bottom_on = (state & 2) != 0;
-
-        printf("Setting state %d, top = %s, bottom = %s\n",
-               lamp_state, (top_on ? "on" : "off"), (bottom_on ? "on" : "off"));
-
-        relay_write(relay0_gpio, top_on);
-        relay_write(relay1_gpio, bottom_on);
-
-        if (top_on != top_light_on.value.bool_value) {
-                top_light_on.value = HOMEKIT_BOOL(top_on);
-                homekit_characteristic_notify(&top_light_on, top_light_on.value);
-        }
-
-        if (bottom_on != bottom_light_on.value.bool_value) {
-                bottom_light_on.value = HOMEKIT_BOOL(bottom_on);
-                homekit_characteristic_notify(&bottom_light_on, bottom_light_on.value);
-        }
+        relay_bank_set_mask(relay_bank, 0b11, state % 4);
 }
 
-void top_light_on_set(homekit_value_t value) {
-        top_light_on.value = value;
-
-        lamp_state_set(
-                (top_light_on.value.bool_value ? 1 : 0) |
-                (bottom_light_on.value.bool_value ? 2 : 0)
-                );
-}
-
-void bottom_light_on_set(homekit_value_t value) {
-        bottom_light_on.value = value;
-
-        lamp_state_set(
-                (top_light_on.value.bool_value ? 1 : 0) | (bottom_light_on.value.bool_value ? 2 : 0)
-                );
-}
-
-void gpio_init() {
-        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
-        led_write(false);
-
-        gpio_set_direction(relay0_gpio, GPIO_MODE_OUTPUT);
-        gpio_set_direction(relay1_gpio, GPIO_MODE_OUTPUT);
-        relay_write(relay0_gpio, true);
-        relay_write(relay1_gpio, true);
+void lamp_changed(relay_bank_t *bank, int index, bool on, void *context) {
+        printf("%s %s\n", relays[index].name, on ? "on" : "off");
 }
 
-void toggle_callback(uint8_t gpio) {
-        lamp_state_set(lamp_state+1);
-}
-
-void led_identify_task(void *_args) {
-        for (int i=0; i<3; i++) {
-                for (int j=0; j<2; j++) {
-                        led_write(true);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                        led_write(false);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                }
-
-                vTaskDelay(250 / portTICK_PERIOD_MS);
-        }
-
-        led_write(false);
-
-        vTaskDelete(NULL);
+void toggle_callback(const input_event_t *event, void *context) {
+        lamp_state_set(relay_bank_get_mask(relay_bank) + 1);
 }
 
 void led_identify(homekit_value_t _value) {
         printf("LED identify\n");
-        xTaskCreate(led_identify_task, "LED identify", 512, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
 
@@ -195,40 +96,46 @@ homekit_characteristic_t serial = HOMEKIT_CHARACTERISTIC_(SERIAL_NUMBER, DEVICE_
 homekit_characteristic_t model= HOMEKIT_CHARACTERISTIC_(MODEL, DEVICE_MODEL);
 homekit_characteristic_t revision = HOMEKIT_CHARACTERISTIC_(FIRMWARE_REVISION,  FW_VERSION);
 
-homekit_accessory_t *accessories[] = {
-        HOMEKIT_ACCESSORY(.id=1, .category=homekit_accessory_category_lightbulb, .services=(homekit_service_t*[]){
-                HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
-                        &name,
-                        &manufacturer,
-                        &serial,
-                        &model,
-                        &revision,
-                        HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
-                        NULL
-                }),
-                HOMEKIT_SERVICE(LIGHTBULB, .primary=true, .characteristics=(homekit_characteristic_t*[]){
-                        HOMEKIT_CHARACTERISTIC(NAME, "Top Light"),
-                        &top_light_on,
-                        NULL
-                }),
-                HOMEKIT_SERVICE(LIGHTBULB, .characteristics=(homekit_characteristic_t*[]){
-                        HOMEKIT_CHARACTERISTIC(NAME, "Bottom Light"),
-                        &bottom_light_on,
-                        NULL
-                }),
+homekit_service_t *head_services[] = {
+        HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
+                &name,
+                &manufacturer,
+                &serial,
+                &model,
+                &revision,
+                HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
                 NULL
         }),
         NULL
 };
 
+homekit_service_t *tail_services[] = {
+        DIAGNOSTICS_SERVICE,
+        NULL
+};
+
 homekit_server_config_t config = {
-        .accessories = accessories,
         .password = "338-77-883",
         .setupId="1QJ8",
 };
 
+void relays_init() {
+        relay_bank = relay_bank_create(relays, sizeof(relays) / sizeof(*relays),
+                                       homekit_accessory_category_lightbulb,
+                                       head_services, tail_services, NULL);
+        if (!relay_bank) {
+                abort();
+        }
+        relay_bank_set_callback(relay_bank, lamp_changed, NULL);
+        relay_bank_zero_cross_init(relay_bank, RELAY_ZERO_CROSS_CONFIG());
+        relay_bank_restore(relay_bank, "relays", RELAY_POWER_ON_DEFAULT);
+        config.accessories = relay_bank->accessories;
+}
+
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -239,12 +146,16 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        relays_init();
+        wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+        power_save_init_profile();
+        boot_timeline_mark("wifi_init");
         led_init();
 
-        if (toggle_create(button_gpio, toggle_callback, NULL)) {
+        if (input_service_add(button_gpio, INPUT_TOGGLE_CONFIG(), toggle_callback, NULL)) {
                 printf("Failed to initialize button\n");
         }
-
+        boot_timeline_mark("peripherals");
 }
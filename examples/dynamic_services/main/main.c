@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <esp_wifi.h>
 #include <esp_event_loop.h>
 #include <esp_log.h>
@@ -12,163 +13,157 @@
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
+#include <relay_bank.h>
+#include <accessory_config.h>
 
 
-#define MAX_SERVICES 20
-
 void on_wifi_ready();
 
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-    if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-        printf("STA start\n");
-        esp_wifi_connect();
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        printf("WiFI ready\n");
-        on_wifi_ready();
-    }
-}
-
-static void wifi_init() {
-    ESP_ERROR_CHECK(esp_netif_init());
-
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-    wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASSWORD,
-        },
-    };
-
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
-}
-
 const int button_gpio = 0;
 const int led_gpio = CONFIG_LED_GPIO;
 bool led_on = false;
 
 void led_write(bool on) {
-    gpio_set_level(led_gpio, on ? 1 : 0);
+    status_led_set(on);
 }
 
 void led_init() {
-    gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+    status_led_init(led_gpio, true);
     led_write(led_on);
 }
 
 
-void led_identify_task(void *_args) {
-  for (int i=0; i<3; i++) {
-   for (int j=0; j<2; j++) {
-       led_write(true);
-       vTaskDelay(100 / portTICK_PERIOD_MS);
-       led_write(false);
-       vTaskDelay(100 / portTICK_PERIOD_MS);
-   }
-
-   vTaskDelay(250 / portTICK_PERIOD_MS);
-}
-
-led_write(false);
-
-vTaskDelete(NULL);
-}
-
 void led_identify(homekit_value_t _value) {
         printf("LED identify\n");
-        xTaskCreate(led_identify_task, "LED identify", 512, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
-const uint8_t relay_gpios[] = {
-  12, 5, 14, 13
+// Used when the accessory partition holds no config, see accessory.json
+const relay_desc_t default_relays[] = {
+    RELAY_DESC(12),
+    RELAY_DESC(5),
+    RELAY_DESC(14),
+    RELAY_DESC(13),
 };
-const size_t relay_count = sizeof(relay_gpios) / sizeof(*relay_gpios);
+const size_t default_relay_count = sizeof(default_relays) / sizeof(*default_relays);
 
+relay_bank_t *relay_bank;
 
-void relay_write(int relay, bool on) {
-    printf("Relay %d %s\n", relay, on ? "ON" : "OFF");
-    gpio_set_level(relay, on ? 1 : 0);
+void relay_changed(relay_bank_t *bank, int index, bool on, void *context) {
+    printf("Relay %d %s\n", index + 1, on ? "ON" : "OFF");
 }
 
-void gpio_init() {
-    for (int i=0; i < relay_count; i++) {
-        gpio_set_direction(relay_gpios[i], GPIO_MODE_OUTPUT);
-        relay_write(relay_gpios[i], true);
-    }
-}
+char name_value[64 + sizeof("-XXXXXX")];
+
+homekit_characteristic_t name = HOMEKIT_CHARACTERISTIC_(NAME, name_value);
+homekit_characteristic_t manufacturer = HOMEKIT_CHARACTERISTIC_(MANUFACTURER, "StudioPieters®");
+homekit_characteristic_t serial = HOMEKIT_CHARACTERISTIC_(SERIAL_NUMBER, "NLDA4SQN1466");
+homekit_characteristic_t model = HOMEKIT_CHARACTERISTIC_(MODEL, "SD466NL/A");
+
+homekit_service_t *head_services[] = {
+    HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]) {
+        &name,
+        &manufacturer,
+        &serial,
+        &model,
+        HOMEKIT_CHARACTERISTIC(FIRMWARE_REVISION, "0.0.1"),
+        HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
+        NULL
+    }),
+    NULL
+};
 
-void relay_callback(homekit_characteristic_t *ch, homekit_value_t value, void *context) {
-    uint8_t *gpio = context;
-    relay_write(*gpio, value.bool_value);
-}
+homekit_service_t *tail_services[] = {
+    DIAGNOSTICS_SERVICE,
+    NULL
+};
+
+homekit_server_config_t config = {
+        .password = "338-77-883",
+        .setupId="1QJ8",
+};
 
-homekit_accessory_t *accessories[2];
+#ifdef CONFIG_RELAY_SHIFT_REGISTER
+#define RELAY_OUTPUT_TYPE RELAY_OUTPUT_SHIFT_REGISTER
+#else
+#define RELAY_OUTPUT_TYPE RELAY_OUTPUT_GPIO
+#endif
+
+relay_bank_t *create_relay_bank(const relay_desc_t *relays, int relay_count,
+                                homekit_accessory_category_t category) {
+#ifdef CONFIG_RELAY_SHIFT_REGISTER
+    relay_output_t output = RELAY_OUTPUT_SHIFT_REGISTER_CONFIG(
+        .mosi_gpio = CONFIG_RELAY_SHIFT_REGISTER_MOSI_GPIO,
+        .sclk_gpio = CONFIG_RELAY_SHIFT_REGISTER_SCLK_GPIO,
+        .latch_gpio = CONFIG_RELAY_SHIFT_REGISTER_LATCH_GPIO,
+        .enable_gpio = CONFIG_RELAY_SHIFT_REGISTER_ENABLE_GPIO,
+    );
+    return relay_bank_create(relays, relay_count, category,
+                             head_services, tail_services, &output);
+#else
+    return relay_bank_create(relays, relay_count, category,
+                             head_services, tail_services, NULL);
+#endif
+}
 
 void init_accessory() {
-    uint8_t macaddr[6];
-    esp_read_mac(macaddr, ESP_MAC_WIFI_STA);
+    const char *name_prefix = "Relays";
+
+    // Kept for the lifetime of the accessory, the services point into it
+    accessory_config_t *accessory_config = accessory_config_load("accessory", RELAY_OUTPUT_TYPE);
+    if (accessory_config && accessory_config->relay_count) {
+        relay_bank = create_relay_bank(accessory_config->relays, accessory_config->relay_count,
+                                       accessory_config->category);
+        if (!relay_bank) {
+            // A config that parses but does not fit this board must not
+            // keep it in a boot loop, it is fixed by writing a new one
+            printf("Accessory config does not fit this board\n");
+        }
+    }
 
-    int name_len = snprintf(NULL, 0, "Relays-%02X%02X%02X",
-                            macaddr[3], macaddr[4], macaddr[5]);
-    char *name_value = malloc(name_len+1);
-    snprintf(name_value, name_len+1, "Relays-%02X%02X%02X",
-             macaddr[3], macaddr[4], macaddr[5]);
-
-    homekit_service_t* services[MAX_SERVICES + 1];
-    homekit_service_t** s = services;
-
-    *(s++) = NEW_HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]) {
-        NEW_HOMEKIT_CHARACTERISTIC(NAME, name_value),
-        NEW_HOMEKIT_CHARACTERISTIC(MANUFACTURER, "StudioPieters®"),
-        NEW_HOMEKIT_CHARACTERISTIC(SERIAL_NUMBER, "NLDA4SQN1466"),
-        NEW_HOMEKIT_CHARACTERISTIC(MODEL, "SD466NL/A"),
-        NEW_HOMEKIT_CHARACTERISTIC(FIRMWARE_REVISION, "0.0.1"),
-        NEW_HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
-        NULL
-    });
-
-    for (int i=0; i < relay_count; i++) {
-        int relay_name_len = snprintf(NULL, 0, "Relay %d", i + 1);
-        char *relay_name_value = malloc(name_len+1);
-        snprintf(relay_name_value, relay_name_len+1, "Relay %d", i + 1);
-
-        *(s++) = NEW_HOMEKIT_SERVICE(LIGHTBULB, .characteristics=(homekit_characteristic_t*[]) {
-            NEW_HOMEKIT_CHARACTERISTIC(NAME, relay_name_value),
-            NEW_HOMEKIT_CHARACTERISTIC(
-                ON, true,
-                .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(
-                    relay_callback, .context=(void*)&relay_gpios[i]
-                ),
-            ),
-            NULL
-        });
+    if (relay_bank) {
+        if (accessory_config->name) {
+            name_prefix = accessory_config->name;
+        }
+        if (accessory_config->manufacturer) {
+            manufacturer.value = HOMEKIT_STRING((char *) accessory_config->manufacturer);
+        }
+        if (accessory_config->serial) {
+            serial.value = HOMEKIT_STRING((char *) accessory_config->serial);
+        }
+        if (accessory_config->model) {
+            model.value = HOMEKIT_STRING((char *) accessory_config->model);
+        }
+    } else {
+        free(accessory_config);
+        printf("Using the built-in accessory config\n");
+        relay_bank = create_relay_bank(default_relays, default_relay_count,
+                                       homekit_accessory_category_other);
+        if (!relay_bank) {
+            abort();
+        }
     }
 
-    *(s++) = NULL;
+    uint8_t macaddr[6];
+    esp_read_mac(macaddr, ESP_MAC_WIFI_STA);
+    snprintf(name_value, sizeof(name_value), "%s-%02X%02X%02X",
+             name_prefix, macaddr[3], macaddr[4], macaddr[5]);
 
-    accessories[0] = NEW_HOMEKIT_ACCESSORY(.category=homekit_accessory_category_other, .services=services);
-    accessories[1] = NULL;
+    relay_bank_set_callback(relay_bank, relay_changed, NULL);
+    relay_bank_zero_cross_init(relay_bank, RELAY_ZERO_CROSS_CONFIG());
+    relay_bank_restore(relay_bank, "relays", RELAY_POWER_ON_DEFAULT);
+    config.accessories = relay_bank->accessories;
 }
 
-homekit_server_config_t config = {
-        .accessories = accessories,
-        .password = "338-77-883",
-        .setupId="1QJ8",
-};
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 
@@ -180,9 +175,12 @@ void app_main(void) {
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK( ret );
+    boot_timeline_mark("nvs");
 
-    gpio_init();
-    led_init();
-    wifi_init();
     init_accessory();
+    led_init();
+    boot_timeline_mark("peripherals");
+    wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+    power_save_init_profile();
+    boot_timeline_mark("wifi_init");
 }
@@ -35,78 +35,29 @@
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
 
 void on_wifi_ready();
 
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-    if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-        printf("STA start\n");
-        esp_wifi_connect();
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        printf("WiFI ready\n");
-        on_wifi_ready();
-    }
-}
-
-static void wifi_init() {
-    ESP_ERROR_CHECK(esp_netif_init());
-
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-    wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = CONFIG_WIFI_SSID,
-            .password = CONFIG_WIFI_PASSWORD,
-        },
-    };
-
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
-}
-
 const int led_gpio = CONFIG_LED_GPIO;
 bool led_on = false;
 
 void led_write(bool on) {
-    gpio_set_level(led_gpio, on ? 1 : 0);
+    status_led_set(on);
 }
 
 void led_init() {
-    gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+    status_led_init(led_gpio, true);
     led_write(led_on);
 }
 
 
-void led_identify_task(void *_args) {
-  for (int i=0; i<3; i++) {
-   for (int j=0; j<2; j++) {
-       led_write(true);
-       vTaskDelay(100 / portTICK_PERIOD_MS);
-       led_write(false);
-       vTaskDelay(100 / portTICK_PERIOD_MS);
-   }
-
-   vTaskDelay(250 / portTICK_PERIOD_MS);
-}
-
-led_write(false);
-
-vTaskDelete(NULL);
-}
-
 void led_identify(homekit_value_t _value) {
         printf("LED identify\n");
-        xTaskCreate(led_identify_task, "LED identify", 512, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
 homekit_value_t led_on_get() {
@@ -155,6 +106,7 @@ homekit_accessory_t *accessories[] = {
                                 ),
                         NULL
                 }),
+                DIAGNOSTICS_SERVICE,
                 NULL
         }),
         NULL
@@ -167,7 +119,9 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -178,7 +132,11 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        wifi_station_init(CONFIG_WIFI_SSID, CONFIG_WIFI_PASSWORD, on_wifi_ready);
+        power_save_init_profile();
+        boot_timeline_mark("wifi_init");
         led_init();
+        boot_timeline_mark("peripherals");
 }
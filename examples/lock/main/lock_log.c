@@ -0,0 +1,183 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <freertos/FreeRTOS.h>
+#include <nvs.h>
+
+#include "lock_log.h"
+
+#define LOCK_LOG_NAMESPACE "lock"
+
+static event_log_t lock_event_log;
+static bool lock_event_log_ready = false;
+
+// Records older than this sequence number were cleared
+static uint32_t cleared_seq = 0;
+
+static event_log_record_t ram_log[LOCK_LOG_RAM_SIZE];
+static int ram_log_head = 0;    // next slot to write
+static int ram_log_count = 0;
+static portMUX_TYPE ram_log_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void ram_log_add(const event_log_record_t *record) {
+        portENTER_CRITICAL(&ram_log_lock);
+        ram_log[ram_log_head] = *record;
+        ram_log_head = (ram_log_head + 1) % LOCK_LOG_RAM_SIZE;
+        if (ram_log_count < LOCK_LOG_RAM_SIZE) {
+                ram_log_count++;
+        }
+        portEXIT_CRITICAL(&ram_log_lock);
+}
+
+int lock_log_init(const char *partition) {
+        nvs_handle_t handle;
+        if (nvs_open(LOCK_LOG_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+                nvs_get_u32(handle, "log_cleared", &cleared_seq);
+                nvs_close(handle);
+        }
+
+        event_log_storage_t storage;
+        if (event_log_partition_storage(&storage, partition) ||
+            event_log_init(&lock_event_log, &storage) ||
+            event_log_start(&lock_event_log)) {
+                printf("Failed to initialize lock log, keeping it in RAM only\n");
+                return -1;
+        }
+        lock_event_log_ready = true;
+
+        // Warm the RAM ring with the newest records from flash
+        static event_log_record_t records[LOCK_LOG_RAM_SIZE];
+        int n = event_log_read_last(&lock_event_log, records, LOCK_LOG_RAM_SIZE);
+        for (int i = n - 1; i >= 0; i--) {
+                if (records[i].seq >= cleared_seq) {
+                        ram_log_add(&records[i]);
+                }
+        }
+        return 0;
+}
+
+void lock_log_add(lock_event_t event, lock_source_t source) {
+        event_log_record_t record = {
+                .timestamp = time(NULL),
+                .type = event,
+                .source = source,
+        };
+        ram_log_add(&record);
+
+        if (lock_event_log_ready) {
+                event_log_add(&lock_event_log, event, source, 0);
+        }
+}
+
+int lock_log_read(uint32_t since, event_log_record_t *records, size_t count) {
+        int n = 0;
+
+        portENTER_CRITICAL(&ram_log_lock);
+        // Start at the oldest record in the ring that is recent enough
+        int first = ram_log_count;
+        for (int i=0; i < ram_log_count; i++) {
+                int slot = (ram_log_head - ram_log_count + i + LOCK_LOG_RAM_SIZE) % LOCK_LOG_RAM_SIZE;
+                if (ram_log[slot].timestamp >= since) {
+                        first = i;
+                        break;
+                }
+        }
+        bool complete = (first > 0 || ram_log_count < LOCK_LOG_RAM_SIZE);
+        if (ram_log_count - first > count) {
+                first = ram_log_count - count;
+        }
+        for (int i = first; i < ram_log_count; i++) {
+                records[n++] = ram_log[(ram_log_head - ram_log_count + i + LOCK_LOG_RAM_SIZE) % LOCK_LOG_RAM_SIZE];
+        }
+        portEXIT_CRITICAL(&ram_log_lock);
+
+        if (complete || n == count || !lock_event_log_ready) {
+                return n;
+        }
+
+        // The query reaches back further than the RAM ring, read the newest
+        // records from flash instead
+        int m = event_log_read_last(&lock_event_log, records, count);
+        int matching = 0;
+        while (matching < m && records[matching].timestamp >= since && records[matching].seq >= cleared_seq) {
+                matching++;
+        }
+        for (int i=0; i < matching / 2; i++) {
+                event_log_record_t record = records[i];
+                records[i] = records[matching - 1 - i];
+                records[matching - 1 - i] = record;
+        }
+        return matching;
+}
+
+int lock_log_clear() {
+        portENTER_CRITICAL(&ram_log_lock);
+        ram_log_head = 0;
+        ram_log_count = 0;
+        portEXIT_CRITICAL(&ram_log_lock);
+
+        if (!lock_event_log_ready) {
+                return 0;
+        }
+
+        // Records still queued for the writer task get their sequence number
+        // here, so none of them outlive the clear
+        uint32_t next_seq;
+        if (event_log_sync(&lock_event_log, &next_seq)) {
+                printf("Failed to write out the lock log before clearing it\n");
+        }
+        cleared_seq = next_seq;
+
+        nvs_handle_t handle;
+        esp_err_t err = nvs_open(LOCK_LOG_NAMESPACE, NVS_READWRITE, &handle);
+        if (err == ESP_OK) {
+                err = nvs_set_u32(handle, "log_cleared", cleared_seq);
+                if (err == ESP_OK) {
+                        err = nvs_commit(handle);
+                }
+                nvs_close(handle);
+        }
+        if (err != ESP_OK) {
+                printf("Failed to save lock log clear: %s\n", esp_err_to_name(err));
+                return -1;
+        }
+        return 0;
+}
+
+void lock_log_dump(size_t count) {
+        static const char *event_names[] = { "?", "unlock", "lock", "jammed" };
+        static const char *source_names[] = { "boot", "homekit", "button", "timeout", "manual" };
+        event_log_record_t records[10];
+
+        if (count > sizeof(records) / sizeof(*records)) {
+                count = sizeof(records) / sizeof(*records);
+        }
+        int n = lock_log_read(0, records, count);
+        for (int i=0; i < n; i++) {
+                printf("Lock event at %u: %s by %s\n", records[i].timestamp,
+                       event_names[records[i].type < 4 ? records[i].type : 0],
+                       records[i].source < 5 ? source_names[records[i].source] : "?");
+        }
+}
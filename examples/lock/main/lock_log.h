@@ -0,0 +1,55 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event_log.h>
+
+#include "lock_state.h"
+
+// Lock access log. Every record goes to the event_log flash ring and to a
+// small RAM ring holding the most recent ones, so typical audit queries are
+// served without touching flash.
+
+#define LOCK_LOG_RAM_SIZE 32
+
+typedef enum {
+        lock_event_unlock = 1,
+        lock_event_lock = 2,
+        lock_event_jammed = 3,
+} lock_event_t;
+
+int lock_log_init(const char *partition);
+
+// Non-blocking, source is a lock_source_t
+void lock_log_add(lock_event_t event, lock_source_t source);
+
+// Copy the newest count records with a timestamp of at least since into
+// records, oldest first. Returns the number of records copied.
+int lock_log_read(uint32_t since, event_log_record_t *records, size_t count);
+
+// Hide all records logged so far, flash is not erased
+int lock_log_clear();
+
+void lock_log_dump(size_t count);
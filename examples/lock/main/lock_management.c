@@ -0,0 +1,111 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <homekit/characteristics.h>
+
+#include "lock_log.h"
+#include "lock_management.h"
+
+#define LOCK_LOGS_TLVS_PER_ENTRY 4
+
+homekit_characteristic_t lock_logs = HOMEKIT_CHARACTERISTIC_(LOGS, NULL, .getter=lock_logs_get);
+
+static uint32_t logs_since = 0;
+
+// Response storage, only used from the HomeKit server task
+static event_log_record_t logs_records[LOCK_LOGS_READ_MAX];
+static tlv_t logs_tlvs[LOCK_LOGS_READ_MAX * LOCK_LOGS_TLVS_PER_ENTRY];
+static tlv_values_t logs_values;
+
+static uint32_t tlv_get_uint32(const tlv_t *tlv) {
+        uint32_t value = 0;
+        for (int i = (tlv->size > 4 ? 4 : tlv->size) - 1; i >= 0; i--) {
+                value = (value << 8) | tlv->value[i];
+        }
+        return value;
+}
+
+void lock_control_point(homekit_value_t value) {
+        if (value.format != homekit_format_tlv || !value.tlv_values) {
+                printf("Invalid lock control point format: %d\n", value.format);
+                return;
+        }
+
+        for (tlv_t *tlv = value.tlv_values->head; tlv; tlv = tlv->next) {
+                switch (tlv->type) {
+                case LOCK_CONTROL_POINT_READ_LOGS_FROM_TIME:
+                        logs_since = tlv_get_uint32(tlv);
+                        printf("Lock logs requested from %u\n", logs_since);
+                        break;
+                case LOCK_CONTROL_POINT_CLEAR_LOGS:
+                        printf("Clearing lock logs\n");
+                        lock_log_clear();
+                        break;
+                case LOCK_CONTROL_POINT_SET_CURRENT_TIME: {
+                        struct timeval now = { .tv_sec = tlv_get_uint32(tlv) };
+                        settimeofday(&now, NULL);
+                        printf("Lock time set to %ld\n", (long)now.tv_sec);
+                        break;
+                }
+                default:
+                        printf("Unknown lock control point request: %d\n", tlv->type);
+                }
+        }
+}
+
+// Timestamps point straight into the records, the ESP32 is little endian
+homekit_value_t lock_logs_get() {
+        int n = lock_log_read(logs_since, logs_records, LOCK_LOGS_READ_MAX);
+
+        tlv_t *tlv = logs_tlvs;
+        tlv_t *previous = NULL;
+        for (int i=0; i < n; i++) {
+                event_log_record_t *record = &logs_records[i];
+
+                if (previous) {
+                        *tlv = (tlv_t) { .type = LOCK_LOGS_SEPARATOR };
+                        previous = previous->next = tlv++;
+                }
+                *tlv = (tlv_t) {
+                        .type = LOCK_LOGS_TIMESTAMP,
+                        .value = (uint8_t *)&record->timestamp,
+                        .size = sizeof(record->timestamp),
+                };
+                if (previous) {
+                        previous->next = tlv;
+                }
+                previous = tlv++;
+
+                *tlv = (tlv_t) { .type = LOCK_LOGS_EVENT, .value = &record->type, .size = 1 };
+                previous = previous->next = tlv++;
+                *tlv = (tlv_t) { .type = LOCK_LOGS_SOURCE, .value = &record->source, .size = 1 };
+                previous = previous->next = tlv++;
+        }
+
+        logs_values.head = (n > 0) ? logs_tlvs : NULL;
+
+        homekit_value_t value = HOMEKIT_TLV(&logs_values);
+        value.is_static = true;
+        return value;
+}
@@ -0,0 +1,51 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <homekit/homekit.h>
+
+// LOCK_MANAGEMENT service: Lock Control Point requests and the Logs
+// characteristic.
+//
+// A control point write is a TLV8 list of requests. A read logs request
+// selects the records the next read of Logs returns. Logs is encoded as a
+// list of entries separated by LOCK_LOGS_SEPARATOR, straight from a static
+// snapshot of the records so a read allocates nothing per entry.
+
+// Lock Control Point request types
+#define LOCK_CONTROL_POINT_READ_LOGS_FROM_TIME 0x00  // uint32 seconds, little endian
+#define LOCK_CONTROL_POINT_CLEAR_LOGS 0x01
+#define LOCK_CONTROL_POINT_SET_CURRENT_TIME 0x02     // uint32 seconds since the epoch
+
+// Logs entry types
+#define LOCK_LOGS_TIMESTAMP 0x01  // uint32 seconds, little endian
+#define LOCK_LOGS_EVENT 0x02      // uint8 lock_event_t
+#define LOCK_LOGS_SOURCE 0x03     // uint8 lock_source_t
+#define LOCK_LOGS_SEPARATOR 0xff
+
+// Entries returned by one read of Logs
+#define LOCK_LOGS_READ_MAX 16
+
+extern homekit_characteristic_t lock_logs;
+
+void lock_control_point(homekit_value_t value);
+homekit_value_t lock_logs_get();
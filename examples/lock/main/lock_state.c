@@ -0,0 +1,249 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <driver/gpio.h>
+#include <esp_timer.h>
+#include <nvs.h>
+
+#include "lock_state.h"
+
+#define LOCK_STATE_NAMESPACE "lock"
+#define LOCK_SENSOR_POLL_PERIOD 50
+// Consecutive equal reads before a sensor change is accepted
+#define LOCK_SENSOR_DEBOUNCE 3
+
+static lock_state_config_t config;
+static lock_state_t current_state = lock_state_unknown;
+static lock_state_t target_state = lock_state_secured;
+static lock_source_t target_source = lock_source_boot;
+
+static lock_state_t sensor_state = lock_state_unknown;
+static lock_state_t sensor_candidate = lock_state_unknown;
+static int sensor_count = 0;
+
+static esp_timer_handle_t relock_timer;
+static esp_timer_handle_t jam_timer;
+static esp_timer_handle_t sensor_timer;
+static bool awaiting_sensor = false;
+
+static SemaphoreHandle_t lock;
+static StaticSemaphore_t lock_buffer;
+
+static void lock_state_save(const char *key, lock_state_t state) {
+        nvs_handle_t handle;
+        esp_err_t err = nvs_open(LOCK_STATE_NAMESPACE, NVS_READWRITE, &handle);
+        if (err == ESP_OK) {
+                err = nvs_set_u8(handle, key, state);
+                if (err == ESP_OK) {
+                        err = nvs_commit(handle);
+                }
+                nvs_close(handle);
+        }
+        if (err != ESP_OK) {
+                printf("Failed to save lock %s state: %s\n", key, esp_err_to_name(err));
+        }
+}
+
+static lock_state_t lock_state_load(nvs_handle_t handle, const char *key, lock_state_t fallback) {
+        uint8_t value;
+        if (nvs_get_u8(handle, key, &value) != ESP_OK || value > lock_state_unknown) {
+                return fallback;
+        }
+        return value;
+}
+
+static lock_state_t lock_sensor_read() {
+        return (gpio_get_level(config.sensor_gpio) == config.sensor_secured_level)
+               ? lock_state_secured : lock_state_unsecured;
+}
+
+// Called with the lock held
+static void lock_state_update(lock_state_t current, lock_state_t target) {
+        bool changed = false;
+
+        if (target != target_state) {
+                target_state = target;
+                lock_state_save("target", target);
+                changed = true;
+        }
+        if (current != current_state) {
+                current_state = current;
+                lock_state_save("current", current);
+                changed = true;
+        }
+
+        if (changed) {
+                printf("Lock current %d target %d\n", current_state, target_state);
+                if (config.callback) {
+                        config.callback(current_state, target_state, target_source, config.context);
+                }
+        }
+}
+
+// Called with the lock held
+static void lock_state_drive(lock_state_t target, lock_source_t source) {
+        target_source = source;
+        gpio_set_level(config.relay_gpio, (target == lock_state_unsecured) ? 1 : 0);
+
+        esp_timer_stop(relock_timer);
+        if (target == lock_state_unsecured && config.unlock_period) {
+                esp_timer_start_once(relock_timer, (uint64_t)config.unlock_period * 1000);
+        }
+
+        if (config.sensor_gpio < 0) {
+                lock_state_update(target, target);
+                return;
+        }
+
+        esp_timer_stop(jam_timer);
+        awaiting_sensor = (sensor_state != target);
+        if (awaiting_sensor) {
+                esp_timer_start_once(jam_timer, (uint64_t)config.jam_timeout * 1000);
+        }
+        lock_state_update(awaiting_sensor ? current_state : target, target);
+}
+
+static void lock_relock_callback(void *arg) {
+        printf("Lock timeout, relocking\n");
+        lock_state_set(lock_state_secured, lock_source_timeout);
+}
+
+static void lock_jam_callback(void *arg) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (awaiting_sensor) {
+                awaiting_sensor = false;
+                printf("Lock jammed, bolt did not follow within %ums\n", config.jam_timeout);
+                lock_state_update(lock_state_jammed, target_state);
+        }
+        xSemaphoreGive(lock);
+}
+
+static void lock_sensor_callback(void *arg) {
+        lock_state_t state = lock_sensor_read();
+        if (state != sensor_candidate) {
+                sensor_candidate = state;
+                sensor_count = 0;
+        }
+        if (sensor_count < LOCK_SENSOR_DEBOUNCE) {
+                sensor_count++;
+        }
+        if (sensor_count < LOCK_SENSOR_DEBOUNCE || state == sensor_state) {
+                return;
+        }
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        sensor_state = state;
+        if (state == target_state) {
+                // The bolt followed the command, or recovered from a jam
+                esp_timer_stop(jam_timer);
+                awaiting_sensor = false;
+                lock_state_update(state, target_state);
+        } else if (!awaiting_sensor) {
+                // Moved by hand, the new position is what the user wants
+                printf("Lock bolt moved by hand\n");
+                esp_timer_stop(relock_timer);
+                gpio_set_level(config.relay_gpio, 0);
+                target_source = lock_source_manual;
+                lock_state_update(state, state);
+        }
+        xSemaphoreGive(lock);
+}
+
+int lock_state_init(lock_state_config_t lock_config) {
+        config = lock_config;
+        lock = xSemaphoreCreateMutexStatic(&lock_buffer);
+
+        esp_timer_create_args_t timer_args = {
+                .callback = lock_relock_callback,
+                .name = "lock_relock",
+        };
+        if (esp_timer_create(&timer_args, &relock_timer) != ESP_OK) {
+                return -1;
+        }
+        timer_args.callback = lock_jam_callback;
+        timer_args.name = "lock_jam";
+        if (esp_timer_create(&timer_args, &jam_timer) != ESP_OK) {
+                return -1;
+        }
+
+        nvs_handle_t handle;
+        if (nvs_open(LOCK_STATE_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+                target_state = lock_state_load(handle, "target", lock_state_secured);
+                current_state = lock_state_load(handle, "current", lock_state_unknown);
+                nvs_close(handle);
+        }
+        // An unlock with auto-relock would have ended by now
+        if (target_state != lock_state_unsecured || config.unlock_period) {
+                target_state = lock_state_secured;
+        }
+        printf("Lock restored current %d target %d\n", current_state, target_state);
+
+        gpio_set_direction(config.relay_gpio, GPIO_MODE_OUTPUT);
+
+        if (config.sensor_gpio >= 0) {
+                gpio_set_direction(config.sensor_gpio, GPIO_MODE_INPUT);
+                gpio_set_pull_mode(config.sensor_gpio, GPIO_PULLUP_ONLY);
+                sensor_state = sensor_candidate = lock_sensor_read();
+
+                timer_args.callback = lock_sensor_callback;
+                timer_args.name = "lock_sensor";
+                if (esp_timer_create(&timer_args, &sensor_timer) != ESP_OK) {
+                        return -1;
+                }
+                esp_timer_start_periodic(sensor_timer, LOCK_SENSOR_POLL_PERIOD * 1000);
+        }
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (config.sensor_gpio >= 0) {
+                // The bolt stays where it was left, as after a move by hand.
+                // Driving the restored target instead would report a jam
+                // when the relay cannot move the bolt.
+                gpio_set_level(config.relay_gpio, 0);
+                target_source = lock_source_manual;
+                lock_state_update(sensor_state, sensor_state);
+        } else {
+                lock_state_drive(target_state, lock_source_boot);
+        }
+        if (config.callback) {
+                config.callback(current_state, target_state, target_source, config.context);
+        }
+        xSemaphoreGive(lock);
+
+        return 0;
+}
+
+void lock_state_set(lock_state_t target, lock_source_t source) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        lock_state_drive(target, source);
+        xSemaphoreGive(lock);
+}
+
+lock_state_t lock_state_current() {
+        return current_state;
+}
+
+lock_state_t lock_state_target() {
+        return target_state;
+}
@@ -0,0 +1,84 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Lock mechanism state kept outside the HomeKit glue.
+//
+// Target and current state survive a reboot in NVS. With a bolt sensor the
+// current state always comes from the sensor: after a command the sensor
+// has jam_timeout to agree before the lock reports jammed, and a bolt moved
+// by hand (with a key) becomes the new target. Without a sensor the current
+// state follows the command.
+
+// Same values as LOCK_CURRENT_STATE
+typedef enum {
+        lock_state_unsecured = 0,
+        lock_state_secured = 1,
+        lock_state_jammed = 2,
+        lock_state_unknown = 3,
+} lock_state_t;
+
+// What caused the last change of the target state
+typedef enum {
+        lock_source_boot = 0,
+        lock_source_homekit = 1,
+        lock_source_button = 2,
+        lock_source_timeout = 3,
+        lock_source_manual = 4,    // bolt moved by hand
+} lock_source_t;
+
+typedef void (*lock_state_callback_fn)(lock_state_t current, lock_state_t target,
+                                       lock_source_t source, void *context);
+
+typedef struct {
+        int relay_gpio;              // energized to unlock
+        int sensor_gpio;             // bolt sensor, -1 if there is none
+        bool sensor_secured_level;   // sensor level with the bolt thrown
+
+        // times in milliseconds
+        uint32_t unlock_period;      // relock after this long, 0 stays unlocked
+        uint32_t jam_timeout;        // time the bolt gets to follow a command
+
+        lock_state_callback_fn callback;  // called on every state change
+        void *context;
+} lock_state_config_t;
+
+#define LOCK_STATE_CONFIG(...) \
+        (lock_state_config_t) { \
+                .sensor_gpio = -1, \
+                .sensor_secured_level = 0, \
+                .unlock_period = 5000, \
+                .jam_timeout = 2000, \
+                __VA_ARGS__ \
+        }
+
+// Restores the persisted state and drives the relay. With a sensor the bolt
+// position read at boot becomes the target instead.
+int lock_state_init(lock_state_config_t config);
+
+void lock_state_set(lock_state_t target, lock_source_t source);
+
+lock_state_t lock_state_current();
+lock_state_t lock_state_target();
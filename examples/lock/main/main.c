@@ -35,136 +35,65 @@
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
-#include <button.h>
-
-#if CONFIG_IDF_TARGET_ESP32
-#include "esp32/rom/ets_sys.h"  // for ETSTimer type
-#elif CONFIG_IDF_TARGET_ESP32S2
-#include "esp32s2/rom/ets_sys.h"
-#elif CONFIG_IDF_TARGET_ESP32S3
-#include "esp32s3/rom/ets_sys.h"
-#elif CONFIG_IDF_TARGET_ESP32C3
-#include "esp32c3/rom/ets_sys.h"
-#elif CONFIG_IDF_TARGET_ESP32H2
-#include "esp32h2/rom/ets_sys.h"
-#endif
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
+#include <input_service.h>
 
-void on_wifi_ready();
-
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-        if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-                printf("STA start\n");
-                esp_wifi_connect();
-        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-                printf("WiFI ready\n");
-                on_wifi_ready();
-        }
-}
-
-static void wifi_init() {
-        ESP_ERROR_CHECK(esp_netif_init());
-
-        ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
-
-        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-        wifi_config_t wifi_config = {
-                .sta = {
-                        .ssid = WIFI_SSID,
-                        .password = WIFI_PASSWORD,
-                },
-        };
+#include "lock_state.h"
+#include "lock_log.h"
+#include "lock_management.h"
 
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
-}
+void on_wifi_ready();
 
 const int button_gpio = 0;
 const int led_gpio = CONFIG_LED_GPIO;
 const int relay_gpio = 14;
+const int lock_sensor_gpio = CONFIG_LOCK_SENSOR_GPIO;
 bool led_on = false;
-bool relay_on = false;
-
-// Timeout in seconds to open lock for
-const int unlock_period = 5;  // 5 seconds
 
-void lock_lock();
-void lock_unlock();
-
-void relay_write(bool on) {
-        gpio_set_level(relay_gpio, on ? 1 : 0);
-}
+// Time in milliseconds to open the lock for, 0 keeps it open
+#define UNLOCK_PERIOD 5000
+// Time in milliseconds the bolt gets to follow a command before the lock reports jammed
+#define LOCK_JAM_TIMEOUT 2000
 
 void led_write(bool on) {
-        gpio_set_level(led_gpio, on ? 1 : 0);
+        status_led_set(on);
 }
 
 void gpio_init() {
-        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+        status_led_init(led_gpio, true);
         led_write(led_on);
-
-        gpio_set_direction(relay_gpio, GPIO_MODE_OUTPUT);
-        relay_write(relay_on);
 }
 
 
-void button_callback(button_event_t event, void* context)  {
-        switch (event) {
-        case button_event_single_press:
+void button_callback(const input_event_t *event, void* context)  {
+        switch (event->type) {
+        case INPUT_EVENT_SINGLE_PRESS:
                 printf("Toggling relay\n");
-                lock_unlock();
+                lock_state_set(lock_state_unsecured, lock_source_button);
                 break;
-        case button_event_double_press:
+        case INPUT_EVENT_DOUBLE_PRESS:
                 printf("double press\n");
                 break;
-        case button_event_tripple_press:
+        case INPUT_EVENT_TRIPLE_PRESS:
                 printf("tripple press\n");
                 break;
-        case button_event_long_press:
+        case INPUT_EVENT_LONG_PRESS:
                 printf("long press\n");
                 break;
         default:
-                printf("Unknown button event: %d\n", event);
-        }
-}
-
-void lock_identify_task(void *_args) {
-// We identify the Sonoff by Flashing it's LED.
-        for (int i=0; i<3; i++) {
-                for (int j=0; j<2; j++) {
-                        led_write(true);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                        led_write(false);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                }
-                vTaskDelay(250 / portTICK_PERIOD_MS);
+                printf("Unknown button event: %d\n", event->type);
         }
-        led_write(false);
-        vTaskDelete(NULL);
 }
 
 void lock_identify(homekit_value_t _value) {
         printf("Lock identify\n");
-        xTaskCreate(lock_identify_task, "Lock identify", 128, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
 
-typedef enum {
-        lock_state_unsecured = 0,
-        lock_state_secured = 1,
-        lock_state_jammed = 2,
-        lock_state_unknown = 3,
-} lock_state_t;
-
-
 homekit_characteristic_t lock_current_state = HOMEKIT_CHARACTERISTIC_(
         LOCK_CURRENT_STATE,
         lock_state_unknown,
@@ -178,62 +107,41 @@ homekit_characteristic_t lock_target_state = HOMEKIT_CHARACTERISTIC_(
         .setter=lock_target_state_setter,
         );
 
+// The characteristic is updated from lock_state_changed(), so the change gets logged
 void lock_target_state_setter(homekit_value_t value) {
-        lock_target_state.value = value;
-
-        if (value.int_value == 0) {
-                lock_unlock();
-        } else {
-                lock_lock();
-        }
+        lock_state_set((value.int_value == 0) ? lock_state_unsecured : lock_state_secured, lock_source_homekit);
 }
 
-void lock_control_point(homekit_value_t value) {
-// Nothing to do here
-}
-
-
-ETSTimer lock_timer;
-
-void lock_lock() {
-        ets_timer_disarm(&lock_timer);
 
-        relay_write(relay_on);
-        led_write(false);
+void lock_state_changed(lock_state_t current, lock_state_t target, lock_source_t source, void *context) {
+        led_write(current == lock_state_unsecured);
 
-        if (lock_current_state.value.int_value != lock_state_secured) {
-                lock_current_state.value = HOMEKIT_UINT8(lock_state_secured);
+        if (lock_current_state.value.int_value != current) {
+                if (current == lock_state_jammed) {
+                        lock_log_add(lock_event_jammed, source);
+                }
+                lock_current_state.value = HOMEKIT_UINT8(current);
                 homekit_characteristic_notify(&lock_current_state, lock_current_state.value);
         }
-}
-
-void lock_timeout() {
-        if (lock_target_state.value.int_value != lock_state_secured) {
-                lock_target_state.value = HOMEKIT_UINT8(lock_state_secured);
+        if (lock_target_state.value.int_value != target) {
+                lock_log_add((target == lock_state_unsecured) ? lock_event_unlock : lock_event_lock, source);
+                lock_target_state.value = HOMEKIT_UINT8(target);
                 homekit_characteristic_notify(&lock_target_state, lock_target_state.value);
         }
-
-        lock_lock();
 }
 
 void lock_init() {
-        lock_current_state.value = HOMEKIT_UINT8(lock_state_secured);
-        homekit_characteristic_notify(&lock_current_state, lock_current_state.value);
-
-        ets_timer_disarm(&lock_timer);
-        ets_timer_setfn(&lock_timer, lock_timeout, NULL);
-}
-
-void lock_unlock() {
-        relay_write(true);
-        led_write(true);
-
-        lock_current_state.value = HOMEKIT_UINT8(lock_state_unsecured);
-        homekit_characteristic_notify(&lock_current_state, lock_current_state.value);
-
-        if (unlock_period) {
-                ets_timer_disarm(&lock_timer);
-                ets_timer_arm(&lock_timer, unlock_period * 1000, 0);
+        lock_log_init("eventlog");
+        lock_log_dump(10);
+
+        if (lock_state_init(LOCK_STATE_CONFIG(
+                                    .relay_gpio = relay_gpio,
+                                    .sensor_gpio = lock_sensor_gpio,
+                                    .unlock_period = UNLOCK_PERIOD,
+                                    .jam_timeout = LOCK_JAM_TIMEOUT,
+                                    .callback = lock_state_changed,
+                                    ))) {
+                printf("Failed to initialize lock\n");
         }
 }
 
@@ -269,8 +177,10 @@ homekit_accessory_t *accessories[] = {
                 HOMEKIT_SERVICE(LOCK_MANAGEMENT, .characteristics=(homekit_characteristic_t*[]){
                         HOMEKIT_CHARACTERISTIC(LOCK_CONTROL_POINT, .setter=lock_control_point ),
                         HOMEKIT_CHARACTERISTIC(VERSION, "1.0"),
+                        &lock_logs,
                         NULL
                 }),
+                DIAGNOSTICS_SERVICE,
                 NULL
         }),
         NULL
@@ -283,7 +193,9 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -294,17 +206,20 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+        power_save_init_profile();
+        boot_timeline_mark("wifi_init");
         gpio_init();
         lock_init();
 
-        button_config_t button_config = BUTTON_CONFIG(
-                button_active_low,
-                .max_repeat_presses=2,
+        input_config_t button_config = INPUT_BUTTON_CONFIG(
+                .max_presses=2,
                 .long_press_time=1000,
                 );
-        if (button_create(button_gpio, button_config, button_callback, NULL)) {
+        if (input_service_add(button_gpio, button_config, button_callback, NULL)) {
                 printf("Failed to initialize button\n");
         }
+        boot_timeline_mark("peripherals");
 }
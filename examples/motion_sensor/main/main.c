@@ -22,6 +22,7 @@
  **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_log.h>
@@ -34,83 +35,85 @@
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
-#include <toggle.h>
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
+#include <input_service.h>
 
-void on_wifi_ready();
-
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-        if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-                printf("STA start\n");
-                esp_wifi_connect();
-        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-                printf("WiFI ready\n");
-                on_wifi_ready();
-        }
-}
-
-static void wifi_init() {
-        ESP_ERROR_CHECK(esp_netif_init());
-
-        ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
-
-        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
+#include "occupancy.h"
 
-        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-        wifi_config_t wifi_config = {
-                .sta = {
-                        .ssid = WIFI_SSID,
-                        .password = WIFI_PASSWORD,
-                },
-        };
-
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
-}
+void on_wifi_ready();
 
-const int sensor_gpio = 4;
+const int sensor_gpios[] = {
+        CONFIG_MOTION_SENSOR_GPIO,
+        CONFIG_MOTION_SENSOR_2_GPIO,
+        CONFIG_MOTION_SENSOR_3_GPIO,
+};
 const int led_gpio = CONFIG_LED_GPIO;
 bool led_on = false;
 
 void led_write(bool on) {
-      gpio_set_level(led_gpio, on ? 1 : 0);
+      status_led_set(on);
 }
 
 void led_init() {
-        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+        status_led_init(led_gpio, true);
         led_write(led_on);
 }
 
-void identify_task(void *_args) {
-        for (int i=0; i<3; i++) {
-                for (int j=0; j<2; j++) {
-                        led_write(true);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                        led_write(false);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                }
-                vTaskDelay(250 / portTICK_PERIOD_MS);
-        }
-        led_write(led_on);
-        vTaskDelete(NULL);
-}
-
 void sensor_identify(homekit_value_t _value) {
         printf("Identify\n");
-        xTaskCreate(identify_task, "Identify", 128, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
-homekit_characteristic_t Motion_detected = HOMEKIT_CHARACTERISTIC_(MOTION_DETECTED, 0);
+homekit_characteristic_t Motion_detected = HOMEKIT_CHARACTERISTIC_(MOTION_DETECTED, false);
+occupancy_t *motion;
+
+#ifdef CONFIG_OCCUPANCY_SENSOR
+homekit_characteristic_t Occupancy_detected = HOMEKIT_CHARACTERISTIC_(OCCUPANCY_DETECTED, 0);
+occupancy_t *occupancy;
+#endif
+
+// context is the index of the PIR sensor
+void sensor_callback(const input_event_t *event, void *context) {
+        int sensor = (intptr_t) context;
+        occupancy_input(motion, sensor, event->active);
+#ifdef CONFIG_OCCUPANCY_SENSOR
+        occupancy_input(occupancy, sensor, event->active);
+#endif
+}
+
+void sensors_init() {
+        motion = occupancy_create(&Motion_detected, OCCUPANCY_CONFIG(
+                .hold_time = CONFIG_MOTION_HOLD_TIME * 1000,
+                .retrigger_time = CONFIG_MOTION_RETRIGGER_TIME * 1000,
+                .min_report_interval = CONFIG_MOTION_MIN_REPORT_INTERVAL * 1000,
+                ));
+        if (!motion) {
+                abort();
+        }
+#ifdef CONFIG_OCCUPANCY_SENSOR
+        occupancy = occupancy_create(&Occupancy_detected, OCCUPANCY_CONFIG(
+                .hold_time = CONFIG_OCCUPANCY_HOLD_TIME * 1000,
+                .retrigger_time = CONFIG_OCCUPANCY_RETRIGGER_TIME * 1000,
+                .min_report_interval = CONFIG_MOTION_MIN_REPORT_INTERVAL * 1000,
+                .confirm_inputs = CONFIG_OCCUPANCY_CONFIRM_SENSORS,
+                .confirm_window = CONFIG_OCCUPANCY_CONFIRM_WINDOW * 1000,
+                ));
+        if (!occupancy) {
+                abort();
+        }
+#endif
 
-void sensor_callback(bool high, void *context) {
-        Motion_detected.value = HOMEKIT_UINT8(high ? 1 : 0);
-        homekit_characteristic_notify(&Motion_detected, Motion_detected.value);
+        for (int i=0; i < sizeof(sensor_gpios) / sizeof(*sensor_gpios); i++) {
+                if (sensor_gpios[i] < 0) {
+                        continue;
+                }
+                if (input_service_add(sensor_gpios[i], INPUT_TOGGLE_CONFIG(), sensor_callback, (void*)(intptr_t) i)) {
+                        printf("Failed to initialize motion sensor at GPIO %d\n", sensor_gpios[i]);
+                }
+        }
 }
 #define DEVICE_NAME "HomeKit Motion Sensor"
 #define DEVICE_MANUFACTURER "StudioPieters®"
@@ -140,6 +143,14 @@ homekit_accessory_t *accessories[] = {
                         &Motion_detected,
                         NULL
                 }),
+#ifdef CONFIG_OCCUPANCY_SENSOR
+                HOMEKIT_SERVICE(OCCUPANCY_SENSOR, .characteristics=(homekit_characteristic_t*[]) {
+                        HOMEKIT_CHARACTERISTIC(NAME, "Occupancy Sensor"),
+                        &Occupancy_detected,
+                        NULL
+                }),
+#endif
+                DIAGNOSTICS_SERVICE,
                 NULL
         }),
         NULL
@@ -153,7 +164,9 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -164,11 +177,13 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+        power_save_init_profile();
+        boot_timeline_mark("wifi_init");
         led_init();
 
-        if (toggle_create(sensor_gpio, sensor_callback, NULL)) {
-                printf("Failed to initialize motion sensor\n");
-        }
+        sensors_init();
+        boot_timeline_mark("peripherals");
 }
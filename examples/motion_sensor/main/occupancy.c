@@ -0,0 +1,179 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <homekit/homekit.h>
+
+#include "occupancy.h"
+
+struct occupancy {
+        homekit_characteristic_t *characteristic;
+        occupancy_config_t config;
+
+        SemaphoreHandle_t lock;
+        esp_timer_handle_t timer;
+
+        uint8_t active_inputs;          // bit per input
+        int64_t triggered_at[OCCUPANCY_MAX_INPUTS];
+        bool occupied;
+        int64_t vacant_at;
+
+        bool reported;
+        int64_t reported_at;
+};
+
+static int64_t occupancy_now() {
+        return esp_timer_get_time() / 1000;
+}
+
+// Called with the lock held. Returns true when the characteristic has to
+// be notified, which the caller does after releasing the lock.
+static bool occupancy_update(occupancy_t *occupancy, int64_t now) {
+        if (occupancy->occupied && !occupancy->active_inputs && now >= occupancy->vacant_at) {
+                occupancy->occupied = false;
+        }
+
+        bool notify = false;
+        int64_t next = INT64_MAX;
+        if (occupancy->occupied != occupancy->reported) {
+                int64_t report_at = occupancy->reported_at + occupancy->config.min_report_interval;
+                if (now >= report_at) {
+                        occupancy->reported = occupancy->occupied;
+                        occupancy->reported_at = now;
+                        notify = true;
+                } else {
+                        next = report_at;
+                }
+        }
+        if (occupancy->occupied && !occupancy->active_inputs && occupancy->vacant_at < next) {
+                next = occupancy->vacant_at;
+        }
+
+        esp_timer_stop(occupancy->timer);
+        if (next != INT64_MAX) {
+                int64_t delay = next > now ? next - now : 1;
+                esp_timer_start_once(occupancy->timer, delay * 1000);
+        }
+        return notify;
+}
+
+static void occupancy_notify(occupancy_t *occupancy, bool occupied) {
+        homekit_characteristic_t *characteristic = occupancy->characteristic;
+        if (characteristic->format == homekit_format_bool) {
+                characteristic->value = HOMEKIT_BOOL(occupied);
+        } else {
+                characteristic->value = HOMEKIT_UINT8(occupied ? 1 : 0);
+        }
+        homekit_characteristic_notify(characteristic, characteristic->value);
+}
+
+static void occupancy_timer(void *arg) {
+        occupancy_t *occupancy = arg;
+
+        xSemaphoreTake(occupancy->lock, portMAX_DELAY);
+        bool notify = occupancy_update(occupancy, occupancy_now());
+        bool reported = occupancy->reported;
+        xSemaphoreGive(occupancy->lock);
+
+        if (notify) {
+                occupancy_notify(occupancy, reported);
+        }
+}
+
+occupancy_t *occupancy_create(homekit_characteristic_t *characteristic, occupancy_config_t config) {
+        occupancy_t *occupancy = calloc(1, sizeof(occupancy_t));
+        if (!occupancy) {
+                return NULL;
+        }
+        occupancy->characteristic = characteristic;
+        occupancy->config = config;
+        // Nothing counts as triggered recently and the first report goes out
+        // right away
+        for (int i=0; i < OCCUPANCY_MAX_INPUTS; i++) {
+                occupancy->triggered_at[i] = -(int64_t)config.confirm_window - 1;
+        }
+        occupancy->reported_at = -(int64_t)config.min_report_interval;
+
+        occupancy->lock = xSemaphoreCreateMutex();
+        esp_timer_create_args_t timer_args = {
+                .callback = occupancy_timer,
+                .arg = occupancy,
+                .name = "occupancy",
+        };
+        if (!occupancy->lock || esp_timer_create(&timer_args, &occupancy->timer) != ESP_OK) {
+                printf("Occupancy: failed to create\n");
+                if (occupancy->lock) {
+                        vSemaphoreDelete(occupancy->lock);
+                }
+                free(occupancy);
+                return NULL;
+        }
+        return occupancy;
+}
+
+void occupancy_input(occupancy_t *occupancy, int input, bool active) {
+        if (input < 0 || input >= OCCUPANCY_MAX_INPUTS) {
+                return;
+        }
+        uint8_t bit = 1 << input;
+
+        xSemaphoreTake(occupancy->lock, portMAX_DELAY);
+        int64_t now = occupancy_now();
+        if (active) {
+                occupancy->active_inputs |= bit;
+                occupancy->triggered_at[input] = now;
+
+                if (!occupancy->occupied) {
+                        int confirmed = 0;
+                        for (int i=0; i < OCCUPANCY_MAX_INPUTS; i++) {
+                                if (now - occupancy->triggered_at[i] <= occupancy->config.confirm_window) {
+                                        confirmed++;
+                                }
+                        }
+                        if (confirmed >= occupancy->config.confirm_inputs) {
+                                occupancy->occupied = true;
+                                occupancy->vacant_at = now + occupancy->config.hold_time;
+                        }
+                }
+        } else {
+                occupancy->active_inputs &= ~bit;
+                if (occupancy->occupied && now + occupancy->config.retrigger_time > occupancy->vacant_at) {
+                        occupancy->vacant_at = now + occupancy->config.retrigger_time;
+                }
+        }
+        bool notify = occupancy_update(occupancy, now);
+        bool reported = occupancy->reported;
+        xSemaphoreGive(occupancy->lock);
+
+        if (notify) {
+                occupancy_notify(occupancy, reported);
+        }
+}
+
+bool occupancy_get(occupancy_t *occupancy) {
+        return occupancy->reported;
+}
@@ -0,0 +1,66 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <homekit/types.h>
+
+// Turns raw PIR edges into clean occupied/vacant transitions on a HomeKit
+// characteristic. Several PIR inputs can feed one engine.
+//
+// The state becomes occupied when confirm_inputs distinct inputs triggered
+// within confirm_window. It stays occupied for at least hold_time, and for
+// retrigger_time after the last active input goes idle. Reports are at
+// least min_report_interval apart, changes in between are folded into one
+// report when the interval ends.
+
+#define OCCUPANCY_MAX_INPUTS 8
+
+typedef struct {
+        uint32_t hold_time;             // ms
+        uint32_t retrigger_time;        // ms
+        uint32_t min_report_interval;   // ms
+        uint8_t confirm_inputs;
+        uint32_t confirm_window;        // ms
+} occupancy_config_t;
+
+#define OCCUPANCY_CONFIG(...) \
+        (occupancy_config_t) { \
+                .hold_time = 30000, \
+                .retrigger_time = 15000, \
+                .min_report_interval = 5000, \
+                .confirm_inputs = 1, \
+                .confirm_window = 10000, \
+                __VA_ARGS__ \
+        }
+
+typedef struct occupancy occupancy_t;
+
+// characteristic is a bool (MOTION_DETECTED) or uint8 (OCCUPANCY_DETECTED)
+occupancy_t *occupancy_create(homekit_characteristic_t *characteristic, occupancy_config_t config);
+
+// input is 0 to OCCUPANCY_MAX_INPUTS-1, active is the PIR output
+void occupancy_input(occupancy_t *occupancy, int input, bool active);
+
+bool occupancy_get(occupancy_t *occupancy);
@@ -31,83 +31,40 @@
  //#include <freertos/task.h>
  #include <freertos/task_snapshot.h>
  #include <driver/gpio.h>
+#include <esp_attr.h>
+#include <esp_system.h>
 
  #include <homekit/homekit.h>
  #include <homekit/characteristics.h>
  #include "wifi.h"
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <status_led.h>
 #include <dht.h>
+#include <sensor_filter.h>
+#include <notify_policy.h>
+#ifdef CONFIG_LOW_POWER_MODE
+#include <power_save.h>
+#endif
 
 void on_wifi_ready();
 
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-    if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-        printf("STA start\n");
-        esp_wifi_connect();
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        printf("WiFI ready\n");
-        on_wifi_ready();
-    }
-}
-
-static void wifi_init() {
-    ESP_ERROR_CHECK(esp_netif_init());
-
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-    wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = CONFIG_WIFI_SSID,
-            .password = CONFIG_WIFI_PASSWORD,
-        },
-    };
-
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
-}
-
 const int led_gpio = CONFIG_LED_GPIO;
 bool led_on = false;
 
 void led_write(bool on) {
-        gpio_set_level(led_gpio, on ? 1 : 0);
+        status_led_set(on);
 }
 
 void led_init() {
-        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+        status_led_init(led_gpio, true);
         led_write(led_on);
 }
 
 
-void led_identify_task(void *_args) {
-        for (int i=0; i<3; i++) {
-                for (int j=0; j<2; j++) {
-                        led_write(true);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                        led_write(false);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                }
-
-                vTaskDelay(250 / portTICK_PERIOD_MS);
-        }
-
-        led_write(false);
-
-        vTaskDelete(NULL);
-}
-
 void led_identify(homekit_value_t _value) {
         printf("LED identify\n");
-        xTaskCreate(led_identify_task, "LED identify", 512, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
 
@@ -139,35 +96,116 @@ homekit_characteristic_t humidity = HOMEKIT_CHARACTERISTIC_(CURRENT_RELATIVE_HUM
 const int sensor_gpio = CONFIG_SENSOR_GPIO;
 const int sensor_type = SENSOR_TYPE;
 
+#ifdef CONFIG_LOW_POWER_MODE
+#define SENSOR_POLL_PERIOD 60000
+// Every notification wakes the radio, so small changes are batched up
+#define TEMPERATURE_NOTIFY_POLICY NOTIFY_POLICY_CONFIG(.min_delta = 0.2, .min_interval = 120000, .max_interval = 900000)
+#define HUMIDITY_NOTIFY_POLICY NOTIFY_POLICY_CONFIG(.min_delta = 2, .min_interval = 120000, .max_interval = 900000)
+// Print the power mode statistics every hour
+#define POWER_SAVE_DUMP_SAMPLES 60
+#else
+#define SENSOR_POLL_PERIOD 3000
+// Notify on 0.1C / 1%RH changes, at most every 10s, at least every 5 minutes
+#define TEMPERATURE_NOTIFY_POLICY NOTIFY_POLICY_CONFIG(.min_delta = 0.1, .min_interval = 10000, .max_interval = 300000)
+#define HUMIDITY_NOTIFY_POLICY NOTIFY_POLICY_CONFIG(.min_delta = 1, .min_interval = 10000, .max_interval = 300000)
+#endif
+// A failed read is retried after the minimum DHT interval instead of a full period
+#define SENSOR_RETRY_PERIOD 2000
+#define SENSOR_MAX_RETRIES 3
+
+// Last reported values, kept in RTC memory so a watchdog or brownout reset
+// starts from them instead of announcing 0C until the first reading
+#define SENSOR_RETAINED_MAGIC 0x7e3b5e41
+typedef struct {
+        uint32_t magic;
+        float temperature;
+        float humidity;
+} sensor_retained_t;
+
+static RTC_NOINIT_ATTR sensor_retained_t sensor_retained;
+
+void sensor_retained_restore() {
+        esp_reset_reason_t reason = esp_reset_reason();
+        if (sensor_retained.magic != SENSOR_RETAINED_MAGIC
+            || reason == ESP_RST_POWERON || reason == ESP_RST_UNKNOWN) {
+                sensor_retained.magic = 0;
+                return;
+        }
+
+        printf("Restoring sensor state after reset: %.1fC %.1f%%\n",
+               sensor_retained.temperature, sensor_retained.humidity);
+        temperature.value = HOMEKIT_FLOAT(sensor_retained.temperature);
+        humidity.value = HOMEKIT_FLOAT(sensor_retained.humidity);
+}
+
 void temperature_sensor_task(void *_args) {
 
         float humidity_value, temperature_value;
+        sensor_filter_t temperature_filter, humidity_filter;
+        sensor_filter_init(&temperature_filter, SENSOR_FILTER_CONFIG());
+        sensor_filter_init(&humidity_filter, SENSOR_FILTER_CONFIG());
+        notify_policy_t temperature_policy, humidity_policy;
+        notify_policy_init(&temperature_policy, TEMPERATURE_NOTIFY_POLICY);
+        notify_policy_init(&humidity_policy, HUMIDITY_NOTIFY_POLICY);
+        int failures = 0;
 
         #ifdef CONFIG_EXAMPLE_INTERNAL_PULLUP
         gpio_set_pull_mode(dht_gpio, GPIO_PULLUP_ONLY);
         #endif
 
+#ifdef CONFIG_LOW_POWER_MODE
+        int samples = 0;
+#endif
+
         while (1) {
+#ifdef CONFIG_LOW_POWER_MODE
+                // The DHT protocol is bit-banged with microsecond timing
+                power_save_busy(true);
+#endif
                 bool success = (dht_read_float_data(SENSOR_TYPE, sensor_gpio, &humidity_value, &temperature_value) == ESP_OK);
+#ifdef CONFIG_LOW_POWER_MODE
+                power_save_busy(false);
+                if (++samples % POWER_SAVE_DUMP_SAMPLES == 0) {
+                        power_save_dump();
+                }
+#endif
                 if (success) {
-                        temperature.value.float_value = temperature_value;
-                        humidity.value.float_value = humidity_value;
-                        printf("Humidity: %.1f%% Temp: %.1fC\n", humidity_value, temperature_value);
-
-                        homekit_characteristic_notify(&temperature, HOMEKIT_FLOAT(temperature_value));
-                        homekit_characteristic_notify(&humidity, HOMEKIT_FLOAT(humidity_value));
+                        failures = 0;
+                        float filtered_temperature = sensor_filter_add(&temperature_filter, temperature_value);
+                        float filtered_humidity = sensor_filter_add(&humidity_filter, humidity_value);
+                        if (!sensor_filter_valid(&temperature_filter)) {
+                                // Fill the window at the fastest rate the sensor allows
+                                printf("Filling filter (raw %.1f%% %.1fC)\n", humidity_value, temperature_value);
+                                vTaskDelay(SENSOR_RETRY_PERIOD / portTICK_PERIOD_MS);
+                                continue;
+                        }
+                        notify_policy_update(&temperature_policy, &temperature, HOMEKIT_FLOAT(filtered_temperature));
+                        notify_policy_update(&humidity_policy, &humidity, HOMEKIT_FLOAT(filtered_humidity));
+                        printf("Humidity: %.1f%% Temp: %.1fC (raw %.1f%% %.1fC, %u notifications suppressed)\n",
+                               humidity.value.float_value, temperature.value.float_value,
+                               humidity_value, temperature_value, notify_policy_total_suppressed());
+                        sensor_retained = (sensor_retained_t) {
+                                .magic = SENSOR_RETAINED_MAGIC,
+                                .temperature = temperature.value.float_value,
+                                .humidity = humidity.value.float_value,
+                        };
 
                 } else {
                         printf("Couldnt read data from sensor\n");
-
+                        if (++failures <= SENSOR_MAX_RETRIES) {
+                                vTaskDelay(SENSOR_RETRY_PERIOD / portTICK_PERIOD_MS);
+                                continue;
+                        }
+                        failures = 0;
                 }
 // If you read the sensor data too often, it will heat up
-                vTaskDelay(3000 / portTICK_PERIOD_MS);
+                vTaskDelay(SENSOR_POLL_PERIOD / portTICK_PERIOD_MS);
         }
 }
 
 void temperature_sensor_init() {
-        xTaskCreate(temperature_sensor_task, "Temperature Sensor", configMINIMAL_STACK_SIZE * 3, NULL, 5, NULL);
+        sensor_retained_restore();
+        xTaskCreate(temperature_sensor_task, "Temperature Sensor", 2560, NULL, 5, NULL);
 }
 
 homekit_accessory_t *accessories[] = {
@@ -191,6 +229,7 @@ homekit_accessory_t *accessories[] = {
                         &humidity,
                         NULL
                 }),
+                DIAGNOSTICS_SERVICE,
                 NULL
         }),
         NULL
@@ -203,7 +242,9 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -214,8 +255,14 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        wifi_station_init(CONFIG_WIFI_SSID, CONFIG_WIFI_PASSWORD, on_wifi_ready);
+        boot_timeline_mark("wifi_init");
+#ifdef CONFIG_LOW_POWER_MODE
+        power_save_init(POWER_SAVE_CONFIG(.light_sleep = true, .wifi_ps = WIFI_PS_MAX_MODEM));
+#endif
         led_init();
         temperature_sensor_init();
+        boot_timeline_mark("peripherals");
 }
@@ -0,0 +1,177 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+
+#include <driver/gpio.h>
+
+#include "actuator_sequencer.h"
+
+static void sequencer_write(actuator_sequencer_t *sequencer, uint8_t outputs) {
+        actuator_sequencer_config_t *config = &sequencer->config;
+
+        if ((sequencer->outputs & actuator_cooler) && !(outputs & actuator_cooler)) {
+                sequencer->cooler_off_time = esp_timer_get_time();
+        }
+        sequencer->outputs = outputs;
+
+        gpio_set_level(config->heater_gpio, ((outputs & actuator_heater) != 0) == config->active_high);
+        gpio_set_level(config->cooler_gpio, ((outputs & actuator_cooler) != 0) == config->active_high);
+        gpio_set_level(config->fan_gpio, ((outputs & actuator_fan) != 0) == config->active_high);
+}
+
+// Apply steps until one has to wait, called with the lock held
+static void sequencer_run(actuator_sequencer_t *sequencer) {
+        while (sequencer->step < sequencer->step_count) {
+                actuator_step_t *step = &sequencer->steps[sequencer->step];
+                if (step->delay > 0 && sequencer->step_deadline == 0) {
+                        sequencer->step_deadline = esp_timer_get_time() + (int64_t)step->delay * 1000;
+                        esp_timer_start_once(sequencer->timer, (uint64_t)step->delay * 1000);
+                        return;
+                }
+
+                sequencer_write(sequencer, step->outputs);
+                sequencer->step_deadline = 0;
+                sequencer->step++;
+        }
+}
+
+static void sequencer_timer_callback(void *arg) {
+        actuator_sequencer_t *sequencer = arg;
+
+        xSemaphoreTake(sequencer->lock, portMAX_DELAY);
+        // A callback that was already dispatched when the sequence got
+        // replaced finds a deadline that has not passed yet, or none at all
+        if (sequencer->step_deadline != 0 && esp_timer_get_time() >= sequencer->step_deadline) {
+                sequencer->steps[sequencer->step].delay = 0;
+                sequencer->step_deadline = 0;
+                sequencer_run(sequencer);
+        }
+        xSemaphoreGive(sequencer->lock);
+}
+
+static void sequencer_add(actuator_sequencer_t *sequencer, uint8_t outputs, uint32_t delay) {
+        actuator_step_t *last = (sequencer->step_count > 0) ? &sequencer->steps[sequencer->step_count - 1] : NULL;
+        if (last && delay == 0) {
+                last->outputs = outputs;
+                return;
+        }
+        if (last && last->outputs == outputs) {
+                return;
+        }
+
+        sequencer->steps[sequencer->step_count++] = (actuator_step_t) {
+                .outputs = outputs,
+                .delay = delay,
+        };
+}
+
+static uint32_t sequencer_lockout_remaining(actuator_sequencer_t *sequencer) {
+        if (sequencer->cooler_off_time == 0 || (sequencer->outputs & actuator_cooler)) {
+                return 0;
+        }
+
+        int64_t elapsed = (esp_timer_get_time() - sequencer->cooler_off_time) / 1000;
+        if (elapsed >= sequencer->config.compressor_lockout) {
+                return 0;
+        }
+        return sequencer->config.compressor_lockout - elapsed;
+}
+
+int actuator_sequencer_init(actuator_sequencer_t *sequencer, actuator_sequencer_config_t config) {
+        *sequencer = (actuator_sequencer_t) {
+                .config = config,
+                .target = thermostat_output_off,
+        };
+
+        sequencer->lock = xSemaphoreCreateMutexStatic(&sequencer->lock_buffer);
+
+        esp_timer_create_args_t timer_args = {
+                .callback = sequencer_timer_callback,
+                .arg = sequencer,
+                .name = "actuators",
+        };
+        if (esp_timer_create(&timer_args, &sequencer->timer) != ESP_OK) {
+                printf("Failed to create actuator timer\n");
+                return -1;
+        }
+
+        gpio_set_direction(config.heater_gpio, GPIO_MODE_OUTPUT);
+        gpio_set_direction(config.cooler_gpio, GPIO_MODE_OUTPUT);
+        gpio_set_direction(config.fan_gpio, GPIO_MODE_OUTPUT);
+        sequencer_write(sequencer, 0);
+
+        return 0;
+}
+
+void actuator_sequencer_set(actuator_sequencer_t *sequencer, thermostat_output_t output) {
+        actuator_sequencer_config_t *config = &sequencer->config;
+
+        xSemaphoreTake(sequencer->lock, portMAX_DELAY);
+        if (sequencer->target == output) {
+                xSemaphoreGive(sequencer->lock);
+                return;
+        }
+
+        // Cancel what is left of the previous sequence
+        esp_timer_stop(sequencer->timer);
+        sequencer->target = output;
+        sequencer->generation++;
+        sequencer->step_count = 0;
+        sequencer->step = 0;
+        sequencer->step_deadline = 0;
+
+        // Steps start from the relays as they are, so a fan that is still
+        // running from a previous sequence is not switched off and on again
+        uint8_t fan = sequencer->outputs & actuator_fan;
+        switch (output) {
+        case thermostat_output_heat:
+                sequencer_add(sequencer, actuator_heater | fan, 0);
+                sequencer_add(sequencer, actuator_heater | actuator_fan, fan ? 0 : config->heat_fan_delay);
+                break;
+        case thermostat_output_cool: {
+                uint32_t lockout = sequencer_lockout_remaining(sequencer);
+                uint32_t prerun = fan ? 0 : config->cool_fan_prerun;
+                sequencer_add(sequencer, actuator_fan, 0);
+                sequencer_add(sequencer, actuator_cooler | actuator_fan, (lockout > prerun) ? lockout : prerun);
+                break;
+        }
+        default: {
+                uint32_t overrun = 0;
+                if (sequencer->outputs & actuator_heater) {
+                        overrun = config->heat_fan_overrun;
+                } else if (sequencer->outputs & actuator_cooler) {
+                        overrun = config->cool_fan_overrun;
+                }
+                sequencer_add(sequencer, fan, 0);
+                sequencer_add(sequencer, 0, fan ? overrun : 0);
+                break;
+        }
+        }
+
+        printf("Actuators: sequence %u towards %d, %d steps\n", sequencer->generation, output, sequencer->step_count);
+        sequencer_run(sequencer);
+        xSemaphoreGive(sequencer->lock);
+}
+
+uint8_t actuator_sequencer_outputs(actuator_sequencer_t *sequencer) {
+        return sequencer->outputs;
+}
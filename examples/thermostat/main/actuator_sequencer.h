@@ -0,0 +1,105 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+
+#include "thermostat_control.h"
+
+// Drives the heater, cooler and fan relays as a short list of timed steps
+// so a change of output becomes e.g. "fan on, wait, cooler on" instead of
+// switching everything at once:
+//
+//  heat: heater on, fan on after heat_fan_delay
+//  cool: fan on, cooler on after cool_fan_prerun and compressor lockout
+//  off:  heater and cooler off, fan off after the matching overrun
+//
+// Every step is applied from one esp_timer. Requesting a new output cancels
+// the rest of the running sequence and starts from the relays as they are.
+
+#define ACTUATOR_SEQUENCER_MAX_STEPS 3
+
+typedef enum {
+        actuator_heater = (1 << 0),
+        actuator_cooler = (1 << 1),
+        actuator_fan = (1 << 2),
+} actuator_t;
+
+typedef struct {
+        int heater_gpio;
+        int cooler_gpio;
+        int fan_gpio;
+        bool active_high;
+
+        // times in milliseconds
+        uint32_t heat_fan_delay;      // heater warms up before the fan starts
+        uint32_t heat_fan_overrun;    // fan keeps running after the heater stops
+        uint32_t cool_fan_prerun;     // fan runs before the cooler starts
+        uint32_t cool_fan_overrun;    // fan keeps running after the cooler stops
+        uint32_t compressor_lockout;  // cooler stays off at least this long
+} actuator_sequencer_config_t;
+
+#define ACTUATOR_SEQUENCER_CONFIG(...) \
+        (actuator_sequencer_config_t) { \
+                .heater_gpio = -1, \
+                .cooler_gpio = -1, \
+                .fan_gpio = -1, \
+                .active_high = true, \
+                __VA_ARGS__ \
+        }
+
+typedef struct {
+        uint8_t outputs;    // actuator_t mask
+        uint32_t delay;     // wait before applying, in milliseconds
+} actuator_step_t;
+
+typedef struct {
+        actuator_sequencer_config_t config;
+
+        thermostat_output_t target;
+        uint8_t outputs;
+        int64_t cooler_off_time;
+
+        actuator_step_t steps[ACTUATOR_SEQUENCER_MAX_STEPS];
+        int step_count;
+        int step;
+        int64_t step_deadline;
+        uint32_t generation;
+
+        esp_timer_handle_t timer;
+        SemaphoreHandle_t lock;
+        StaticSemaphore_t lock_buffer;
+} actuator_sequencer_t;
+
+// Configures the GPIOs and switches all actuators off
+int actuator_sequencer_init(actuator_sequencer_t *sequencer, actuator_sequencer_config_t config);
+
+// Start the sequence towards output, a request for the current target is ignored
+void actuator_sequencer_set(actuator_sequencer_t *sequencer, thermostat_output_t output);
+
+// actuator_t mask of the relays that are on right now
+uint8_t actuator_sequencer_outputs(actuator_sequencer_t *sequencer);
@@ -22,6 +22,8 @@
  **/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_log.h>
@@ -29,283 +31,501 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <driver/gpio.h>
 #include <sys/time.h>
+#include <time.h>
+#include <esp_sntp.h>
 
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
+#include <wifi_station.h>
+#include <diagnostics.h>
+#include <power_save.h>
+#include <status_led.h>
 #include <dht.h>
+#include <sensor_filter.h>
+#include <notify_policy.h>
 
-#if CONFIG_IDF_TARGET_ESP32
-#include "esp32/rom/ets_sys.h"  // for ETSTimer type
-#elif CONFIG_IDF_TARGET_ESP32S2
-#include "esp32s2/rom/ets_sys.h"
-#elif CONFIG_IDF_TARGET_ESP32S3
-#include "esp32s3/rom/ets_sys.h"
-#elif CONFIG_IDF_TARGET_ESP32C3
-#include "esp32c3/rom/ets_sys.h"
-#elif CONFIG_IDF_TARGET_ESP32H2
-#include "esp32h2/rom/ets_sys.h"
-#endif
+#include "thermostat_control.h"
+#include "actuator_sequencer.h"
+#include "thermostat_schedule.h"
 
 void on_wifi_ready();
 
-static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
-{
-        if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_START || event_id == WIFI_EVENT_STA_DISCONNECTED)) {
-                printf("STA start\n");
-                esp_wifi_connect();
-        } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-                printf("WiFI ready\n");
-                on_wifi_ready();
-        }
-}
-
-static void wifi_init() {
-        ESP_ERROR_CHECK(esp_netif_init());
-
-        ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
-
-        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
-        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
-
-        wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
-        ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+const int led_gpio = CONFIG_LED_GPIO;
+bool led_on = false;
 
-        wifi_config_t wifi_config = {
-                .sta = {
-                        .ssid = WIFI_SSID,
-                        .password = WIFI_PASSWORD,
-                },
-        };
+#define ZONE_COUNT CONFIG_THERMOSTAT_ZONE_COUNT
 
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
+#define TEMPERATURE_POLL_PERIOD 3000
+// A failed read is retried after the minimum DHT interval instead of a full period
+#define SENSOR_RETRY_PERIOD 2000
+#define SENSOR_MAX_RETRIES 3
+// Notify on 0.1C / 1%RH changes, at most every 10s, at least every 5 minutes
+#define TEMPERATURE_NOTIFY_POLICY NOTIFY_POLICY_CONFIG(.min_delta = 0.1, .min_interval = 10000, .max_interval = 300000)
+#define HUMIDITY_NOTIFY_POLICY NOTIFY_POLICY_CONFIG(.min_delta = 1, .min_interval = 10000, .max_interval = 300000)
+#define HEATER_FAN_DELAY 30000
+#define HEATER_FAN_OVERRUN 60000
+#define COOLER_FAN_PRERUN 0
+#define COOLER_FAN_OVERRUN 0
+#define COMPRESSOR_LOCKOUT 180000
+
+// Hysteresis control, set CONTROL_KP > 0 for time-proportioned PI(D) control.
+// Tune with tools/thermostat_sim.c.
+#define CONTROL_HYSTERESIS 0.5
+#define CONTROL_MIN_ON_TIME 180000
+#define CONTROL_MIN_OFF_TIME 300000
+#define CONTROL_KP 0
+#define CONTROL_KI 0
+#define CONTROL_KD 0
+#define CONTROL_CYCLE_TIME 900000
+
+// Times before this mean SNTP has not synced yet (2022-01-01)
+#define SCHEDULE_MIN_VALID_TIME 1640995200
+
+#define SCHEDULE_WORKDAY { \
+        THERMOSTAT_SCHEDULE_ENTRY(6, 30, 21, 25), \
+        THERMOSTAT_SCHEDULE_ENTRY(8, 30, 17, 28), \
+        THERMOSTAT_SCHEDULE_ENTRY(17, 0, 21, 25), \
+        THERMOSTAT_SCHEDULE_ENTRY(22, 30, 16, 28), \
+}
+#define SCHEDULE_WEEKEND { \
+        THERMOSTAT_SCHEDULE_ENTRY(8, 0, 21, 25), \
+        THERMOSTAT_SCHEDULE_ENTRY(23, 0, 16, 28), \
+        THERMOSTAT_SCHEDULE_END, \
+        THERMOSTAT_SCHEDULE_END, \
 }
 
-const int led_gpio = CONFIG_LED_GPIO;
-bool led_on = false;
-const int temperature_sensor_gpio = 4;
-const int fan_gpio = 14;
-const int cooler_gpio = 12;
-const int heater_gpio = 13;
+// Used until a schedule is stored in NVS
+const thermostat_week_t default_schedule = {
+        .day = {
+                SCHEDULE_WEEKEND,
+                SCHEDULE_WORKDAY,
+                SCHEDULE_WORKDAY,
+                SCHEDULE_WORKDAY,
+                SCHEDULE_WORKDAY,
+                SCHEDULE_WORKDAY,
+                SCHEDULE_WEEKEND,
+        },
+};
 
-#define TEMPERATURE_POLL_PERIOD 10000
-#define HEATER_FAN_DELAY 30000
-#define COOLER_FAN_DELAY 0
+#if CONFIG_THERMOSTAT_SCHEDULE
+// The week of a zone as the raw thermostat_week_t, 3 bytes per entry
+#define HOMEKIT_CHARACTERISTIC_CUSTOM_SCHEDULE HOMEKIT_CUSTOM_UUID("F0000010")
+#define HOMEKIT_DECLARE_CHARACTERISTIC_CUSTOM_SCHEDULE(...) \
+        .type = HOMEKIT_CHARACTERISTIC_CUSTOM_SCHEDULE, \
+        .description = "Schedule", \
+        .format = homekit_format_data, \
+        .permissions = homekit_permissions_paired_read \
+                       | homekit_permissions_paired_write, \
+        .value = HOMEKIT_DATA_(NULL, 0), \
+        ##__VA_ARGS__
+#endif
 
 void led_write(bool on) {
-        gpio_set_level(led_gpio, on ? 1 : 0);
+        status_led_set(on);
 }
 
 void led_init() {
-        gpio_set_direction(led_gpio, GPIO_MODE_OUTPUT);
+        status_led_init(led_gpio, true);
         led_write(led_on);
 }
 
-void sensor_identify_task(void *_args) {
-        for (int i=0; i<3; i++) {
-                for (int j=0; j<2; j++) {
-                        led_write(true);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                        led_write(false);
-                        vTaskDelay(100 / portTICK_PERIOD_MS);
-                }
-
-                vTaskDelay(250 / portTICK_PERIOD_MS);
-        }
-
-        led_write(false);
-
-        vTaskDelete(NULL);
-}
-
 void led_identify(homekit_value_t _value) {
         printf("LED identify\n");
-        xTaskCreate(sensor_identify_task, "LED identify", 512, NULL, 2, NULL);
+        status_led_signal(&status_led_identify);
 }
 
 void thermostat_identify(homekit_value_t _value) {
         printf("Thermostat identify\n");
 }
 
-ETSTimer fan_timer;
+// Everything one zone owns: its sensor, relays, HomeKit services and
+// controller state. All zones are served by a single scheduler task.
+typedef struct {
+        int sensor_gpio;
+        int heater_gpio;
+        int cooler_gpio;
+        int fan_gpio;
+
+        homekit_characteristic_t name;
+        homekit_characteristic_t current_temperature;
+        homekit_characteristic_t target_temperature;
+        homekit_characteristic_t units;
+        homekit_characteristic_t current_state;
+        homekit_characteristic_t target_state;
+        homekit_characteristic_t cooling_threshold;
+        homekit_characteristic_t heating_threshold;
+        homekit_characteristic_t humidity_name;
+        homekit_characteristic_t current_humidity;
+        homekit_service_t thermostat_service;
+        homekit_service_t humidity_service;
+
+        thermostat_control_t control;
+        actuator_sequencer_t actuators;
+        sensor_filter_t temperature_filter;
+        sensor_filter_t humidity_filter;
+        notify_policy_t temperature_policy;
+        notify_policy_t humidity_policy;
+#if CONFIG_THERMOSTAT_SCHEDULE
+        thermostat_schedule_t schedule;
+        homekit_characteristic_t schedule_data;
+#endif
+
+        int failures;
+        uint32_t next_sample;
+        // Set by on_update, the thermostat task then runs update_state()
+        volatile bool update_pending;
+} thermostat_zone_t;
+
+void on_update(homekit_characteristic_t *ch, homekit_value_t value, void *context);
+
+#if CONFIG_THERMOSTAT_SCHEDULE
+homekit_value_t zone_schedule_get(const homekit_characteristic_t *ch);
+void zone_schedule_set(homekit_characteristic_t *ch, homekit_value_t value);
+
+#define ZONE_SCHEDULE(i) \
+        .schedule_data = HOMEKIT_CHARACTERISTIC_(CUSTOM_SCHEDULE, \
+                .getter_ex = zone_schedule_get, \
+                .setter_ex = zone_schedule_set, \
+                .context = &zones[i]),
+#define ZONE_SCHEDULE_CHARACTERISTIC(i) &zones[i].schedule_data,
+#else
+#define ZONE_SCHEDULE(i)
+#define ZONE_SCHEDULE_CHARACTERISTIC(i)
+#endif
+
+#define THERMOSTAT_ZONE(i, _name, _sensor_gpio, _heater_gpio, _cooler_gpio, _fan_gpio) \
+        [i] = { \
+                .sensor_gpio = _sensor_gpio, \
+                .heater_gpio = _heater_gpio, \
+                .cooler_gpio = _cooler_gpio, \
+                .fan_gpio = _fan_gpio, \
+                .name = HOMEKIT_CHARACTERISTIC_(NAME, _name), \
+                .current_temperature = HOMEKIT_CHARACTERISTIC_(CURRENT_TEMPERATURE, 0), \
+                .target_temperature = HOMEKIT_CHARACTERISTIC_(TARGET_TEMPERATURE, 22, \
+                        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=&zones[i])), \
+                .units = HOMEKIT_CHARACTERISTIC_(TEMPERATURE_DISPLAY_UNITS, 0), \
+                .current_state = HOMEKIT_CHARACTERISTIC_(CURRENT_HEATING_COOLING_STATE, 0), \
+                .target_state = HOMEKIT_CHARACTERISTIC_(TARGET_HEATING_COOLING_STATE, 0, \
+                        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=&zones[i])), \
+                .cooling_threshold = HOMEKIT_CHARACTERISTIC_(COOLING_THRESHOLD_TEMPERATURE, 25, \
+                        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=&zones[i])), \
+                .heating_threshold = HOMEKIT_CHARACTERISTIC_(HEATING_THRESHOLD_TEMPERATURE, 15, \
+                        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=&zones[i])), \
+                .humidity_name = HOMEKIT_CHARACTERISTIC_(NAME, _name " Humidity"), \
+                .current_humidity = HOMEKIT_CHARACTERISTIC_(CURRENT_RELATIVE_HUMIDITY, 0), \
+                ZONE_SCHEDULE(i) \
+                .thermostat_service = HOMEKIT_SERVICE_(THERMOSTAT, .primary=(i == 0), .characteristics=(homekit_characteristic_t*[]) { \
+                        &zones[i].name, \
+                        &zones[i].current_state, \
+                        &zones[i].target_state, \
+                        &zones[i].current_temperature, \
+                        &zones[i].target_temperature, \
+                        &zones[i].units, \
+                        &zones[i].cooling_threshold, \
+                        &zones[i].heating_threshold, \
+                        ZONE_SCHEDULE_CHARACTERISTIC(i) \
+                        NULL \
+                }), \
+                .humidity_service = HOMEKIT_SERVICE_(HUMIDITY_SENSOR, .characteristics=(homekit_characteristic_t*[]) { \
+                        &zones[i].humidity_name, \
+                        &zones[i].current_humidity, \
+                        NULL \
+                }), \
+        }
 
-void heaterOn() {
-        gpio_set_level(heater_gpio, false);
+// Relays are active low
+thermostat_zone_t zones[ZONE_COUNT] = {
+        //                  name            sensor heater cooler fan
+        THERMOSTAT_ZONE(0, "Thermostat",    4,     13,    12,    14),
+#if ZONE_COUNT > 1
+        THERMOSTAT_ZONE(1, "Thermostat 2",  16,    25,    26,    27),
+#endif
+#if ZONE_COUNT > 2
+        THERMOSTAT_ZONE(2, "Thermostat 3",  17,    32,    33,    23),
+#endif
+};
+
+void update_state(thermostat_zone_t *zone) {
+        // No control before the first filtered temperature
+        if (!sensor_filter_valid(&zone->temperature_filter)) {
+                return;
+        }
+
+        int state = zone->target_state.value.int_value;
+        float heat_setpoint = (state == 3) ? zone->heating_threshold.value.float_value : zone->target_temperature.value.float_value;
+        float cool_setpoint = (state == 3) ? zone->cooling_threshold.value.float_value : zone->target_temperature.value.float_value;
+
+        thermostat_output_t output = thermostat_control_update(
+                &zone->control, state, zone->current_temperature.value.float_value,
+                heat_setpoint, cool_setpoint, xTaskGetTickCount() * portTICK_PERIOD_MS
+                );
+        if (zone->current_state.value.int_value == output) {
+                return;
+        }
+
+        zone->current_state.value = HOMEKIT_UINT8(output);
+        homekit_characteristic_notify(&zone->current_state, zone->current_state.value);
+
+        actuator_sequencer_set(&zone->actuators, output);
 }
 
-void heaterOff() {
-        gpio_set_level(heater_gpio, true);
+TaskHandle_t thermostat_task_handle;
+
+// Runs in the HomeKit server task. The controller state and the current
+// state are only touched by the thermostat task, so hand the update over.
+void on_update(homekit_characteristic_t *ch, homekit_value_t value, void *context) {
+        thermostat_zone_t *zone = context;
+        zone->update_pending = true;
+        if (thermostat_task_handle) {
+                xTaskNotifyGive(thermostat_task_handle);
+        }
 }
 
-void coolerOn() {
-        gpio_set_level(cooler_gpio, false);
+#if CONFIG_THERMOSTAT_SCHEDULE
+// Serializes writes of a week over HomeKit with the thermostat task
+SemaphoreHandle_t schedule_lock;
+
+void zone_schedule_key(thermostat_zone_t *zone, char *key, size_t size) {
+        snprintf(key, size, "zone%d", (int)(zone - zones));
 }
 
-void coolerOff() {
-        gpio_set_level(cooler_gpio, true);
+homekit_value_t zone_schedule_get(const homekit_characteristic_t *ch) {
+        thermostat_zone_t *zone = ch->context;
+        return HOMEKIT_DATA((uint8_t*) &zone->schedule.week, sizeof(zone->schedule.week));
 }
 
-void fan_alarm(void *arg) {
-        gpio_set_level(fan_gpio, false);
+void zone_schedule_set(homekit_characteristic_t *ch, homekit_value_t value) {
+        thermostat_zone_t *zone = ch->context;
+        if (value.format != homekit_format_data || value.data_size != sizeof(thermostat_week_t)) {
+                printf("%s: Invalid schedule size\n", zone->name.value.string_value);
+                return;
+        }
+
+        thermostat_week_t week;
+        memcpy(&week, value.data_value, sizeof(week));
+
+        char key[8];
+        zone_schedule_key(zone, key, sizeof(key));
+        xSemaphoreTake(schedule_lock, portMAX_DELAY);
+        thermostat_schedule_set(&zone->schedule, key, &week);
+        xSemaphoreGive(schedule_lock);
 }
 
-void fanOn(uint16_t delay) {
-        if (delay > 0) {
-                ets_timer_arm(&fan_timer, delay, false);
-        } else {
-                gpio_set_level(fan_gpio, false);
+// Clamped to the characteristic's range, e.g. 0-25C for the heating threshold
+void zone_set_temperature(homekit_characteristic_t *ch, float value) {
+        if (ch->min_value && value < *ch->min_value) {
+                value = *ch->min_value;
+        }
+        if (ch->max_value && value > *ch->max_value) {
+                value = *ch->max_value;
+        }
+        if (ch->value.float_value != value) {
+                ch->value = HOMEKIT_FLOAT(value);
+                homekit_characteristic_notify(ch, ch->value);
         }
 }
 
-void fanOff() {
-        ets_timer_disarm(&fan_timer);
-        gpio_set_level(fan_gpio, true);
+// Applies the schedule entry that became active, setpoints changed through
+// HomeKit since then stay until the next entry starts
+void zone_schedule(thermostat_zone_t *zone, uint32_t now) {
+        thermostat_schedule_learn(&zone->schedule, zone->current_state.value.int_value == thermostat_output_heat,
+                                  zone->current_temperature.value.float_value, now);
+
+        time_t current_time = time(NULL);
+        if (current_time < SCHEDULE_MIN_VALID_TIME) {
+                return;
+        }
+
+        struct tm local_time;
+        localtime_r(&current_time, &local_time);
+
+        thermostat_setpoints_t setpoints;
+        xSemaphoreTake(schedule_lock, portMAX_DELAY);
+        bool changed = thermostat_schedule_evaluate(&zone->schedule, &local_time,
+                                                    zone->current_temperature.value.float_value, &setpoints);
+        xSemaphoreGive(schedule_lock);
+        if (!changed) {
+                return;
+        }
+
+        printf("%s: Schedule heat %.1fC cool %.1fC%s\n", zone->name.value.string_value,
+               setpoints.heat, setpoints.cool, setpoints.preheat ? " (pre-heat)" : "");
+
+        float target = (zone->target_state.value.int_value == thermostat_mode_cool) ? setpoints.cool : setpoints.heat;
+        zone_set_temperature(&zone->target_temperature, target);
+        zone_set_temperature(&zone->heating_threshold, setpoints.heat);
+        zone_set_temperature(&zone->cooling_threshold, setpoints.cool);
 }
 
-void update_state();
+void schedule_init() {
+        setenv("TZ", CONFIG_THERMOSTAT_TIMEZONE, 1);
+        tzset();
 
-void on_update(homekit_characteristic_t *ch, homekit_value_t value, void *context) {
-        update_state();
+        sntp_setoperatingmode(SNTP_OPMODE_POLL);
+        sntp_setservername(0, CONFIG_THERMOSTAT_NTP_SERVER);
+        sntp_init();
 }
+#endif
 
-#define DEVICE_NAME "Thermostat"
-#define DEVICE_MANUFACTURER "StudioPieters®"
-#define DEVICE_SERIAL "NLDA4SQN1466"
-#define DEVICE_MODEL "SD466NL/A"
-#define FW_VERSION "0.0.1"
+void zone_sample(thermostat_zone_t *zone, uint32_t now) {
+        float humidity_value, temperature_value;
 
-homekit_characteristic_t name = HOMEKIT_CHARACTERISTIC_(NAME, DEVICE_NAME);
-homekit_characteristic_t manufacturer = HOMEKIT_CHARACTERISTIC_(MANUFACTURER,  DEVICE_MANUFACTURER);
-homekit_characteristic_t serial = HOMEKIT_CHARACTERISTIC_(SERIAL_NUMBER, DEVICE_SERIAL);
-homekit_characteristic_t model= HOMEKIT_CHARACTERISTIC_(MODEL, DEVICE_MODEL);
-homekit_characteristic_t revision = HOMEKIT_CHARACTERISTIC_(FIRMWARE_REVISION,  FW_VERSION);
-homekit_characteristic_t current_temperature = HOMEKIT_CHARACTERISTIC_( CURRENT_TEMPERATURE, 0);
-homekit_characteristic_t target_temperature  = HOMEKIT_CHARACTERISTIC_(TARGET_TEMPERATURE, 22, .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update));
-homekit_characteristic_t units = HOMEKIT_CHARACTERISTIC_(TEMPERATURE_DISPLAY_UNITS, 0);
-homekit_characteristic_t current_state = HOMEKIT_CHARACTERISTIC_(CURRENT_HEATING_COOLING_STATE, 0);
-homekit_characteristic_t target_state = HOMEKIT_CHARACTERISTIC_(TARGET_HEATING_COOLING_STATE, 0, .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update));
-homekit_characteristic_t cooling_threshold = HOMEKIT_CHARACTERISTIC_(COOLING_THRESHOLD_TEMPERATURE, 25, .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update));
-homekit_characteristic_t heating_threshold = HOMEKIT_CHARACTERISTIC_(HEATING_THRESHOLD_TEMPERATURE, 15, .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update));
-homekit_characteristic_t current_humidity = HOMEKIT_CHARACTERISTIC_(CURRENT_RELATIVE_HUMIDITY, 0);
-
-void update_state() {
-        int state = target_state.value.int_value;
-        if ((state == 1 && current_temperature.value.float_value < target_temperature.value.float_value) ||
-            (state == 3 && current_temperature.value.float_value < heating_threshold.value.float_value)) {
-                if (current_state.value.int_value != 1) {
-                        current_state.value = HOMEKIT_UINT8(1);
-                        homekit_characteristic_notify(&current_state, current_state.value);
-
-                        heaterOn();
-                        coolerOff();
-                        fanOff();
-                        fanOn(HEATER_FAN_DELAY);
-                }
-        } else if ((state == 2 && current_temperature.value.float_value > target_temperature.value.float_value) ||
-                   (state == 3 && current_temperature.value.float_value > cooling_threshold.value.float_value)) {
-                if (current_state.value.int_value != 2) {
-                        current_state.value = HOMEKIT_UINT8(2);
-                        homekit_characteristic_notify(&current_state, current_state.value);
-
-                        coolerOn();
-                        heaterOff();
-                        fanOff();
-                        fanOn(COOLER_FAN_DELAY);
+        // DHT_TYPE_AM2301 == AM2301 (DHT21, DHT22, AM2302, AM2321)
+        bool success = (dht_read_float_data(DHT_TYPE_AM2301, zone->sensor_gpio, &humidity_value, &temperature_value) == ESP_OK);
+        if (success) {
+                zone->failures = 0;
+                zone->next_sample = now + TEMPERATURE_POLL_PERIOD;
+                float temperature = sensor_filter_add(&zone->temperature_filter, temperature_value);
+                float humidity = sensor_filter_add(&zone->humidity_filter, humidity_value);
+                if (!sensor_filter_valid(&zone->temperature_filter)) {
+                        // Fill the window at the fastest rate the sensor allows
+                        zone->next_sample = now + SENSOR_RETRY_PERIOD;
+                        printf("%s: Filling filter (raw %.1f%% %.1fC)\n", zone->name.value.string_value,
+                               humidity_value, temperature_value);
+                        return;
                 }
+                notify_policy_update(&zone->temperature_policy, &zone->current_temperature, HOMEKIT_FLOAT(temperature));
+                notify_policy_update(&zone->humidity_policy, &zone->current_humidity, HOMEKIT_FLOAT(humidity));
+                printf("%s: Humidity: %.1f%% Temp: %.1fC (raw %.1f%% %.1fC, %u notifications suppressed)\n",
+                       zone->name.value.string_value,
+                       zone->current_humidity.value.float_value, zone->current_temperature.value.float_value,
+                       humidity_value, temperature_value, notify_policy_total_suppressed());
+
+#if CONFIG_THERMOSTAT_SCHEDULE
+                zone_schedule(zone, now);
+#endif
+                update_state(zone);
         } else {
-                if (current_state.value.int_value != 0) {
-                        current_state.value = HOMEKIT_UINT8(0);
-                        homekit_characteristic_notify(&current_state, current_state.value);
-
-                        coolerOff();
-                        heaterOff();
-                        fanOff();
+                printf("%s: Couldnt read data from sensor\n", zone->name.value.string_value);
+                if (++zone->failures <= SENSOR_MAX_RETRIES) {
+                        zone->next_sample = now + SENSOR_RETRY_PERIOD;
+                } else {
+                        zone->failures = 0;
+                        zone->next_sample = now + TEMPERATURE_POLL_PERIOD;
                 }
         }
 }
 
-void temperature_sensor_task(void *_args) {
-        ets_timer_setfn(&fan_timer, fan_alarm, NULL);
-
-        gpio_set_pull_mode(temperature_sensor_gpio, GPIO_PULLUP_ONLY);
-        gpio_set_direction(fan_gpio, GPIO_MODE_OUTPUT);
-        gpio_set_direction(heater_gpio, GPIO_MODE_OUTPUT);
-        gpio_set_direction(cooler_gpio, GPIO_MODE_OUTPUT);
-
-        fanOff();
-        heaterOff();
-        coolerOff();
-
-        float humidity_value, temperature_value;
-
+// Samples the zone that is due first, zones start staggered over one poll
+// period so the reads spread out evenly. Woken early by on_update.
+void thermostat_task(void *_args) {
         while (1) {
-                // DHT_TYPE_AM2301 == AM2301 (DHT21, DHT22, AM2302, AM2321)
-                bool success = (dht_read_float_data(DHT_TYPE_AM2301, temperature_sensor_gpio, &humidity_value, &temperature_value) == ESP_OK);
-                if (success) {
-                        current_temperature.value = HOMEKIT_FLOAT(temperature_value);
-                        current_humidity.value = HOMEKIT_FLOAT(humidity_value);
-                        printf("Humidity: %.1f%% Temp: %.1fC\n", humidity_value, temperature_value);
+                for (int i=0; i < ZONE_COUNT; i++) {
+                        if (zones[i].update_pending) {
+                                zones[i].update_pending = false;
+                                update_state(&zones[i]);
+                        }
+                }
 
-                        homekit_characteristic_notify(&current_temperature, current_temperature.value);
-                        homekit_characteristic_notify(&current_humidity, current_humidity.value);
+                uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+                thermostat_zone_t *zone = &zones[0];
+                for (int i=1; i < ZONE_COUNT; i++) {
+                        if ((int32_t)(zones[i].next_sample - zone->next_sample) < 0) {
+                                zone = &zones[i];
+                        }
+                }
 
-                        update_state();
-                } else {
-                        printf("Couldnt read data from sensor\n");
+                int32_t wait = zone->next_sample - now;
+                if (wait > 0) {
+                        if (ulTaskNotifyTake(pdTRUE, wait / portTICK_PERIOD_MS)) {
+                                continue;
+                        }
+                        now = xTaskGetTickCount() * portTICK_PERIOD_MS;
                 }
 
-                vTaskDelay(TEMPERATURE_POLL_PERIOD / portTICK_PERIOD_MS);
+                zone_sample(zone, now);
         }
 }
 
+void zone_init(thermostat_zone_t *zone, uint32_t now) {
+        gpio_set_pull_mode(zone->sensor_gpio, GPIO_PULLUP_ONLY);
+
+        thermostat_control_init(&zone->control, THERMOSTAT_CONTROL_CONFIG(
+                                        .hysteresis = CONTROL_HYSTERESIS,
+                                        .min_on_time = CONTROL_MIN_ON_TIME,
+                                        .min_off_time = CONTROL_MIN_OFF_TIME,
+                                        .kp = CONTROL_KP,
+                                        .ki = CONTROL_KI,
+                                        .kd = CONTROL_KD,
+                                        .cycle_time = CONTROL_CYCLE_TIME,
+                                        ), now);
+        actuator_sequencer_init(&zone->actuators, ACTUATOR_SEQUENCER_CONFIG(
+                                        .heater_gpio = zone->heater_gpio,
+                                        .cooler_gpio = zone->cooler_gpio,
+                                        .fan_gpio = zone->fan_gpio,
+                                        .active_high = false,
+                                        .heat_fan_delay = HEATER_FAN_DELAY,
+                                        .heat_fan_overrun = HEATER_FAN_OVERRUN,
+                                        .cool_fan_prerun = COOLER_FAN_PRERUN,
+                                        .cool_fan_overrun = COOLER_FAN_OVERRUN,
+                                        .compressor_lockout = COMPRESSOR_LOCKOUT,
+                                        ));
+        sensor_filter_init(&zone->temperature_filter, SENSOR_FILTER_CONFIG());
+        sensor_filter_init(&zone->humidity_filter, SENSOR_FILTER_CONFIG());
+        notify_policy_init(&zone->temperature_policy, TEMPERATURE_NOTIFY_POLICY);
+        notify_policy_init(&zone->humidity_policy, HUMIDITY_NOTIFY_POLICY);
+#if CONFIG_THERMOSTAT_SCHEDULE
+        char key[8];
+        zone_schedule_key(zone, key, sizeof(key));
+        thermostat_schedule_init(&zone->schedule, key, &default_schedule, CONFIG_THERMOSTAT_MAX_PREHEAT);
+#endif
+}
+
 void thermostat_init() {
-        xTaskCreate(temperature_sensor_task, "Thermostat", 256, NULL, 2, NULL);
+        uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+#if CONFIG_THERMOSTAT_SCHEDULE
+        schedule_lock = xSemaphoreCreateMutex();
+#endif
+        for (int i=0; i < ZONE_COUNT; i++) {
+                zone_init(&zones[i], now);
+                zones[i].next_sample = now + i * TEMPERATURE_POLL_PERIOD / ZONE_COUNT;
+        }
+        xTaskCreate(thermostat_task, "Thermostat", 3072, NULL, 2, &thermostat_task_handle);
 }
 
+#define DEVICE_NAME "Thermostat"
+#define DEVICE_MANUFACTURER "StudioPieters®"
+#define DEVICE_SERIAL "NLDA4SQN1466"
+#define DEVICE_MODEL "SD466NL/A"
+#define FW_VERSION "0.0.1"
 
-homekit_accessory_t *accessories[] = {
-        HOMEKIT_ACCESSORY(.id=1, .category=homekit_accessory_category_sensor, .services=(homekit_service_t*[]){
-                HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
-                        &name,
-                        &manufacturer,
-                        &serial,
-                        &model,
-                        &revision,
-                        HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
-                        NULL
-                }),
-                HOMEKIT_SERVICE(THERMOSTAT, .primary=true, .characteristics=(homekit_characteristic_t*[]) {
-                        HOMEKIT_CHARACTERISTIC(NAME, "Thermostat"),
-                        &current_state,
-                        &target_state,
-                        &target_temperature,
-                        &units,
-                        &cooling_threshold,
-                        &heating_threshold,
-                        NULL
-                }),
-                HOMEKIT_SERVICE(HUMIDITY_SENSOR, .characteristics=(homekit_characteristic_t*[]) {
-                        HOMEKIT_CHARACTERISTIC(NAME, "Humidity Sensor"),
-                        &current_humidity,
-                        NULL
-                }),
-                HOMEKIT_SERVICE(TEMPERATURE_SENSOR, .characteristics=(homekit_characteristic_t*[]) {
-                        HOMEKIT_CHARACTERISTIC(NAME, "Humidity Sensor"),
-                        &current_temperature,
-                        NULL
-                }),
+homekit_characteristic_t name = HOMEKIT_CHARACTERISTIC_(NAME, DEVICE_NAME);
+homekit_characteristic_t manufacturer = HOMEKIT_CHARACTERISTIC_(MANUFACTURER,  DEVICE_MANUFACTURER);
+homekit_characteristic_t serial = HOMEKIT_CHARACTERISTIC_(SERIAL_NUMBER, DEVICE_SERIAL);
+homekit_characteristic_t model= HOMEKIT_CHARACTERISTIC_(MODEL, DEVICE_MODEL);
+homekit_characteristic_t revision = HOMEKIT_CHARACTERISTIC_(FIRMWARE_REVISION,  FW_VERSION);
+
+// Accessory information, two services per zone, diagnostics and NULL
+homekit_service_t *services[1 + 2 * ZONE_COUNT + 2] = {
+        HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
+                &name,
+                &manufacturer,
+                &serial,
+                &model,
+                &revision,
+                HOMEKIT_CHARACTERISTIC(IDENTIFY, led_identify),
                 NULL
         }),
-        NULL
 };
 
+homekit_accessory_t *accessories[] = {
+        HOMEKIT_ACCESSORY(.id=1, .category=homekit_accessory_category_sensor, .services=services),
+        NULL
+};
 
+void init_accessory() {
+        homekit_service_t **s = services + 1;
+        for (int i=0; i < ZONE_COUNT; i++) {
+                *(s++) = &zones[i].thermostat_service;
+                *(s++) = &zones[i].humidity_service;
+        }
+        *(s++) = DIAGNOSTICS_SERVICE;
+        *(s++) = NULL;
+}
 
 homekit_server_config_t config = {
         .accessories = accessories,
@@ -314,7 +534,12 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+        boot_timeline_mark("wifi_ready");
         homekit_server_init(&config);
+#if CONFIG_THERMOSTAT_SCHEDULE
+        schedule_init();
+#endif
+        boot_timeline_ready();
 }
 
 void app_main(void) {
@@ -325,8 +550,13 @@ void app_main(void) {
                 ret = nvs_flash_init();
         }
         ESP_ERROR_CHECK( ret );
+        boot_timeline_mark("nvs");
 
-        wifi_init();
+        init_accessory();
+        wifi_station_init(WIFI_SSID, WIFI_PASSWORD, on_wifi_ready);
+        power_save_init_profile();
+        boot_timeline_mark("wifi_init");
         led_init();
         thermostat_init();
+        boot_timeline_mark("peripherals");
 }
@@ -0,0 +1,169 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "thermostat_control.h"
+
+void thermostat_control_init(thermostat_control_t *control, thermostat_control_config_t config, uint32_t now) {
+        memset(control, 0, sizeof(*control));
+        control->config = config;
+        control->output = thermostat_output_off;
+        // Allow the first start right away
+        control->output_changed = now - config.min_off_time;
+        control->previous_time = now;
+        control->cycle_start = now;
+}
+
+static thermostat_output_t hysteresis_demand(thermostat_control_t *control, thermostat_mode_t mode,
+                                             float temperature, float heat_setpoint, float cool_setpoint) {
+        float band = control->config.hysteresis;
+        bool can_heat = (mode == thermostat_mode_heat || mode == thermostat_mode_auto);
+        bool can_cool = (mode == thermostat_mode_cool || mode == thermostat_mode_auto);
+
+        switch (control->output) {
+        case thermostat_output_heat:
+                if (can_heat && temperature < heat_setpoint + band) {
+                        return thermostat_output_heat;
+                }
+                break;
+        case thermostat_output_cool:
+                if (can_cool && temperature > cool_setpoint - band) {
+                        return thermostat_output_cool;
+                }
+                break;
+        default:
+                break;
+        }
+
+        if (can_heat && temperature < heat_setpoint - band) {
+                return thermostat_output_heat;
+        }
+        if (can_cool && temperature > cool_setpoint + band) {
+                return thermostat_output_cool;
+        }
+        return thermostat_output_off;
+}
+
+static thermostat_output_t pid_demand(thermostat_control_t *control, thermostat_mode_t mode,
+                                      float temperature, float heat_setpoint, float cool_setpoint,
+                                      uint32_t now) {
+        thermostat_control_config_t *config = &control->config;
+
+        thermostat_output_t direction = thermostat_output_off;
+        if (mode == thermostat_mode_heat) {
+                direction = thermostat_output_heat;
+        } else if (mode == thermostat_mode_cool) {
+                direction = thermostat_output_cool;
+        } else if (mode == thermostat_mode_auto) {
+                direction = (temperature < (heat_setpoint + cool_setpoint) / 2) ?
+                            thermostat_output_heat : thermostat_output_cool;
+        }
+
+        // Error is positive when the output in this direction is needed
+        float error = (direction == thermostat_output_heat) ?
+                      heat_setpoint - temperature : temperature - cool_setpoint;
+
+        if (direction != control->direction) {
+                control->direction = direction;
+                control->integral = 0;
+                control->previous_error = error;
+        }
+        if (direction == thermostat_output_off) {
+                control->duty = 0;
+                return thermostat_output_off;
+        }
+
+        float dt = (uint32_t)(now - control->previous_time) / 1000.0;
+        control->previous_time = now;
+
+        float derivative = 0;
+        if (dt > 0) {
+                control->integral += error * dt;
+                derivative = (error - control->previous_error) / dt;
+        }
+        control->previous_error = error;
+
+        // Anti-windup: the integral term alone never exceeds full output
+        if (config->ki > 0) {
+                float limit = 1.0 / config->ki;
+                if (control->integral > limit) {
+                        control->integral = limit;
+                } else if (control->integral < 0) {
+                        control->integral = 0;
+                }
+        }
+
+        float duty = config->kp * error + config->ki * control->integral + config->kd * derivative;
+        if (duty < 0) {
+                duty = 0;
+        } else if (duty > 1) {
+                duty = 1;
+        }
+        control->duty = duty;
+
+        // Time-proportioned output, pulses shorter than the minimum on or
+        // off time are rounded away
+        if ((uint32_t)(now - control->cycle_start) >= config->cycle_time) {
+                control->cycle_start = now;
+        }
+        uint32_t on_time = duty * config->cycle_time;
+        if (on_time < config->min_on_time) {
+                on_time = 0;
+        } else if (config->cycle_time - on_time < config->min_off_time) {
+                on_time = config->cycle_time;
+        }
+
+        return ((uint32_t)(now - control->cycle_start) < on_time) ? direction : thermostat_output_off;
+}
+
+thermostat_output_t thermostat_control_update(thermostat_control_t *control, thermostat_mode_t mode,
+                                              float temperature, float heat_setpoint, float cool_setpoint,
+                                              uint32_t now) {
+        thermostat_output_t demand;
+        if (control->config.kp > 0) {
+                demand = pid_demand(control, mode, temperature, heat_setpoint, cool_setpoint, now);
+        } else {
+                demand = hysteresis_demand(control, mode, temperature, heat_setpoint, cool_setpoint);
+        }
+
+        if (demand == control->output) {
+                return control->output;
+        }
+
+        // Turning off is always allowed when the mode is off
+        uint32_t elapsed = now - control->output_changed;
+        if (control->output != thermostat_output_off) {
+                if (mode != thermostat_mode_off && elapsed < control->config.min_on_time) {
+                        return control->output;
+                }
+                // Heat and cool never swap directly, rest in off first
+                demand = thermostat_output_off;
+        } else if (elapsed < control->config.min_off_time) {
+                return control->output;
+        }
+
+        control->output = demand;
+        control->output_changed = now;
+
+        return control->output;
+}
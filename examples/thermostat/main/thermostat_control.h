@@ -0,0 +1,90 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdint.h>
+
+// Heating/cooling decision for one thermostat, independent of the hardware
+// so it can be driven by the simulator in tools/ as well.
+//
+// In hysteresis mode the output switches when the temperature leaves a band
+// of +/- hysteresis around the setpoint. With kp > 0 a PI(D) controller
+// computes a duty cycle which is time-proportioned over cycle_time.
+// Minimum on and off times are enforced in both modes.
+
+// Same values as TARGET_HEATING_COOLING_STATE
+typedef enum {
+        thermostat_mode_off = 0,
+        thermostat_mode_heat = 1,
+        thermostat_mode_cool = 2,
+        thermostat_mode_auto = 3,
+} thermostat_mode_t;
+
+// Same values as CURRENT_HEATING_COOLING_STATE
+typedef enum {
+        thermostat_output_off = 0,
+        thermostat_output_heat = 1,
+        thermostat_output_cool = 2,
+} thermostat_output_t;
+
+typedef struct {
+        float hysteresis;        // degrees C
+        // times in milliseconds
+        uint32_t min_on_time;
+        uint32_t min_off_time;
+
+        float kp;                // per degree C, 0 selects hysteresis mode
+        float ki;                // per degree C per second
+        float kd;                // per degree C per second of change
+        uint32_t cycle_time;
+} thermostat_control_config_t;
+
+#define THERMOSTAT_CONTROL_CONFIG(...) \
+        (thermostat_control_config_t) { \
+                .hysteresis = 0.5, \
+                .min_on_time = 180000, \
+                .min_off_time = 300000, \
+                .cycle_time = 900000, \
+                __VA_ARGS__ \
+        }
+
+typedef struct {
+        thermostat_control_config_t config;
+
+        thermostat_output_t output;
+        uint32_t output_changed;
+
+        // PID state
+        thermostat_output_t direction;
+        float integral;
+        float previous_error;
+        uint32_t previous_time;
+        uint32_t cycle_start;
+        float duty;
+} thermostat_control_t;
+
+void thermostat_control_init(thermostat_control_t *control, thermostat_control_config_t config, uint32_t now);
+
+// Evaluate the controller, now is a millisecond timestamp
+thermostat_output_t thermostat_control_update(thermostat_control_t *control, thermostat_mode_t mode,
+                                              float temperature, float heat_setpoint, float cool_setpoint,
+                                              uint32_t now);
@@ -0,0 +1,194 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <nvs.h>
+
+#include "thermostat_schedule.h"
+
+#define SCHEDULE_NAMESPACE "schedule"
+#define SCHEDULE_MINUTES_PER_WEEK (7 * 24 * 60)
+// Heater runs shorter than this say more about the dead time than the rate
+#define SCHEDULE_LEARN_MIN_TIME (10 * 60 * 1000)
+#define SCHEDULE_LEARN_ALPHA 0.25
+
+static bool entry_used(const thermostat_schedule_entry_t *entry) {
+        return entry->slot < THERMOSTAT_SCHEDULE_SLOTS
+               && entry->heat >= THERMOSTAT_SCHEDULE_MIN_SETPOINT * 2
+               && entry->heat <= THERMOSTAT_SCHEDULE_MAX_HEAT_SETPOINT * 2
+               && entry->cool >= THERMOSTAT_SCHEDULE_MIN_SETPOINT * 2
+               && entry->cool <= THERMOSTAT_SCHEDULE_MAX_COOL_SETPOINT * 2;
+}
+
+// A week is rejected when an entry is neither used nor ended properly,
+// which catches blobs of a different layout
+static bool week_valid(const thermostat_week_t *week) {
+        for (int day=0; day < 7; day++) {
+                for (int i=0; i < THERMOSTAT_SCHEDULE_ENTRIES; i++) {
+                        const thermostat_schedule_entry_t *entry = &week->day[day][i];
+                        if (entry->slot != THERMOSTAT_SCHEDULE_UNUSED && !entry_used(entry)) {
+                                return false;
+                        }
+                }
+        }
+        return true;
+}
+
+int thermostat_schedule_init(thermostat_schedule_t *schedule, const char *key,
+                             const thermostat_week_t *defaults, uint32_t max_preheat) {
+        memset(schedule, 0, sizeof(*schedule));
+        schedule->week = *defaults;
+        schedule->max_preheat = max_preheat;
+        schedule->active = -1;
+
+        nvs_handle_t handle;
+        if (nvs_open(SCHEDULE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+                return 0;
+        }
+
+        thermostat_week_t week;
+        size_t size = sizeof(week);
+        esp_err_t err = nvs_get_blob(handle, key, &week, &size);
+        nvs_close(handle);
+
+        if (err == ESP_OK && size == sizeof(week) && week_valid(&week)) {
+                schedule->week = week;
+        } else if (err == ESP_OK) {
+                printf("Ignoring invalid stored schedule %s\n", key);
+        } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+                printf("Ignoring stored schedule %s: %s\n", key, esp_err_to_name(err));
+        }
+        return 0;
+}
+
+int thermostat_schedule_save(thermostat_schedule_t *schedule, const char *key) {
+        nvs_handle_t handle;
+        esp_err_t err = nvs_open(SCHEDULE_NAMESPACE, NVS_READWRITE, &handle);
+        if (err == ESP_OK) {
+                err = nvs_set_blob(handle, key, &schedule->week, sizeof(schedule->week));
+                if (err == ESP_OK) {
+                        err = nvs_commit(handle);
+                }
+                nvs_close(handle);
+        }
+
+        if (err != ESP_OK) {
+                printf("Failed to save schedule %s: %s\n", key, esp_err_to_name(err));
+                return -1;
+        }
+        return 0;
+}
+
+int thermostat_schedule_set(thermostat_schedule_t *schedule, const char *key,
+                            const thermostat_week_t *week) {
+        if (!week_valid(week)) {
+                printf("Rejecting invalid schedule %s\n", key);
+                return -1;
+        }
+        schedule->week = *week;
+        schedule->active = -1;
+        return thermostat_schedule_save(schedule, key);
+}
+
+static int entry_start(int day, const thermostat_schedule_entry_t *entry) {
+        return day * 24 * 60 + entry->slot * 15;
+}
+
+bool thermostat_schedule_evaluate(thermostat_schedule_t *schedule, const struct tm *now,
+                                  float temperature, thermostat_setpoints_t *setpoints) {
+        int minute = (now->tm_wday * 24 + now->tm_hour) * 60 + now->tm_min;
+
+        // The active entry is the last one that started, wrapping back into
+        // the previous week, the next one the first that has yet to start
+        int active = -1, active_start = 0;
+        int next = -1, next_wait = 0;
+        for (int day=0; day < 7; day++) {
+                for (int i=0; i < THERMOSTAT_SCHEDULE_ENTRIES; i++) {
+                        const thermostat_schedule_entry_t *entry = &schedule->week.day[day][i];
+                        if (!entry_used(entry)) {
+                                continue;
+                        }
+
+                        int since = (minute - entry_start(day, entry) + SCHEDULE_MINUTES_PER_WEEK) % SCHEDULE_MINUTES_PER_WEEK;
+                        int wait = SCHEDULE_MINUTES_PER_WEEK - since;
+                        if (active < 0 || since < active_start) {
+                                active = day * THERMOSTAT_SCHEDULE_ENTRIES + i;
+                                active_start = since;
+                        }
+                        if (since != 0 && (next < 0 || wait < next_wait)) {
+                                next = day * THERMOSTAT_SCHEDULE_ENTRIES + i;
+                                next_wait = wait;
+                        }
+                }
+        }
+        if (active < 0) {
+                return false;
+        }
+
+        const thermostat_schedule_entry_t *entries = &schedule->week.day[0][0];
+        const thermostat_schedule_entry_t *entry = &entries[active];
+        bool preheat = false;
+        if (next >= 0 && schedule->max_preheat > 0 && schedule->heating_rate > 0) {
+                float next_heat = entries[next].heat / 2.0;
+                if (entries[next].heat > entry->heat && temperature < next_heat) {
+                        float lead = (next_heat - temperature) / schedule->heating_rate * 60;
+                        if (lead > schedule->max_preheat) {
+                                lead = schedule->max_preheat;
+                        }
+                        if (next_wait <= lead) {
+                                entry = &entries[next];
+                                preheat = true;
+                        }
+                }
+        }
+
+        if (active == schedule->active && preheat == schedule->preheat) {
+                return false;
+        }
+        schedule->active = active;
+        schedule->preheat = preheat;
+
+        setpoints->heat = entry->heat / 2.0;
+        setpoints->cool = entry->cool / 2.0;
+        setpoints->preheat = preheat;
+        return true;
+}
+
+void thermostat_schedule_learn(thermostat_schedule_t *schedule, bool heating,
+                               float temperature, uint32_t now) {
+        if (heating && !schedule->heating) {
+                schedule->heating_start = now;
+                schedule->heating_start_temperature = temperature;
+        } else if (!heating && schedule->heating) {
+                uint32_t elapsed = now - schedule->heating_start;
+                float rise = temperature - schedule->heating_start_temperature;
+                if (elapsed >= SCHEDULE_LEARN_MIN_TIME && rise > 0) {
+                        float rate = rise / (elapsed / 3600000.0);
+                        schedule->heating_rate = (schedule->heating_rate > 0)
+                                ? schedule->heating_rate + SCHEDULE_LEARN_ALPHA * (rate - schedule->heating_rate)
+                                : rate;
+                        printf("Heating rate %.2fC/h (last run %.2fC/h)\n", schedule->heating_rate, rate);
+                }
+        }
+        schedule->heating = heating;
+}
@@ -0,0 +1,105 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Weekly setpoint schedule, evaluated on the device against local time so
+// setpoints keep changing when the controller or Wi-Fi is away.
+//
+// A day holds up to THERMOSTAT_SCHEDULE_ENTRIES switch points, each taking
+// 3 bytes. The week is stored in NVS as a single blob. Optionally a switch
+// to a higher heating setpoint starts early, based on the heating rate
+// learned from previous heater runs.
+
+#define THERMOSTAT_SCHEDULE_ENTRIES 4
+#define THERMOSTAT_SCHEDULE_UNUSED 0xff
+#define THERMOSTAT_SCHEDULE_SLOTS (24 * 4)
+// Setpoint limits in degrees C, also applied to weeks written over HomeKit.
+// The maxima are those of the HAP heating and cooling threshold
+// characteristics the setpoints are written to.
+#define THERMOSTAT_SCHEDULE_MIN_SETPOINT 10
+#define THERMOSTAT_SCHEDULE_MAX_HEAT_SETPOINT 25
+#define THERMOSTAT_SCHEDULE_MAX_COOL_SETPOINT 35
+
+typedef struct {
+        uint8_t slot;    // start in 15 minute units after midnight
+        uint8_t heat;    // heating setpoint in 0.5 degree C units
+        uint8_t cool;    // cooling setpoint in 0.5 degree C units
+} thermostat_schedule_entry_t;
+
+#define THERMOSTAT_SCHEDULE_ENTRY(_hour, _minute, _heat, _cool) { \
+        .slot = (_hour) * 4 + (_minute) / 15, \
+        .heat = (_heat) * 2, \
+        .cool = (_cool) * 2, \
+}
+
+// Entries past the last used one of a day are ended with this. Entries left
+// zero-initialized are ignored as well, as are entries with setpoints
+// outside the limits above.
+#define THERMOSTAT_SCHEDULE_END { .slot = THERMOSTAT_SCHEDULE_UNUSED }
+
+// Days are numbered like tm_wday, 0 is Sunday
+typedef struct {
+        thermostat_schedule_entry_t day[7][THERMOSTAT_SCHEDULE_ENTRIES];
+} thermostat_week_t;
+
+typedef struct {
+        float heat;
+        float cool;
+        bool preheat;
+} thermostat_setpoints_t;
+
+typedef struct {
+        thermostat_week_t week;
+        uint32_t max_preheat;    // minutes, 0 disables pre-heat
+
+        float heating_rate;      // learned, degrees C per hour, 0 until known
+        bool heating;
+        uint32_t heating_start;
+        float heating_start_temperature;
+
+        int active;              // applied entry as day * ENTRIES + index, -1 before the first
+        bool preheat;
+} thermostat_schedule_t;
+
+// Loads the week stored under key, falling back to defaults
+int thermostat_schedule_init(thermostat_schedule_t *schedule, const char *key,
+                             const thermostat_week_t *defaults, uint32_t max_preheat);
+
+int thermostat_schedule_save(thermostat_schedule_t *schedule, const char *key);
+
+// Replaces the week after checking it and saves it under key. The entry
+// active at the next evaluation is applied again.
+int thermostat_schedule_set(thermostat_schedule_t *schedule, const char *key,
+                            const thermostat_week_t *week);
+
+// Returns true and fills setpoints when a different entry, or the pre-heat
+// for the next one, became active since the previous call
+bool thermostat_schedule_evaluate(thermostat_schedule_t *schedule, const struct tm *now,
+                                  float temperature, thermostat_setpoints_t *setpoints);
+
+// Feed with every sample to learn how fast the zone heats up, now in milliseconds
+void thermostat_schedule_learn(thermostat_schedule_t *schedule, bool heating,
+                               float temperature, uint32_t now);
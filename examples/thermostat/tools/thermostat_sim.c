@@ -0,0 +1,226 @@
+/** Copyright 2022 Achim Pieters | StudioPieters®
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NON INFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ **/
+
+// Host-side simulator for thermostat_control, to tune the controller
+// against a simple thermal model of a room.
+//
+//   cc -O2 -I../main -o thermostat_sim thermostat_sim.c ../main/thermostat_control.c -lm
+//   ./thermostat_sim kp=0.4 ki=0.0005 hours=48 csv=run.csv
+//
+// Parameters (key=value): mode (1 heat, 2 cool, 3 auto), setpoint, hysteresis,
+// kp, ki, kd, cycle (s), min_on (s), min_off (s), max_starts (per hour, 0 for
+// no limit), hours, poll (s), csv.
+//
+// Exits with 1 when the output ran shorter than min_on or min_off, or started
+// more than max_starts times within any hour, so it can gate a tuning change.
+//
+// The room loses heat to the outside with time constant tau_room, the
+// outside temperature swings sinusoidally over the day, and the heater or
+// cooler acts through a first-order lag (radiator or coil) so overshoot and
+// short-cycling show up as they do on a real install.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thermostat_control.h"
+
+// Enough for one start every 10s poll over an hour
+#define STARTS_WINDOW 400
+
+typedef struct {
+        float tau_room;         // s
+        float tau_emitter;      // s
+        float heat_gain;        // degrees C per second at full emitter output
+        float cool_gain;
+        float outside_mean;
+        float outside_swing;
+} thermal_model_t;
+
+int main(int argc, char **argv) {
+        thermostat_mode_t mode = thermostat_mode_heat;
+        float setpoint = 21;
+        float hours = 24;
+        float poll = 10;
+        int max_starts = 6;
+        const char *csv_path = NULL;
+
+        thermostat_control_config_t config = THERMOSTAT_CONTROL_CONFIG();
+        thermal_model_t model = {
+                .tau_room = 4 * 3600,
+                .tau_emitter = 600,
+                .heat_gain = 8.0 / 3600,
+                .cool_gain = 6.0 / 3600,
+                .outside_mean = 5,
+                .outside_swing = 5,
+        };
+
+        for (int i=1; i < argc; i++) {
+                char *value = strchr(argv[i], '=');
+                if (!value) {
+                        fprintf(stderr, "Invalid argument %s\n", argv[i]);
+                        return 1;
+                }
+                *value++ = 0;
+
+                if (!strcmp(argv[i], "mode")) mode = atoi(value);
+                else if (!strcmp(argv[i], "setpoint")) setpoint = atof(value);
+                else if (!strcmp(argv[i], "hysteresis")) config.hysteresis = atof(value);
+                else if (!strcmp(argv[i], "kp")) config.kp = atof(value);
+                else if (!strcmp(argv[i], "ki")) config.ki = atof(value);
+                else if (!strcmp(argv[i], "kd")) config.kd = atof(value);
+                else if (!strcmp(argv[i], "cycle")) config.cycle_time = atof(value) * 1000;
+                else if (!strcmp(argv[i], "min_on")) config.min_on_time = atof(value) * 1000;
+                else if (!strcmp(argv[i], "min_off")) config.min_off_time = atof(value) * 1000;
+                else if (!strcmp(argv[i], "max_starts")) max_starts = atoi(value);
+                else if (!strcmp(argv[i], "hours")) hours = atof(value);
+                else if (!strcmp(argv[i], "poll")) poll = atof(value);
+                else if (!strcmp(argv[i], "csv")) csv_path = value;
+                else {
+                        fprintf(stderr, "Unknown parameter %s\n", argv[i]);
+                        return 1;
+                }
+        }
+
+        if (mode == thermostat_mode_cool) {
+                model.outside_mean = 30;
+        }
+
+        FILE *csv = NULL;
+        if (csv_path) {
+                csv = fopen(csv_path, "w");
+                if (!csv) {
+                        perror(csv_path);
+                        return 1;
+                }
+                fprintf(csv, "time,outside,temperature,emitter,output,duty\n");
+        }
+
+        thermostat_control_t control;
+        thermostat_control_init(&control, config, 0);
+
+        const float dt = 1;  // s
+        float temperature = setpoint;
+        float emitter = 0;
+        thermostat_output_t output = thermostat_output_off;
+        thermostat_output_t last_output = output;
+
+        uint32_t starts = 0;
+        float on_seconds = 0;
+        float shortest_on = INFINITY, shortest_off = INFINITY;
+        float last_switch = 0;
+        bool switched = false;
+        // Start times of the last STARTS_WINDOW starts, for the busiest hour
+        float start_times[STARTS_WINDOW];
+        int busiest_hour = 0;
+        double error_sum = 0;
+        uint32_t error_samples = 0;
+        float low = INFINITY, high = -INFINITY;
+
+        float duration = hours * 3600;
+        for (float t = 0; t < duration; t += dt) {
+                float outside = model.outside_mean -
+                                model.outside_swing * cosf(2 * M_PI * t / 86400);
+
+                uint32_t now = t * 1000;
+                if (fmodf(t, poll) < dt) {
+                        output = thermostat_control_update(&control, mode, temperature,
+                                                           setpoint, setpoint, now);
+                }
+
+                if (output != last_output) {
+                        float period = t - last_switch;
+                        // The time before the first start is not an off cycle
+                        if (last_output == thermostat_output_off) {
+                                if (switched && period < shortest_off) shortest_off = period;
+                                start_times[starts % STARTS_WINDOW] = t;
+                                starts++;
+
+                                int in_hour = 0;
+                                for (int j=0; j < starts && j < STARTS_WINDOW; j++) {
+                                        if (t - start_times[j] < 3600) in_hour++;
+                                }
+                                if (in_hour > busiest_hour) busiest_hour = in_hour;
+                        } else if (period < shortest_on) {
+                                shortest_on = period;
+                        }
+                        last_switch = t;
+                        switched = true;
+                        last_output = output;
+                }
+                if (output != thermostat_output_off) {
+                        on_seconds += dt;
+                }
+
+                // Emitter output is positive when heating, negative when cooling
+                float drive = (output == thermostat_output_heat) ? 1 :
+                              (output == thermostat_output_cool) ? -1 : 0;
+                emitter += (drive - emitter) * dt / model.tau_emitter;
+
+                float gain = (emitter > 0) ? model.heat_gain : model.cool_gain;
+                temperature += ((outside - temperature) / model.tau_room + emitter * gain) * dt;
+
+                // Skip the warm-up before judging regulation
+                if (t > 2 * 3600) {
+                        float error = temperature - setpoint;
+                        error_sum += error * error;
+                        error_samples++;
+                        if (temperature < low) low = temperature;
+                        if (temperature > high) high = temperature;
+                }
+
+                if (csv && fmodf(t, 60) < dt) {
+                        fprintf(csv, "%.0f,%.2f,%.3f,%.3f,%d,%.3f\n",
+                                t, outside, temperature, emitter, output, control.duty);
+                }
+        }
+
+        if (csv) {
+                fclose(csv);
+        }
+
+        printf("starts:        %u (%.1f per hour, %d in the busiest hour)\n", starts, starts / hours, busiest_hour);
+        printf("duty:          %.1f%%\n", 100 * on_seconds / duration);
+        printf("shortest on:   %.0fs\n", shortest_on);
+        printf("shortest off:  %.0fs\n", shortest_off);
+        if (error_samples) {
+                printf("rms error:     %.3fC\n", sqrt(error_sum / error_samples));
+                printf("range:         %.2fC .. %.2fC\n", low, high);
+        }
+
+        int failed = 0;
+        if (shortest_on < config.min_on_time / 1000.0f) {
+                printf("FAIL: on for %.0fs, minimum on time is %.0fs\n", shortest_on, config.min_on_time / 1000.0f);
+                failed = 1;
+        }
+        if (shortest_off < config.min_off_time / 1000.0f) {
+                printf("FAIL: off for %.0fs, minimum off time is %.0fs\n", shortest_off, config.min_off_time / 1000.0f);
+                failed = 1;
+        }
+        if (max_starts > 0 && busiest_hour > max_starts) {
+                printf("FAIL: %d starts within an hour, limit is %d\n", busiest_hour, max_starts);
+                failed = 1;
+        }
+
+        return failed;
+}